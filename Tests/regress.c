@@ -0,0 +1,1201 @@
+/*
+ * Regression checks for json.c, against the fixtures of this directory.
+ *
+ * Compile with
+ *         gcc -o regress -I.. regress.c ../json.c -lm -lpthread -lrt
+ *
+ * USAGE: ./regress (from this directory)
+ *
+ * Scratch files are named temp____*, removed on success.
+ */
+
+#include "json.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CACHE_FILE "temp____cache.json"
+#define WRITE_FILE "temp____write.json"
+#define STORE_FILE "temp____store.json"
+
+static int failures;
+
+static void check(int ok, const char *what)
+{
+	printf("%s - %s\n", ok ? "ok" : "FAIL", what);
+	if (!ok)
+		failures++;
+}
+
+static char *slurp(const char *filename, size_t *length)
+{
+	FILE *input = fopen(filename, "rb");
+	char *data = NULL;
+	long size;
+
+	if (!input)
+		return NULL;
+	if (fseek(input, 0, SEEK_END) == 0 && (size = ftell(input)) >= 0
+	    && fseek(input, 0, SEEK_SET) == 0 && (data = malloc(size + 1))) {
+		*length = fread(data, 1, size, input);
+		data[*length] = '\0';
+	}
+	fclose(input);
+	return data;
+}
+
+static int spill(const char *filename, const char *data, size_t length)
+{
+	FILE *output = fopen(filename, "wb");
+	int ok;
+
+	if (!output)
+		return 0;
+	ok = fwrite(data, 1, length, output) == length;
+	return fclose(output) == 0 && ok;
+}
+
+static json_value *load(const char *filename)
+{
+	json_value *value;
+	size_t length;
+	char *text = slurp(filename, &length);
+
+	if (!text)
+		return NULL;
+	value = json_parse(text, length);
+	free(text);
+	return value;
+}
+
+struct text {
+	char *data;
+	size_t length;
+};
+
+static int text_append(void *userdata, const char *data, uint32_t length)
+{
+	struct text *text = userdata;
+	char *ptr = realloc(text->data, text->length + length + 1);
+
+	if (!ptr)
+		return ENOMEM;
+	memcpy(ptr + text->length, data, length);
+	text->data = ptr;
+	text->length += length;
+	text->data[text->length] = '\0';
+	return 0;
+}
+
+/* the canonical text of value, to be freed by the caller */
+static char *canonical(const json_value *value)
+{
+	struct text text = { NULL, 0 };
+
+	if (!value || json_value_canonical(value, text_append, &text)) {
+		free(text.data);
+		return NULL;
+	}
+	return text.data;
+}
+
+static int same_canonical(const json_value *value, const char *expected)
+{
+	char *text = canonical(value);
+	int same = text && expected && !strcmp(text, expected);
+
+	free(text);
+	return same;
+}
+
+/* runs text through a streaming parser; 0 or its error */
+static int stream(json_config *config, json_parser_callback callback, void *userdata,
+                  const char *text)
+{
+	json_parser parser;
+	int ret;
+
+	ret = json_parser_init(&parser, config, callback, userdata);
+	if (ret)
+		return ret;
+	ret = json_parser_string(&parser, text, strlen(text), NULL);
+	if (!ret && !json_parser_is_done(&parser))
+		ret = -1;
+	json_parser_free(&parser);
+	return ret;
+}
+
+struct point {
+	int64_t n;
+	double x;
+	int on;
+	char name[8];
+	struct {
+		int64_t id;
+	} owner;
+};
+
+static const json_field owner_fields[] = {
+	{ "id", JSON_FIELD_INT, offsetof(struct point, owner.id) - offsetof(struct point, owner), 0, NULL },
+};
+
+static json_schema owner_schema;
+
+static const json_field point_fields[] = {
+	{ "n", JSON_FIELD_INT, offsetof(struct point, n), 0, NULL },
+	{ "x", JSON_FIELD_DOUBLE, offsetof(struct point, x), 0, NULL },
+	{ "on", JSON_FIELD_BOOL, offsetof(struct point, on), 0, NULL },
+	{ "name", JSON_FIELD_STRING, offsetof(struct point, name), sizeof(((struct point *) 0)->name), NULL },
+	{ "owner", JSON_FIELD_OBJECT, offsetof(struct point, owner), 0, &owner_schema },
+};
+
+static int decode(const char *text, struct point *point)
+{
+	static json_schema schema;
+	json_schema_decoder dec;
+
+	json_schema_init(&owner_schema, owner_fields, 1);
+	json_schema_init(&schema, point_fields, 5);
+	memset(point, 0, sizeof(*point));
+	json_schema_decoder_init(&dec, &schema, point);
+	return stream(NULL, json_schema_callback, &dec, text);
+}
+
+/* switch LC_NUMERIC to a locale writing 1,5 if there is one; the caller
+ * goes back to "C" */
+static int comma_locale(void)
+{
+	/* the environment's locale first, in case it already is one */
+	static const char *names[] = { "", "de_DE.UTF-8", "de_DE.utf8", "de_DE", "fr_FR.UTF-8", NULL };
+	int i;
+
+	for (i = 0; names[i]; i++)
+		if (setlocale(LC_NUMERIC, names[i]) && !strcmp(localeconv()->decimal_point, ","))
+			return 1;
+	return 0;
+}
+
+static void test_schema(void)
+{
+	struct point point;
+
+	check(!decode("{\"n\":-42,\"x\":2.5e1,\"on\":true,\"name\":\"truncated\","
+	              "\"extra\":[1,{\"n\":9}],\"owner\":{\"id\":7}}", &point)
+	      && point.n == -42 && point.x == 25 && point.on
+	      && !strcmp(point.name, "truncat") && point.owner.id == 7,
+	      "schema: members decoded, unknown ones skipped");
+	check(decode("{\"n\":1.5}", &point) != 0, "schema: a float for an int member fails");
+	check(!decode("{\"n\\u0000\":5,\"nam\":\"x\"}", &point) && point.n == 0 && !point.name[0],
+	      "schema: keys match on their full length");
+
+	if (comma_locale()) {
+		check(!decode("{\"x\":1.5}", &point) && point.x == 1.5,
+		      "schema: doubles read the same in a comma locale");
+	} else
+		printf("skip - schema: no comma locale installed\n");
+	setlocale(LC_NUMERIC, "C");
+}
+
+/* json_validate_ex must agree with json_parse_ex, message included */
+static int same_verdict(const char *text, int settings)
+{
+	json_settings with = { 0 };
+	char parse_error[json_error_max] = "", validate_error[json_error_max] = "";
+	json_value *value;
+	int valid;
+
+	with.settings = settings;
+	value = json_parse_ex(&with, text, strlen(text), parse_error);
+	valid = json_validate_ex(&with, text, strlen(text), validate_error);
+	json_value_free(value);
+	return valid == (value != NULL) && !strcmp(parse_error, validate_error);
+}
+
+static void test_validate(void)
+{
+	static const char *documents[] = {
+		"0e1", "-0.5E+3", "12", "\"x\"", "true", "null", "[1,]", "{\"a\":1,}",
+		"[1,2", "{\"a\" 1}", "[01]", "1.", "1e", "-", "[tru]", "\"\\ud800\\udc00\"",
+		"\"\xff\"", "{\"a\":[{},[]]} ", "[1] x", "// c\n[1]", "[1 /* c */, 2]", "/* c",
+		"", "   ", "{\"a\":\"b\\u00e9\"}", "[1e400, -9223372036854775809]", NULL
+	};
+	char deep[2 * LIBJSON_VALIDATE_STACK_SIZE + 3];
+	char error[json_error_max];
+	json_config config;
+	int i, ok = 1;
+
+	for (i = 0; documents[i]; i++)
+		if (!same_verdict(documents[i], 0) || !same_verdict(documents[i], json_enable_comments)) {
+			printf("# differs on %s\n", documents[i]);
+			ok = 0;
+		}
+	check(ok, "validate: same verdict and message as json_parse_ex");
+
+	memset(deep, '[', LIBJSON_VALIDATE_STACK_SIZE + 1);
+	memset(deep + LIBJSON_VALIDATE_STACK_SIZE + 1, ']', LIBJSON_VALIDATE_STACK_SIZE + 1);
+	deep[2 * LIBJSON_VALIDATE_STACK_SIZE + 2] = '\0';
+	check(!json_validate_ex(NULL, deep, strlen(deep), error) && strstr(error, "nested")
+	      && json_validate_ex(NULL, deep + 1, strlen(deep) - 2, error),
+	      "validate: nesting limited to LIBJSON_VALIDATE_STACK_SIZE");
+
+	memset(&config, 0, sizeof(config));
+	config.allow_yaml_comments = 1;
+	check(json_validate(&config, "{} # done", 9, NULL) == 0
+	      && json_validate(&config, "# only", 6, NULL) != 0,
+	      "validate: a comment may end the input after a document");
+}
+
+static void test_minify(void)
+{
+	static const char pretty[] = "{ \"a b\" :\n\t[ 1 , \"\\\" x\\\\\" ,\r\n {} ] }  ";
+	static const char expected[] = "{\"a b\":[1,\"\\\" x\\\\\",{}]}";
+	struct text streamed = { NULL, 0 };
+	json_minifier minifier;
+	json_value *before, *after;
+	char *text, *original, *expected_text;
+	size_t length;
+	uint32_t i, chunk, minified;
+	int ok = 1;
+
+	text = strdup(pretty);
+	check(text && json_minify(text, text, sizeof(pretty) - 1) == sizeof(expected) - 1
+	      && !memcmp(text, expected, sizeof(expected) - 1),
+	      "minify: whitespace dropped outside strings only");
+	free(text);
+
+	/* a big pretty document, in place, then streamed in odd sized chunks */
+	text = slurp("web.json", &length);
+	original = text ? malloc(length) : NULL;
+	if (!original) {
+		check(0, "minify: web.json read");
+		free(text);
+		return;
+	}
+	memcpy(original, text, length);
+	minified = json_minify(text, text, (uint32_t) length);
+	before = json_parse(original, length);
+	after = json_parse(text, minified);
+	expected_text = canonical(before);
+	check(minified < length && after && same_canonical(after, expected_text),
+	      "minify: web.json keeps its value");
+	free(expected_text);
+
+	for (chunk = 1; chunk <= 7 && ok; chunk += 3) {
+		json_minifier_init(&minifier, text_append, &streamed);
+		streamed.length = 0;
+		for (i = 0; i < length && ok; i += chunk)
+			ok = !json_minifier_string(&minifier, original + i,
+			                           (uint32_t) (length - i < chunk ? length - i : chunk));
+		ok = ok && streamed.length == minified && !memcmp(streamed.data, text, minified);
+	}
+	check(ok, "minify: streaming gives the same bytes, split anywhere");
+
+	json_value_free(before);
+	json_value_free(after);
+	free(streamed.data);
+	free(original);
+	free(text);
+}
+
+static int refuse_parts(void *userdata, int type, const char *data, uint32_t length)
+{
+	(void) data;
+	(void) length;
+	if (type == JSON_STRING_PART)
+		++*(int *) userdata;
+	return (type == JSON_STRING_PART) ? JSON_ERROR_CALLBACK : 0;
+}
+
+static void test_spans(void)
+{
+	char text[300] = "[\"";
+	json_config config;
+	json_parser parser;
+	uint32_t processed = 0;
+	int parts = 0, ret;
+
+	memset(text + 2, 'x', 250);
+	strcpy(text + 252, "\"]");
+
+	/* a run the buffer can't take stops the scan where it starts */
+	memset(&config, 0, sizeof(config));
+	config.max_data = 100;
+	json_parser_init(&parser, &config, NULL, NULL);
+	ret = json_parser_string(&parser, text, strlen(text), &processed);
+	json_parser_free(&parser);
+	check(ret == JSON_ERROR_DATA_LIMIT && processed == 2, "spans: data limit reported on the run");
+
+	memset(&config, 0, sizeof(config));
+	config.buffer_initial_size = 32;
+	config.partial_strings = 1;
+	json_parser_init(&parser, &config, refuse_parts, &parts);
+	ret = json_parser_string(&parser, text, strlen(text), NULL);
+	json_parser_free(&parser);
+	check(ret == JSON_ERROR_CALLBACK && parts == 1, "spans: a refused part stops the parse");
+}
+
+/* what the number callback and the batches got, in order */
+struct numbers {
+	int types[16];
+	json_number values[16];
+	int count;
+	char raw[40]; /* text of the last number, gone with the parser */
+};
+
+static int take_number(void *userdata, const json_number *number)
+{
+	struct numbers *numbers = userdata;
+
+	if (numbers->count == 16)
+		return JSON_ERROR_CALLBACK;
+	numbers->values[numbers->count] = *number;
+	snprintf(numbers->raw, sizeof(numbers->raw), "%.*s", (int) number->raw_length, number->raw);
+	numbers->types[numbers->count++] = number->type;
+	return 0;
+}
+
+static int take_batch(void *userdata, const json_event *events, uint32_t nr_events, const char *arena)
+{
+	struct numbers *numbers = userdata;
+	uint32_t i;
+
+	(void) arena;
+	for (i = 0; i < nr_events; i++) {
+		if (numbers->count == 16)
+			return JSON_ERROR_CALLBACK;
+		numbers->types[numbers->count++] = events[i].type;
+	}
+	return 0;
+}
+
+/* numbers of text through the number callback, chunk bytes at a time */
+static int scan_numbers(const char *text, uint32_t chunk, struct numbers *numbers)
+{
+	json_parser parser;
+	uint32_t i, length = strlen(text);
+	int ret = 0;
+
+	memset(numbers, 0, sizeof(*numbers));
+	json_parser_init(&parser, NULL, NULL, numbers);
+	json_parser_set_number_callback(&parser, take_number);
+	for (i = 0; i < length && !ret; i += chunk)
+		ret = json_parser_string(&parser, text + i, (length - i < chunk) ? length - i : chunk, NULL);
+	json_parser_free(&parser);
+	return ret;
+}
+
+static void test_numbers(void)
+{
+	static const char text[] = "[0,-12,9223372036854775807,-9223372036854775808,9223372036854775808,"
+	                           "1.5,-2.5e-3,1e400,0.1E+1,123456789012345678901234567890.5]";
+	static const char order[] = "[1,\"a\",-2.5]";
+	static const int expected_order[] = {
+		JSON_ARRAY_BEGIN, JSON_INT, JSON_STRING, JSON_FLOAT, JSON_ARRAY_END
+	};
+	struct numbers numbers;
+	json_event events[8];
+	json_parser parser;
+	json_reader reader;
+	json_token token;
+	uint32_t chunk;
+	int ok = 1;
+
+	for (chunk = 1; chunk <= sizeof(text) && ok; chunk += sizeof(text) - 2) {
+		json_number *v = numbers.values;
+
+		ok = !scan_numbers(text, chunk, &numbers) && numbers.count == 10
+		     && v[0].i == 0 && v[1].i == -12 && !v[1].overflow
+		     && v[2].i == INT64_MAX && !v[2].overflow && v[3].i == INT64_MIN && !v[3].overflow
+		     && v[4].type == JSON_INT && v[4].overflow && v[4].i == INT64_MAX
+		     && v[4].d == 9223372036854775808.0
+		     && v[5].type == JSON_FLOAT && v[5].d == 1.5 && v[6].d == -2.5e-3
+		     && v[7].overflow && v[8].d == 1.0 && v[8].i == 1
+		     && v[9].d == strtod("123456789012345678901234567890.5", NULL)
+		     && !strcmp(numbers.raw, "123456789012345678901234567890.5");
+	}
+	check(ok, "numbers: converted while scanned, whatever the chunks");
+
+	if (comma_locale()) {
+		check(!scan_numbers("[0.25,1e-400,3.14159265358979323846264]", 3, &numbers) && numbers.count == 3
+		      && numbers.values[0].d == 0.25 && numbers.values[1].d == 0
+		      && numbers.values[2].d == 3.14159265358979323846264,
+		      "numbers: same values in a comma locale");
+	} else
+		printf("skip - numbers: no comma locale installed\n");
+	setlocale(LC_NUMERIC, "C");
+
+	memset(&numbers, 0, sizeof(numbers));
+	json_parser_init(&parser, NULL, NULL, &numbers);
+	json_parser_set_number_callback(&parser, take_number);
+	json_parser_set_batch(&parser, events, 8, take_batch);
+	ok = !json_parser_string(&parser, order, strlen(order), NULL) && numbers.count == 5
+	     && !memcmp(numbers.types, expected_order, sizeof(expected_order));
+	json_parser_free(&parser);
+	check(ok, "numbers: in document order with batched events");
+
+	ok = !json_reader_init(&reader, NULL, order, strlen(order));
+	for (chunk = 0; ok && chunk < 5; chunk++)
+		ok = !json_reader_next(&reader, &token) && token.type == expected_order[chunk]
+		     && (chunk != 1 || token.number.i == 1) && (chunk != 3 || token.number.d == -2.5);
+	json_reader_free(&reader);
+	check(ok, "numbers: reader tokens carry their value");
+}
+
+/* the events of a parse, and their data, each followed by a | */
+struct events {
+	int types[64];
+	int count;
+	struct text data;
+	const char *skip;   /* key whose values are passed over */
+	int skip_arrays;    /* pass over the content of arrays */
+	const char *binary; /* key whose values are base64 */
+};
+
+static int log_event(void *userdata, int type, const char *data, uint32_t length)
+{
+	struct events *events = userdata;
+
+	if (events->count == 64)
+		return JSON_ERROR_CALLBACK;
+	events->types[events->count++] = type;
+	if (data && (text_append(&events->data, data, length) || text_append(&events->data, "|", 1)))
+		return JSON_ERROR_CALLBACK;
+	if (type == JSON_KEY && events->skip && strlen(events->skip) == length
+	    && !memcmp(events->skip, data, length))
+		return JSON_CALLBACK_SKIP;
+	if (type == JSON_ARRAY_BEGIN && events->skip_arrays)
+		return JSON_CALLBACK_SKIP;
+	if (type == JSON_KEY && events->binary && strlen(events->binary) == length
+	    && !memcmp(events->binary, data, length))
+		return JSON_CALLBACK_BINARY;
+	return 0;
+}
+
+/* parse text chunk bytes at a time, leaving its events in events */
+static int parse_events(json_config *config, const char *text, uint32_t length, uint32_t chunk,
+                        struct events *events)
+{
+	json_parser parser;
+	uint32_t i;
+	int ret;
+
+	events->count = 0;
+	events->data.length = 0;
+	ret = json_parser_init(&parser, config, log_event, events);
+	for (i = 0; i < length && !ret; i += chunk)
+		ret = json_parser_string(&parser, text + i, (length - i < chunk) ? length - i : chunk, NULL);
+	if (!ret && !json_parser_is_done(&parser))
+		ret = JSON_ERROR_INCOMPLETE;
+	json_parser_free(&parser);
+	return ret;
+}
+
+static int count_events(const struct events *events, int type)
+{
+	int i, count = 0;
+
+	for (i = 0; i < events->count; i++)
+		count += (events->types[i] == type);
+	return count;
+}
+
+static void test_documents(void)
+{
+	static const char stream[] = "{\"a\":1} [2]\x1e{}\n\x1e[\"x\"]\n";
+	struct events events;
+	json_config config;
+	uint32_t chunk;
+	int ok = 1;
+
+	memset(&events, 0, sizeof(events));
+	memset(&config, 0, sizeof(config));
+	config.multi_document = 1;
+	for (chunk = 1; chunk < sizeof(stream) && ok; chunk += 4)
+		ok = !parse_events(&config, stream, sizeof(stream) - 1, chunk, &events)
+		     && count_events(&events, JSON_DOCUMENT_END) == 4
+		     && events.types[events.count - 1] == JSON_DOCUMENT_END
+		     && !strcmp(events.data.data, "a|1|2|x|");
+	check(ok, "documents: concatenated and RFC 7464 records, split anywhere");
+
+	check(parse_events(&config, "{} [", 4, 4, &events) == JSON_ERROR_INCOMPLETE
+	      && count_events(&events, JSON_DOCUMENT_END) == 1,
+	      "documents: a stream ending inside one is incomplete");
+	check(parse_events(&config, "{} \x1e", 4, 4, &events) == 0
+	      && parse_events(NULL, "{} {}", 5, 5, &events) != 0,
+	      "documents: separators alone are fine, several need multi_document");
+	free(events.data.data);
+}
+
+/* length bytes of s end on a utf8 character boundary */
+static int whole_characters(const char *s, uint32_t length)
+{
+	uint32_t k;
+
+	for (k = 1; k <= 3 && k <= length; k++) {
+		unsigned char ch = s[length - k];
+
+		if (ch < 0x80)
+			return 1;
+		if (ch >= 0xc0)
+			return (ch >= 0xf0) ? k == 4 : (ch >= 0xe0) ? k == 3 : k == 2;
+	}
+	return 1;
+}
+
+static void test_parts(void)
+{
+	static const char source[] = "ab\\n\\u00e9\xc3\xa9\\ud83d\\ude00";
+	static const char decoded[] = "ab\n\xc3\xa9\xc3\xa9\xf0\x9f\x98\x80";
+	struct events events;
+	struct text body = { NULL, 0 }, document = { NULL, 0 }, expected = { NULL, 0 };
+	json_config config;
+	json_parser parser;
+	char *part, *end;
+	uint32_t chunk;
+	int i, ok = 1;
+
+	for (i = 0; i < 100; i++) {
+		text_append(&body, source, sizeof(source) - 1);
+		text_append(&expected, decoded, sizeof(decoded) - 1);
+	}
+	text_append(&document, "{\"", 2);
+	text_append(&document, body.data, body.length);
+	text_append(&document, "\":\"", 3);
+	text_append(&document, body.data, body.length);
+	text_append(&document, "\"}", 2);
+
+	memset(&events, 0, sizeof(events));
+	memset(&config, 0, sizeof(config));
+	config.buffer_initial_size = LIBJSON_PARTIAL_MIN_BUFFER_SIZE;
+	config.partial_strings = 1;
+	for (chunk = 7; chunk < 2 * document.length && ok; chunk += document.length) {
+		ok = !parse_events(&config, document.data, document.length, chunk, &events)
+		     && count_events(&events, JSON_KEY_PART) > 10 && count_events(&events, JSON_STRING_PART) > 10
+		     && events.types[events.count - 1] == JSON_OBJECT_END;
+		/* key and value: parts then the rest, each cut between characters */
+		for (part = events.data.data, i = 0; ok && i < 2; i++) {
+			struct text joined = { NULL, 0 };
+
+			while ((end = strchr(part, '|'))) {
+				ok = ok && whole_characters(part, end - part);
+				text_append(&joined, part, end - part);
+				part = end + 1;
+				if (joined.length >= expected.length)
+					break;
+			}
+			ok = ok && joined.length == expected.length && !memcmp(joined.data, expected.data, expected.length);
+			free(joined.data);
+		}
+	}
+	check(ok, "parts: long keys and strings cut on characters, split anywhere");
+
+	json_parser_init(&parser, &config, NULL, NULL);
+	ok = !json_parser_string(&parser, document.data, document.length, NULL)
+	     && parser.buffer_size == LIBJSON_PARTIAL_MIN_BUFFER_SIZE;
+	json_parser_free(&parser);
+	check(ok, "parts: the buffer keeps its size");
+
+	free(body.data);
+	free(document.data);
+	free(expected.data);
+	free(events.data.data);
+}
+
+static void test_skip(void)
+{
+	static const char document[] = "{\"drop\":{\"a\":[1,\"]}\\\"\",{\"b\":\"}\"}]},\"keep\":\"x\","
+	                               "\"drop\":-1.5e3,\"list\":[1,[2,\"]\"],3],\"drop\":\"s\\\"]\",\"end\":true}";
+	static const int arrays_skipped[] = {
+		JSON_OBJECT_BEGIN, JSON_KEY, JSON_ARRAY_BEGIN, JSON_ARRAY_END, JSON_KEY, JSON_INT, JSON_OBJECT_END
+	};
+	struct events events;
+	uint32_t chunk;
+	int ok = 1;
+
+	memset(&events, 0, sizeof(events));
+	events.skip = "drop";
+	for (chunk = 1; chunk < sizeof(document) && ok; chunk += 5)
+		ok = !parse_events(NULL, document, sizeof(document) - 1, chunk, &events)
+		     && count_events(&events, JSON_KEY) == 6 && count_events(&events, JSON_ARRAY_BEGIN) == 2
+		     && !strncmp(events.data.data, "drop|keep|x|drop|list|1|2|]|3|drop|end|", 39);
+	check(ok, "skip: values of a key passed over, brackets in strings ignored");
+
+	events.skip = NULL;
+	events.skip_arrays = 1;
+	check(!parse_events(NULL, "{\"list\":[1,[2,\"]\"]],\"k\":2}", 26, 26, &events)
+	      && events.count == 7 && !memcmp(events.types, arrays_skipped, sizeof(arrays_skipped)),
+	      "skip: content of an array passed over, its end reported");
+	check(parse_events(NULL, "{\"list\":[1,[2]}", 15, 15, &events) != 0,
+	      "skip: unbalanced brackets still fail");
+	free(events.data.data);
+}
+
+/* an output that takes limit bytes, then fails */
+struct sink {
+	uint32_t taken;
+	uint32_t limit;
+};
+
+static int limited_sink(void *userdata, const char *data, uint32_t length)
+{
+	struct sink *sink = userdata;
+
+	(void) data;
+	if (sink->taken + length > sink->limit)
+		return 1;
+	sink->taken += length;
+	return 0;
+}
+
+/* print every kind of event to a sink failing after limit bytes: the
+ * error of the first event that didn't fit, 0 if all did */
+static int print_limited(uint32_t limit, int base64, uint32_t *taken)
+{
+	static const struct { int type; const char *data; } events[] = {
+		{ JSON_OBJECT_BEGIN, NULL }, { JSON_KEY, "k" }, { JSON_ARRAY_BEGIN, NULL },
+		{ JSON_INT, "1" }, { JSON_FLOAT, "2.5" }, { JSON_NULL, NULL }, { JSON_TRUE, NULL },
+		{ JSON_FALSE, NULL }, { JSON_STRING, "s\n" }, { JSON_BSTRING, "\x01\xff" },
+		{ JSON_STRING_PART, "pa" }, { JSON_STRING, "rt" }, { JSON_OBJECT_BEGIN, NULL },
+		{ JSON_KEY_PART, "k" }, { JSON_KEY, "ey" }, { JSON_OBJECT_BEGIN, NULL },
+		{ JSON_OBJECT_END, NULL }, { JSON_OBJECT_END, NULL }, { JSON_ARRAY_END, NULL },
+		{ JSON_OBJECT_END, NULL }, { JSON_DOCUMENT_END, NULL },
+	};
+	struct sink sink = { 0, limit };
+	json_printer printer;
+	size_t i;
+	int ret = 0;
+
+	json_print_init(&printer, limited_sink, &sink);
+	printer.base64 = base64;
+	for (i = 0; i < sizeof(events) / sizeof(events[0]) && !ret; i++)
+		ret = json_print_pretty(&printer, events[i].type, events[i].data,
+		                        (events[i].data) ? strlen(events[i].data) : 0);
+	json_print_free(&printer);
+	*taken = sink.taken;
+	return ret;
+}
+
+static void test_printer(void)
+{
+	uint32_t full, limit, taken;
+	int base64, ok = 1;
+
+	for (base64 = 0; base64 <= JSON_BASE64 && ok; base64 += JSON_BASE64) {
+		ok = !print_limited(UINT32_MAX, base64, &full);
+		for (limit = 0; limit < full && ok; limit++)
+			ok = print_limited(limit, base64, &taken) == JSON_ERROR_CALLBACK && taken <= limit;
+	}
+	check(ok, "printer: every output error is reported");
+}
+
+static void test_base64(void)
+{
+	char bytes[256], encoded[JSON_BASE64_LENGTH(256) + 1], decoded[256];
+	struct events events;
+	struct text printed = { NULL, 0 };
+	json_printer printer;
+	uint32_t length, n, decoded_length;
+	int variant, i, ok = 1;
+
+	for (i = 0; i < 256; i++)
+		bytes[i] = (char) (i * 7 + 3);
+	for (variant = JSON_BASE64; variant <= JSON_BASE64_URL; variant++)
+		for (length = 0; length <= 256 && ok; length += (length < 20) ? 1 : 59) {
+			n = json_base64_encode(encoded, bytes, length, variant);
+			ok = n == ((variant == JSON_BASE64) ? JSON_BASE64_LENGTH(length) : (length * 4 + 2) / 3)
+			     && !json_base64_decode(decoded, &decoded_length, encoded, n)
+			     && decoded_length == length && !memcmp(decoded, bytes, length);
+		}
+	check(ok, "base64: round trips in both alphabets");
+	check(json_base64_decode(decoded, &decoded_length, "ab$d", 4) == JSON_ERROR_BASE64
+	      && json_base64_decode(decoded, &decoded_length, "a", 1) == JSON_ERROR_BASE64,
+	      "base64: invalid text refused");
+
+	/* a binary member parsed, then printed back as base64 */
+	memset(&events, 0, sizeof(events));
+	events.binary = "bin";
+	n = json_base64_encode(encoded, bytes, 200, JSON_BASE64);
+	encoded[n] = '\0';
+	printed.length = 0;
+	text_append(&printed, "{\"bin\":\"", 8);
+	text_append(&printed, encoded, n);
+	text_append(&printed, "\",\"s\":\"QQ==\"}", 13);
+	ok = !parse_events(NULL, printed.data, printed.length, 7, &events)
+	     && count_events(&events, JSON_BSTRING) == 1 && count_events(&events, JSON_STRING) == 1
+	     && !memcmp(events.data.data, "bin|", 4) && !memcmp(events.data.data + 4, bytes, 200)
+	     && !strcmp(events.data.data + 204, "|s|QQ==|");
+	check(ok, "base64: a binary member decoded, split anywhere");
+	check(parse_events(NULL, "{\"bin\":\"QQ=A\"}", 14, 14, &events) == JSON_ERROR_BASE64,
+	      "base64: an invalid binary member fails");
+
+	printed.length = 0;
+	json_print_init(&printer, text_append, &printed);
+	printer.base64 = JSON_BASE64;
+	ok = !json_print_raw(&printer, JSON_BSTRING, bytes, 200)
+	     && printed.length == n + 2 && !memcmp(printed.data + 1, encoded, n);
+	json_print_free(&printer);
+	check(ok, "base64: binary strings printed back");
+
+	free(printed.data);
+	free(events.data.data);
+}
+
+/* json_value_write's output for value, read back; NULL when it failed */
+static char *written(const json_value *value, int threads, int *err)
+{
+	size_t length;
+	int fd = open(WRITE_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (fd < 0) {
+		*err = errno;
+		return NULL;
+	}
+	*err = json_value_write(value, fd, threads);
+	close(fd);
+	return *err ? NULL : slurp(WRITE_FILE, &length);
+}
+
+static int writes_back(const json_value *value, int threads)
+{
+	int err;
+	char *text = written(value, threads, &err);
+	json_value *back = text ? json_parse(text, strlen(text)) : NULL;
+	char *expected = canonical(value);
+	int same = back && same_canonical(back, expected);
+
+	json_value_free(back);
+	free(expected);
+	free(text);
+	return same;
+}
+
+static void test_write(void)
+{
+	json_value *value = load("web.json");
+	struct text deep = { NULL, 0 };
+	char *text;
+	int i, err;
+
+	check(value && writes_back(value, 1) && writes_back(value, 4) && writes_back(value, 64),
+	      "write: web.json written back whole, whatever the threads");
+	json_value_free(value);
+
+	/* nested below the depth the split stops at */
+	for (i = 0; i < 40; i++)
+		text_append(&deep, "[\"abcdefgh\",{\"k\":", 17);
+	text_append(&deep, "1", 1);
+	for (i = 0; i < 40; i++)
+		text_append(&deep, "}]", 2);
+	value = json_parse(deep.data, deep.length);
+	check(value && writes_back(value, 4), "write: deep trees written back whole");
+	json_value_free(value);
+	free(deep.data);
+
+	value = json_parse("[1.5,[2]]", 9);
+	if (value) {
+		value->u.array.values[0]->u.dbl = 0.0 / 0.0;
+		check(!written(value, 2, &err) && err == EDOM, "write: NaN refused");
+		value->u.array.values[0]->u.dbl = 1.5;
+	}
+	if (comma_locale()) {
+		text = value ? written(value, 2, &err) : NULL;
+		check(text && !strcmp(text, "[1.5,[2]]"), "write: doubles written the same in a comma locale");
+		free(text);
+	} else
+		printf("skip - write: no comma locale installed\n");
+	setlocale(LC_NUMERIC, "C");
+	json_value_free(value);
+	unlink(WRITE_FILE);
+}
+
+static void test_templates(void)
+{
+	json_template tpl;
+	json_slot slots[5];
+	json_printer printer;
+	struct text text = { NULL, 0 }, direct = { NULL, 0 };
+	int ret, ok;
+
+	memset(slots, 0, sizeof(slots));
+	ret = json_template_compile(&tpl, json_print_raw, JSON_OBJECT_BEGIN,
+	                            JSON_KEY, "id", -1, JSON_SLOT_INT,
+	                            JSON_KEY, "name", -1, JSON_SLOT_STRING,
+	                            JSON_KEY, "ok", -1, JSON_SLOT_BOOL,
+	                            JSON_KEY, "x", -1, JSON_SLOT_FLOAT,
+	                            JSON_KEY, "raw", -1, JSON_SLOT_RAW,
+	                            JSON_OBJECT_END, -1);
+	if (ret) {
+		check(0, "templates: compile");
+		return;
+	}
+
+	/* two renders as the values of an array */
+	json_print_init(&printer, text_append, &text);
+	ok = !json_print_raw(&printer, JSON_ARRAY_BEGIN, NULL, 0);
+	slots[0].i = -42;
+	slots[1].s = "a\"b";
+	slots[1].length = -1;
+	slots[2].b = 1;
+	slots[3].d = 1.5;
+	slots[4].s = "[1,2]";
+	slots[4].length = -1;
+	ok = ok && !json_template_render(&tpl, &printer, slots);
+	slots[0].i = 7;
+	slots[2].b = 0;
+	slots[3].d = 0.0 / 0.0;
+	ok = ok && !json_template_render(&tpl, &printer, slots)
+	     && !json_print_raw(&printer, JSON_ARRAY_END, NULL, 0);
+	json_print_free(&printer);
+	check(ok && text.data && !strcmp(text.data,
+	      "[{\"id\":-42,\"name\":\"a\\\"b\",\"ok\":true,\"x\":1.5,\"raw\":[1,2]},"
+	      "{\"id\":7,\"name\":\"a\\\"b\",\"ok\":false,\"x\":null,\"raw\":[1,2]}]"),
+	      "templates: slots filled, renders separated like values");
+	json_template_free(&tpl);
+
+	/* a pretty template prints what the pretty printer would */
+	text.length = 0;
+	ret = json_template_compile(&tpl, json_print_pretty, JSON_OBJECT_BEGIN,
+	                            JSON_KEY, "a", -1, JSON_SLOT_INT,
+	                            JSON_KEY, "b", -1, JSON_ARRAY_BEGIN, JSON_SLOT_STRING, JSON_ARRAY_END,
+	                            JSON_OBJECT_END, -1);
+	slots[0].i = 1;
+	slots[1].s = "x";
+	json_print_init(&printer, text_append, &text);
+	ok = !ret && !json_template_render(&tpl, &printer, slots);
+	json_print_free(&printer);
+	json_print_init(&printer, text_append, &direct);
+	ok = ok && !json_print_args(&printer, json_print_pretty, JSON_OBJECT_BEGIN,
+	                            JSON_KEY, "a", -1, JSON_INT, "1", -1,
+	                            JSON_KEY, "b", -1, JSON_ARRAY_BEGIN, JSON_STRING, "x", -1, JSON_ARRAY_END,
+	                            JSON_OBJECT_END, -1);
+	json_print_free(&printer);
+	check(ok && text.data && direct.data && !strcmp(text.data, direct.data),
+	      "templates: pretty renders match the pretty printer");
+	json_template_free(&tpl);
+
+	free(text.data);
+	free(direct.data);
+}
+
+static void test_canonical(void)
+{
+	json_value *value = load("canonical.json");
+	json_value *back = NULL, *other = json_parse("{\"a\":[1,2]}", 11);
+	size_t length;
+	char *expected = slurp("canonical_expected.json", &length);
+	uint64_t hash, back_hash, other_hash, pair[2];
+
+	if (!value || !expected || !other) {
+		check(0, "canonical: fixtures");
+		goto out;
+	}
+	check(same_canonical(value, expected), "canonical: members sorted, numbers and strings normalized");
+	if (comma_locale())
+		check(same_canonical(value, expected), "canonical: the same text in a comma locale");
+	else
+		printf("skip - canonical: no comma locale installed\n");
+	setlocale(LC_NUMERIC, "C");
+
+	/* the same document written another way hashes the same */
+	back = json_parse(expected, length);
+	check(back && !json_value_hash(value, 0, &hash) && !json_value_hash(back, 0, &back_hash)
+	      && hash == back_hash, "canonical: equal documents hash the same");
+	check(!json_value_hash(other, 0, &other_hash) && other_hash != hash,
+	      "canonical: different documents hash differently");
+	check(!json_value_hash128(value, pair) && pair[0] == hash && pair[1] != hash,
+	      "canonical: the 128 bit hash extends the 64 bit one");
+out:
+	json_value_free(value);
+	json_value_free(back);
+	json_value_free(other);
+	free(expected);
+}
+
+static json_value *parse_deduped(const char *text, size_t length)
+{
+	json_settings settings = { 0 };
+
+	settings.settings = json_enable_dedupe;
+	return json_parse_ex(&settings, text, length, NULL);
+}
+
+static void test_dedupe(void)
+{
+	static const char shared[] = "[{\"a\":[1,2]},{\"a\":[1,2]},{\"a\":[1,3]},1,1.0,\"1\",1]";
+	json_value *plain = load("web.json"), *value = NULL, **values;
+	size_t length;
+	char *text = slurp("web.json", &length), *expected = canonical(plain);
+
+	if (!text || !expected) {
+		check(0, "dedupe: fixtures");
+		goto out;
+	}
+	value = parse_deduped(text, length);
+	check(value && same_canonical(value, expected), "dedupe: web.json reads the same");
+	json_value_free(value);
+
+	value = parse_deduped(shared, sizeof(shared) - 1);
+	if (!value || value->type != json_array || value->u.array.length != 7) {
+		check(0, "dedupe: parse");
+		goto out;
+	}
+	values = value->u.array.values;
+	check(values[0] == values[1] && values[3] == values[6], "dedupe: equal subtrees are one value");
+	check(values[2] != values[0] && values[2]->u.object.values[0].value->u.array.values[0]
+	      == values[0]->u.object.values[0].value->u.array.values[0],
+	      "dedupe: different subtrees keep their equal parts shared");
+	check(values[3] != values[4] && values[3] != values[5] && values[4] != values[5],
+	      "dedupe: an int, a double and a string of the same text stay apart");
+	check(values[0]->u.object.values[0].name == values[2]->u.object.values[0].name,
+	      "dedupe: member names stored once");
+	check(same_canonical(value, "[{\"a\":[1,2]},{\"a\":[1,2]},{\"a\":[1,3]},1,1,\"1\",1]"),
+	      "dedupe: the tree reads the same");
+out:
+	json_value_free(value);
+	json_value_free(plain);
+	free(expected);
+	free(text);
+}
+
+static int print_event(void *userdata, int type, const char *data, uint32_t length)
+{
+	return json_print_raw(userdata, type, data, length);
+}
+
+/* the diff of from and to, applied to from, gives to */
+static int diff_round_trip(const char *from_text, const char *to_text)
+{
+	json_value *from = json_parse(from_text, strlen(from_text));
+	json_value *to = json_parse(to_text, strlen(to_text));
+	json_value *patch = NULL;
+	struct text text = { NULL, 0 };
+	json_printer printer;
+	char *expected = canonical(to);
+	int ok = 0;
+
+	if (from && to && expected) {
+		json_print_init(&printer, text_append, &text);
+		ok = !json_value_diff(from, to, print_event, &printer);
+		json_print_free(&printer);
+	}
+	ok = ok && text.data && (patch = json_parse(text.data, text.length))
+	     && json_patch_apply(&from, patch, NULL) && same_canonical(from, expected);
+	json_value_free(from);
+	json_value_free(to);
+	json_value_free(patch);
+	free(expected);
+	free(text.data);
+	return ok;
+}
+
+static void test_diff(void)
+{
+	static const char *pairs[][2] = {
+		{ "{\"a\":1,\"b\":[1,2,3]}", "{\"a\":1,\"b\":[1,2,3]}" },
+		{ "{\"a\":1,\"b\":2}", "{\"b\":3,\"c\":{\"d\":null}}" },
+		{ "[1,2,3,4,5]", "[0,1,3,5,6]" },
+		{ "[[1],[2],[3]]", "[[3],[1],[2],[2]]" },
+		{ "{\"a/b\":{\"c~d\":[true]}}", "{\"a/b\":{\"c~d\":[false],\"e\":\"x\"}}" },
+		{ "{\"x\":[{\"y\":1},{\"y\":2}]}", "{\"x\":[{\"y\":2},{\"y\":1,\"z\":1}]}" },
+		{ "[1]", "{\"1\":1}" },
+		{ "1", "\"one\"" },
+	};
+	size_t length;
+	char *doc = slurp("patch_doc.json", &length);
+	char *result = slurp("patch_ok_expected.json", &length);
+	unsigned int i;
+	int ok = 1;
+
+	for (i = 0; i < sizeof(pairs) / sizeof(pairs[0]); i++)
+		ok = ok && diff_round_trip(pairs[i][0], pairs[i][1]) && diff_round_trip(pairs[i][1], pairs[i][0]);
+	check(ok, "diff: the patch turns from into to");
+	check(doc && result && diff_round_trip(doc, result) && diff_round_trip(result, doc),
+	      "diff: the patch fixtures round trip");
+	free(doc);
+	free(result);
+}
+
+static void test_patch(void)
+{
+	char error[json_error_max];
+	json_value *doc = load("patch_doc.json");
+	json_value *ok = load("patch_ok.json");
+	json_value *atomic = load("patch_atomic.json");
+	json_value *before;
+	size_t length;
+	char *expected = slurp("patch_ok_expected.json", &length);
+	char *text = canonical(doc);
+
+	if (!doc || !ok || !atomic || !expected || !text) {
+		check(0, "patch: fixtures");
+		goto out;
+	}
+
+	before = doc;
+	error[0] = '\0';
+	check(!json_patch_apply(&doc, atomic, error), "patch: failing test op fails the patch");
+	check(!strncmp(error, "op 3:", 5), "patch: error names the failing op");
+	check(doc == before && same_canonical(doc, text), "patch: document unchanged after a failure");
+
+	check(json_patch_apply(&doc, ok, error), "patch: every op applies");
+	check(same_canonical(doc, expected), "patch: result");
+
+out:
+	json_value_free(doc);
+	json_value_free(ok);
+	json_value_free(atomic);
+	free(expected);
+	free(text);
+}
+
+static void store_cleanup(void)
+{
+	unlink(STORE_FILE);
+	unlink(STORE_FILE ".log");
+	unlink(STORE_FILE ".log.next");
+}
+
+static void test_store(void)
+{
+	static const char add[] = "[{\"op\":\"add\",\"path\":\"/zz\",\"value\":1}]";
+	char error[json_error_max];
+	json_value *ok = load("patch_ok.json");
+	json_value *atomic = load("patch_atomic.json");
+	json_value *more = json_parse(add, sizeof(add) - 1);
+	json_store *store;
+	char *doc, *expected, *before = NULL;
+	size_t length, expected_length;
+
+	doc = slurp("patch_doc.json", &length);
+	expected = slurp("patch_ok_expected.json", &expected_length);
+	store_cleanup();
+	if (!ok || !atomic || !more || !doc || !expected || !spill(STORE_FILE, doc, length)) {
+		check(0, "store: fixtures");
+		goto out;
+	}
+
+	store = json_store_open(STORE_FILE, error);
+	check(store != NULL, "store: open");
+	if (!store)
+		goto out;
+	before = canonical(json_store_root(store));
+	check(json_store_patch(store, atomic, error) == EINVAL, "store: failing patch is refused");
+	check(same_canonical(json_store_root(store), before), "store: document unchanged after a failure");
+	check(json_store_patch(store, ok, error) == 0, "store: patch applies");
+	check(json_store_close(store) == 0, "store: close");
+
+	store = json_store_open(STORE_FILE, error);
+	check(store && same_canonical(json_store_root(store), expected), "store: log replayed on open");
+	if (!store)
+		goto out;
+	check(json_store_compact(store) == 0 && json_store_close(store) == 0, "store: compact");
+	store = json_store_open(STORE_FILE, error);
+	check(store && same_canonical(json_store_root(store), expected), "store: compacted file reopened");
+	if (!store)
+		goto out;
+	check(json_store_patch(store, more, error) == 0 && json_store_close(store) == 0,
+	      "store: patch after a compaction");
+
+	/* the base file edited behind the store's back: its log is left alone */
+	error[0] = '\0';
+	spill(STORE_FILE, doc, length);
+	store = json_store_open(STORE_FILE, error);
+	check(!store && strstr(error, "another version") && access(STORE_FILE ".log", F_OK) == 0,
+	      "store: a log for another version is refused and kept");
+	if (store)
+		json_store_close(store);
+
+	store_cleanup();
+out:
+	json_value_free(ok);
+	json_value_free(atomic);
+	json_value_free(more);
+	free(doc);
+	free(expected);
+	free(before);
+}
+
+static int cached_matches(const char *expected)
+{
+	json_settings settings;
+	json_value *value;
+	int same;
+
+	memset(&settings, 0, sizeof(settings));
+	value = json_parse_file_cached(&settings, CACHE_FILE, NULL, NULL);
+	same = value && same_canonical(value, expected);
+	json_value_free(value);
+	return same;
+}
+
+static void test_cache(void)
+{
+	json_value *value = load("web.json");
+	char *expected = canonical(value), *image;
+	size_t length;
+
+	json_value_free(value);
+	image = slurp("web.json", &length);
+	if (!expected || !image || !spill(CACHE_FILE, image, length)) {
+		check(0, "cache: fixtures");
+		goto out;
+	}
+	free(image);
+	image = NULL;
+	unlink(CACHE_FILE ".jllc");
+
+	check(cached_matches(expected), "cache: miss parses the file");
+	check(access(CACHE_FILE ".jllc", F_OK) == 0, "cache: image written");
+	check(cached_matches(expected), "cache: hit loads the image");
+
+	/* a damaged image is a miss, never a wrong tree */
+	image = slurp(CACHE_FILE ".jllc", &length);
+	if (image && length > 512) {
+		/* slurp leaves a NUL after the image */
+		spill(CACHE_FILE ".jllc", image, length + 1);
+		check(cached_matches(expected), "cache: oversized image is reparsed");
+		memset(image + length / 2, 0x5a, 64);
+		spill(CACHE_FILE ".jllc", image, length);
+		check(cached_matches(expected), "cache: corrupted image is reparsed");
+		spill(CACHE_FILE ".jllc", image, length / 3);
+		check(cached_matches(expected), "cache: truncated image is reparsed");
+	} else
+		check(0, "cache: image size");
+
+	unlink(CACHE_FILE);
+	unlink(CACHE_FILE ".jllc");
+out:
+	free(expected);
+	free(image);
+}
+
+int main(void)
+{
+	test_cache();
+	test_schema();
+	test_validate();
+	test_minify();
+	test_spans();
+	test_numbers();
+	test_documents();
+	test_parts();
+	test_skip();
+	test_printer();
+	test_base64();
+	test_write();
+	test_templates();
+	test_canonical();
+	test_dedupe();
+	test_diff();
+	test_patch();
+	test_store();
+
+	if (failures)
+		printf("%d failure(s)\n", failures);
+	return failures ? 1 : 0;
+}
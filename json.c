@@ -1,5 +1,10 @@
 /* vim: set et ts=3 sw=3 sts=3 ft=c: */
 
+/* st_mtim, mmap and shm_open are POSIX 2008, hidden by strict -std=c99 */
+#ifndef _DEFAULT_SOURCE
+   #define _DEFAULT_SOURCE
+#endif
+
 #include "json.h"
 
 #ifdef _MSC_VER
@@ -15,6 +20,71 @@
 #include <limits.h>
 #include <math.h>
 #include <errno.h>
+#include <locale.h>
+#include <sys/stat.h>
+/* acquire/release atomics for what threads (parallel writes, store
+ * compaction) and processes (shared images) share.  without them there
+ * are no threads, and plain accesses do */
+#if defined(__GNUC__)
+   #define JSON_HAVE_ATOMICS
+   #define json_atomic_load(ptr) __atomic_load_n ((ptr), __ATOMIC_ACQUIRE)
+   #define json_atomic_store(ptr, value) __atomic_store_n ((ptr), (value), __ATOMIC_RELEASE)
+   #define json_atomic_fetch_inc(ptr) __atomic_fetch_add ((ptr), 1, __ATOMIC_RELAXED)
+   #define json_atomic_swap(ptr, expected, desired) \
+      __atomic_compare_exchange_n ((ptr), (expected), (desired), 0, \
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#else
+   #define json_atomic_load(ptr) (*(ptr))
+   #define json_atomic_store(ptr, value) (*(ptr) = (value))
+   #define json_atomic_fetch_inc(ptr) ((*(ptr)) ++)
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+   #include <sys/mman.h>
+   #include <fcntl.h>
+   #include <unistd.h>
+   #include <pthread.h>
+   #include <sys/uio.h>
+   #if defined(__APPLE__)
+      #include <xlocale.h>
+   #endif
+   #define JSON_HAVE_MMAP
+   #define JSON_HAVE_USELOCALE
+   #ifdef JSON_HAVE_ATOMICS
+      #define JSON_HAVE_THREADS
+   #endif
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+   #include <emmintrin.h>
+   #define JSON_HAVE_SSE2
+   #if defined(__GNUC__)
+      #include <tmmintrin.h>
+      #define JSON_HAVE_SSSE3_DISPATCH
+   #endif
+#endif
+#ifdef JSON_HAVE_SSE2
+   /* bit scans over _mm_movemask_epi8 masks; mask_ctz needs a non-zero mask */
+   #if defined(__GNUC__)
+      #define mask_ctz(mask) __builtin_ctz (mask)
+      #define mask_parity(mask) __builtin_parity (mask)
+   #else
+      #include <intrin.h>
+      static __inline int mask_ctz (unsigned long mask)
+      {
+         unsigned long index;
+         _BitScanForward (&index, mask);
+         return (int) index;
+      }
+      static __inline int mask_parity (unsigned int mask)
+      {
+         mask ^= mask >> 16;
+         mask ^= mask >> 8;
+         mask ^= mask >> 4;
+         mask ^= mask >> 2;
+         mask ^= mask >> 1;
+         return (int) (mask & 1);
+      }
+   #endif
+#endif
 #define FILENAME_SIZE 1024
 #define MAX_LINE 2048
 #define ANSI_COLOR_GREEN   "\x1b[32m"
@@ -64,6 +134,10 @@ typedef unsigned int json_uchar;
 
 const struct _json_value json_value_none;
 
+static int is_image_root (const json_value * value);
+static void image_release (json_settings * settings, json_value * root);
+static json_value * dedupe_tree (json_settings * settings, json_value * root);
+
 static unsigned char hex_value (json_char c)
 {
    if (isdigit((unsigned char)c))
@@ -85,6 +159,69 @@ static int would_overflow (json_int_t value, json_char b)
    return ((JSON_INT_MAX - (b - '0')) / 10 ) < value;
 }
 
+/* Numbers go in and out of text in the C locale, whatever the process's:
+ * JSON's decimal point is '.'.  The calling thread switches to the C
+ * locale for the length of one conversion (POSIX 2008 uselocale); where
+ * there is no uselocale, the conversions follow the process's locale.
+ */
+
+#ifdef JSON_HAVE_USELOCALE
+
+typedef locale_t json_locale;
+
+static locale_t c_locale;
+static pthread_once_t c_locale_once = PTHREAD_ONCE_INIT;
+
+static void c_locale_init (void)
+{
+   c_locale = newlocale (LC_ALL_MASK, "C", (locale_t) 0);
+}
+
+/* returns the locale to go back to, 0 when nothing was switched */
+static json_locale c_locale_enter (void)
+{
+   pthread_once (&c_locale_once, c_locale_init);
+   return c_locale ? uselocale (c_locale) : (locale_t) 0;
+}
+
+static void c_locale_leave (json_locale previous)
+{
+   if (previous)
+      uselocale (previous);
+}
+
+#else
+
+typedef int json_locale;
+
+#define c_locale_enter() 0
+#define c_locale_leave(previous) ((void) (previous))
+
+#endif
+
+static double c_strtod (const char * s, char ** end)
+{
+   json_locale previous = c_locale_enter ();
+   double dbl = strtod (s, end);
+
+   c_locale_leave (previous);
+   return dbl;
+}
+
+static int c_snprintf (char * buf, size_t size, const char * format, ...)
+{
+   json_locale previous = c_locale_enter ();
+   va_list args;
+   int length;
+
+   va_start (args, format);
+   length = vsnprintf (buf, size, format, args);
+   va_end (args);
+
+   c_locale_leave (previous);
+   return length;
+}
+
 typedef struct
 {
    size_t used_memory;
@@ -92,6 +229,10 @@ typedef struct
    json_settings settings;
    int first_pass;
 
+   /* when validating: one node per nesting level instead of the allocator */
+   json_value * nodes;
+   unsigned int nodes_size;
+
    const json_char * ptr;
    unsigned int cur_line, cur_col;
 
@@ -194,7 +335,19 @@ static int new_value (json_state * state,
       return 1;
    }
 
-   if (! (value = (json_value *) json_alloc
+   if (state->nodes)
+   {
+      /* values open one at a time below *top, which only ever holds a
+       * container, so a node is free again once its value is done
+       */
+      value = *top ? *top + 1 : state->nodes;
+
+      if (value == state->nodes + state->nodes_size)
+         return 0;
+
+      memset (value, 0, sizeof (json_value));
+   }
+   else if (! (value = (json_value *) json_alloc
          (state, sizeof (json_value) + state->settings.value_extra, 1)))
    {
       return 0;
@@ -211,10 +364,15 @@ static int new_value (json_state * state,
       value->col = state->cur_col;
    #endif
 
-   if (*alloc)
-      (*alloc)->_reserved.next_alloc = value;
+   if (!state->nodes)
+   {
+      if (*alloc)
+         (*alloc)->_reserved.next_alloc = value;
+
+      *alloc = value;
+   }
 
-   *alloc = *top = value;
+   *top = value;
 
    return 1;
 }
@@ -247,10 +405,16 @@ static const long
    flag_block_comment    = 1 << 14,
    flag_num_got_decimal  = 1 << 15;
 
-json_value * json_parse_ex (json_settings * settings,
-                            const json_char * json,
-                            size_t length,
-                            char * error_buf)
+/* Both json_parse_ex and json_validate_ex: with nodes, only the first pass
+ * runs, on nodes_size levels of nesting, and a non-zero return (into nodes)
+ * just means the document is valid.
+ */
+static json_value * parse_document (json_settings * settings,
+                                    const json_char * json,
+                                    size_t length,
+                                    char * error_buf,
+                                    json_value * nodes,
+                                    unsigned int nodes_size)
 {
    char error [json_error_max];
    const json_char * end;
@@ -274,6 +438,8 @@ json_value * json_parse_ex (json_settings * settings,
    end = (json + length);
 
    memcpy (&state.settings, settings, sizeof (json_settings));
+   state.nodes = nodes;
+   state.nodes_size = nodes_size;
 
    if (!state.settings.mem_alloc)
       state.settings.mem_alloc = default_alloc;
@@ -942,9 +1108,16 @@ json_value * json_parse_ex (json_settings * settings,
          }
       }
 
+      if (state.nodes)
+         return root;
+
       alloc = root;
    }
 
+   /* values with extra space are each the caller's own: never shared */
+   if ((state.settings.settings & json_enable_dedupe) && !state.settings.value_extra)
+      return dedupe_tree (&state.settings, root);
+
    return root;
 
 e_unknown_value:
@@ -954,7 +1127,11 @@ e_unknown_value:
 
 e_alloc_failure:
 
-   strcpy (error, "Memory allocation failure");
+   if (state.nodes)
+      sprintf (error, "%u:%u: Too deeply nested", line_and_col);
+   else
+      strcpy (error, "Memory allocation failure");
+
    goto e_failed;
 
 e_overflow:
@@ -972,6 +1149,9 @@ e_failed:
          strcpy (error_buf, "Unknown error");
    }
 
+   if (state.nodes)
+      return 0;
+
    if (state.first_pass)
       alloc = root;
 
@@ -988,12 +1168,32 @@ e_failed:
    return 0;
 }
 
+json_value * json_parse_ex (json_settings * settings,
+                            const json_char * json,
+                            size_t length,
+                            char * error_buf)
+{
+   return parse_document (settings, json, length, error_buf, 0, 0);
+}
+
 json_value * json_parse (const json_char * json, size_t length)
 {
    json_settings settings = { 0 };
    return json_parse_ex (&settings, json, length, 0);
 }
 
+int json_validate_ex (json_settings * settings,
+                      const json_char * json,
+                      size_t length,
+                      char * error_buf)
+{
+   json_value nodes [LIBJSON_VALIDATE_STACK_SIZE];
+   json_settings defaults = { 0 };
+
+   return parse_document (settings ? settings : &defaults, json, length, error_buf,
+                          nodes, LIBJSON_VALIDATE_STACK_SIZE) != 0;
+}
+
 void json_value_free_ex (json_settings * settings, json_value * value)
 {
    json_value * cur_value;
@@ -1001,6 +1201,12 @@ void json_value_free_ex (json_settings * settings, json_value * value)
    if (!value)
       return;
 
+   if (is_image_root (value))
+   {
+      image_release (settings, value);
+      return;
+   }
+
    value->parent = 0;
 
    while (value)
@@ -1051,158 +1257,5921 @@ void json_value_free (json_value * value)
    json_value_free_ex (&settings, value);
 }
 
- void print_depth_shift(int depth)
+/* Flat images of a parsed tree.
+ *
+ * An image is a single block holding a header, every json_value of the tree
+ * (in breadth-first order, root first) and the arrays, object entries and
+ * strings they point to.  Pointers inside the block are stored as offsets
+ * from the start of the block, so the block can be written to disk as-is;
+ * image_relocate turns the offsets back into pointers after loading.
+ *
+ * The root of a relocated image is tagged through _reserved so that
+ * json_value_free can release the whole block at once.
+ */
+
+#define JSON_IMAGE_MAGIC    "JLLI"
+#define JSON_IMAGE_VERSION  1
+
+typedef struct
 {
-        int j;
-        for (j=0; j < depth; j++) {
-                printf(" ");
-        }
-}
+   char magic [4];
+   uint32_t version;
+   uint32_t value_size;    /* images only match the json_value layout they were built with */
+   uint32_t release;       /* set when loading: how the block goes, IMAGE_RELEASE_* */
 
-//////////////////////////////////////////////////////////////////////////////////////////////////////////////
+   uint64_t image_size;
+   uint64_t nodes;
 
+   /* what the image was built from (used by the parse cache) */
+   uint64_t source_size;
+   uint64_t source_mtime;  /* nanoseconds */
+   uint64_t source_hash;
 
-void process_value(json_value* value, int depth);
+} json_image_header;
 
- void process_object(json_value* value, int depth)
+#define IMAGE_RELEASE_FREE      0  /* malloc'd */
+#define IMAGE_RELEASE_SETTINGS  1  /* from mem_alloc of the parse settings */
+
+#define IMAGE_HEADER_SIZE \
+   ((sizeof (json_image_header) + 15) & ~ (size_t) 15)
+
+#define IMAGE_NODES(image) \
+   ((json_value *) (((char *) (image)) + IMAGE_HEADER_SIZE))
+
+#define IMAGE_OFFSET(image, ptr) \
+   ((void *) (uintptr_t) (((const char *) (ptr)) - ((const char *) (image))))
+
+#define IMAGE_POINTER(image, off) \
+   ((void *) (((char *) (image)) + (uintptr_t) (off)))
+
+static const char json_image_marker = 0;
+
+static int is_image_root (const json_value * value)
 {
-        int length, x;
-        if (value == NULL) {
-                return;
-        }
-        length = value->u.object.length;
-        for (x = 0; x < length; x++) {
-                print_depth_shift(depth);
-                printf("object[%d].name = %s\n", x, value->u.object.values[x].name);
-                process_value(value->u.object.values[x].value, depth+1);
-                
-        }
+   return value->_reserved.object_mem == (void *) &json_image_marker;
 }
 
- void process_array(json_value* value, int depth)
+static uint64_t fnv1a_64 (uint64_t hash, const void * data, size_t length)
 {
-        int length, x;
-        if (value == NULL) {
-                return;
-        }
-        length = value->u.array.length;
-        printf("array\n");
-        for (x = 0; x < length; x++) {
-                process_value(value->u.array.values[x], depth);
-        }
+   const unsigned char * p = (const unsigned char *) data;
+
+   while (length --)
+   {
+      hash ^= *p ++;
+      hash *= 0x100000001b3ULL;
+   }
+
+   return hash;
 }
 
- void process_value(json_value* value, int depth)
+#define FNV1A_64_INIT 0xcbf29ce484222325ULL
+
+/* Depth-first walks without recursion: trees as deep as the parser accepts
+ * are walked on a heap stack.  walk_child hands out the children of the
+ * frame on top one at a time, and 0 once they are all done.
+ */
+
+typedef struct
 {
+   const json_value * value;
+   unsigned int index;
 
+} walk_frame;
 
-        if (value == NULL) {
-                return;
-        }
-        if (value->type != json_object) {
-                print_depth_shift(depth);
-        }
-        switch (value->type) {
-                case json_none:
-                        printf("none\n");
-                        
-                        break;
-                case json_null:
-                        printf("null\n");
-                                                
-                        break;
-                case json_object:
-                        process_object(value, depth+1);
-                                                
-                        break;
-                case json_array:
-                        process_array(value, depth+1);
-                                                
-                        break;
-                case json_integer:
-                        printf("int: %10ld\n", (long)value->u.integer);
-                                                
-                        break;
-                case json_double:
-                        printf("double: %f\n", value->u.dbl);
-                                                
-                        break;
-                case json_string:
-                        printf("string: %s\n", value->u.string.ptr);
-                                                
-                        break;
-                case json_boolean:
-                        printf("bool: %d\n", value->u.boolean);
-                                                
-                        break;
-        }
+typedef struct
+{
+   walk_frame * frames;
+   size_t depth, size;
 
-}
+} walk_stack;
 
-void getter(json_value* value)
+static int walk_push (walk_stack * stack, const json_value * value)
 {
-int depth=0;
-            int length,j;
-      
-        length = value->u.object.length;
-       
-        do {
-        printf("give object index : ");
-        scanf("%d", &j);}while(j>length);
-        
-        
-              
-                printf("\n");
-                print_depth_shift(depth);
-                printf("depth %d\n",depth);
-                printf("key of object[%d] : %s\n", j, value->u.object.values[j].name);
-                printf("value is ");
-                process_value(value->u.object.values[j].value, depth);
-                printf("\n");
+   if (stack->depth == stack->size)
+   {
+      size_t size = stack->size ? stack->size * 2 : 32;
+      walk_frame * frames = (walk_frame *) realloc
+         (stack->frames, size * sizeof (walk_frame));
+
+      if (!frames)
+         return 0;
+
+      stack->frames = frames;
+      stack->size = size;
+   }
+
+   stack->frames [stack->depth].value = value;
+   stack->frames [stack->depth].index = 0;
+   ++ stack->depth;
+
+   return 1;
 }
 
-void get_key(json_value* value)
+static const json_value * walk_child (walk_frame * frame)
 {
-int depth=0;
-            int length,j;
-      
-        length = value->u.object.length;
-       
-        do {
-        printf("give object index : ");
-        scanf("%d", &j);}while(j>length);
-        
-        
-              
-                printf("\n");
-                print_depth_shift(depth);
-                printf("key of object[%d] : %s\n", j, value->u.object.values[j].name);
-                printf("\n");
+   const json_value * value = frame->value;
+
+   switch (value->type)
+   {
+      case json_array:
+
+         if (frame->index < value->u.array.length)
+            return value->u.array.values [frame->index ++];
+
+         break;
+
+      case json_object:
+
+         if (frame->index < value->u.object.length)
+            return value->u.object.values [frame->index ++].value;
+
+         break;
+
+      default:
+         break;
+   };
+
+   return 0;
 }
 
-void get_value(json_value* value)
+static void image_count_value (const json_value * value, size_t * nodes,
+                               size_t * pointer_bytes, size_t * char_bytes)
 {
-int depth=0;
-            int length,j;
-      
-        length = value->u.object.length;
-       
-        do {
-        printf("give object index : ");
-        scanf("%d", &j);}while(j>length);
-        
-        
-              
-                printf("\n");
-                print_depth_shift(depth);
-                printf("value of object[%d] : ", j);
-                process_value(value->u.object.values[j].value, depth+1);
-                printf("\n");
-}
+   unsigned int i;
+
+   ++ *nodes;
 
+   switch (value->type)
+   {
+      case json_array:
 
+         *pointer_bytes += value->u.array.length * sizeof (json_value *);
+         break;
 
-int setter(int argc, char **argv)
+      case json_object:
+
+         *pointer_bytes += value->u.object.length * sizeof (json_object_entry);
+
+         for (i = 0; i < value->u.object.length; ++ i)
+            *char_bytes += value->u.object.values [i].name_length + 1;
+
+         break;
+
+      case json_string:
+
+         *char_bytes += value->u.string.length + 1;
+         break;
+
+      default:
+         break;
+   };
+}
+
+/* 0 when out of memory */
+static int image_count (const json_value * root, size_t * nodes,
+                        size_t * pointer_bytes, size_t * char_bytes)
+{
+   walk_stack stack = { 0 };
+   const json_value * child;
+
+   image_count_value (root, nodes, pointer_bytes, char_bytes);
+
+   if (!walk_push (&stack, root))
+      return 0;
+
+   while (stack.depth > 0)
+   {
+      if (! (child = walk_child (&stack.frames [stack.depth - 1])))
+      {
+         -- stack.depth;
+         continue;
+      }
+
+      image_count_value (child, nodes, pointer_bytes, char_bytes);
+
+      if ((child->type == json_array || child->type == json_object)
+            && !walk_push (&stack, child))
+      {
+         free (stack.frames);
+         return 0;
+      }
+   }
+
+   free (stack.frames);
+   return 1;
+}
+
+typedef struct
+{
+   size_t nodes, pointer_bytes, char_bytes;
+
+} image_layout;
+
+/* 0 when out of memory */
+static size_t image_measure (const json_value * root, image_layout * layout)
+{
+   memset (layout, 0, sizeof (*layout));
+
+   if (!image_count (root, &layout->nodes, &layout->pointer_bytes, &layout->char_bytes))
+      return 0;
+
+   return IMAGE_HEADER_SIZE + layout->nodes * sizeof (json_value)
+            + layout->pointer_bytes + layout->char_bytes;
+}
+
+/* Fill a zeroed block of image_measure () bytes.  The magic is left to the
+ * caller so that it can be written last when the block is already shared.
+ */
+static void image_fill (json_image_header * image, const json_value * root,
+                        const image_layout * layout)
+{
+   json_value * nodes;
+   size_t i, next;
+   char * pointers, * chars;
+
+   image->version = JSON_IMAGE_VERSION;
+   image->value_size = sizeof (json_value);
+   image->image_size = IMAGE_HEADER_SIZE + layout->nodes * sizeof (json_value)
+                          + layout->pointer_bytes + layout->char_bytes;
+   image->nodes = layout->nodes;
+
+   nodes = IMAGE_NODES (image);
+   pointers = (char *) (nodes + layout->nodes);
+   chars = pointers + layout->pointer_bytes;
+
+   /* Breadth-first copy: while a node is waiting to be filled in, its
+    * _reserved field points at the source value it was copied from.
+    */
+   nodes [0] = *root;
+   nodes [0].parent = 0;
+   nodes [0]._reserved.next_alloc = (json_value *) root;
+
+   for (i = 0, next = 1; i < next; ++ i)
+   {
+      json_value * value = &nodes [i];
+      const json_value * src = value->_reserved.next_alloc;
+      unsigned int j;
+
+      value->_reserved.next_alloc = 0;
+
+      switch (src->type)
+      {
+         case json_array:
+         {
+            json_value ** values = (json_value **) pointers;
+
+            pointers += src->u.array.length * sizeof (json_value *);
+            value->u.array.values = src->u.array.length ?
+               (json_value **) IMAGE_OFFSET (image, values) : 0;
+
+            for (j = 0; j < src->u.array.length; ++ j, ++ next)
+            {
+               nodes [next] = *src->u.array.values [j];
+               nodes [next].parent = (json_value *) IMAGE_OFFSET (image, value);
+               nodes [next]._reserved.next_alloc = src->u.array.values [j];
+
+               values [j] = (json_value *) IMAGE_OFFSET (image, &nodes [next]);
+            }
+
+            break;
+         }
+
+         case json_object:
+         {
+            json_object_entry * entries = (json_object_entry *) pointers;
+
+            pointers += src->u.object.length * sizeof (json_object_entry);
+            value->u.object.values = src->u.object.length ?
+               (json_object_entry *) IMAGE_OFFSET (image, entries) : 0;
+
+            for (j = 0; j < src->u.object.length; ++ j, ++ next)
+            {
+               const json_object_entry * entry = &src->u.object.values [j];
+
+               memcpy (chars, entry->name, entry->name_length + 1);
+               entries [j].name = (json_char *) IMAGE_OFFSET (image, chars);
+               entries [j].name_length = entry->name_length;
+               chars += entry->name_length + 1;
+
+               nodes [next] = *entry->value;
+               nodes [next].parent = (json_value *) IMAGE_OFFSET (image, value);
+               nodes [next]._reserved.next_alloc = entry->value;
+
+               entries [j].value = (json_value *) IMAGE_OFFSET (image, &nodes [next]);
+            }
+
+            break;
+         }
+
+         case json_string:
+
+            memcpy (chars, src->u.string.ptr, src->u.string.length + 1);
+            value->u.string.ptr = (json_char *) IMAGE_OFFSET (image, chars);
+            chars += src->u.string.length + 1;
+
+            break;
+
+         default:
+            break;
+      };
+   }
+
+}
+
+static json_image_header * image_build (const json_value * root)
+{
+   json_image_header * image;
+   image_layout layout;
+   size_t size = image_measure (root, &layout);
+
+   if (!size || ! (image = (json_image_header *) calloc (1, size)))
+      return 0;
+
+   image_fill (image, root, &layout);
+   memcpy (image->magic, JSON_IMAGE_MAGIC, 4);
+
+   return image;
+}
+
+/* A block read back from disk is only relocated when it is laid out exactly
+ * as image_fill writes it: arrays and entries handed out in node order from
+ * the end of the nodes, strings and names after them, every child a node
+ * further down that names its parent.  Nothing then overlaps, every offset
+ * stays inside the block and the nodes form a tree.
+ */
+
+static int image_child (const json_image_header * image, const void * off,
+                        uint64_t parent)
+{
+   uint64_t offset = (uint64_t) (uintptr_t) off, index;
+
+   if (offset < IMAGE_HEADER_SIZE
+         || (offset - IMAGE_HEADER_SIZE) % sizeof (json_value) != 0)
+   {
+      return 0;
+   }
+
+   index = (offset - IMAGE_HEADER_SIZE) / sizeof (json_value);
+
+   return index > parent && index < image->nodes
+      && (uint64_t) (uintptr_t) IMAGE_NODES (image) [index].parent
+            == IMAGE_HEADER_SIZE + parent * sizeof (json_value);
+}
+
+static int image_chars (const json_image_header * image, const void * off,
+                        unsigned int length, uint64_t * chars)
+{
+   if ((uint64_t) (uintptr_t) off != *chars
+         || (uint64_t) length + 1 > image->image_size - *chars
+         || ((const char *) image) [*chars + length] != 0)
+   {
+      return 0;
+   }
+
+   *chars += (uint64_t) length + 1;
+   return 1;
+}
+
+/* Turns the offsets of a block of size bytes back into pointers, or returns
+ * 0 when the block is not a well-formed image.
+ */
+static json_value * image_relocate (json_image_header * image, size_t size)
+{
+   json_value * nodes = IMAGE_NODES (image);
+   uint64_t i, pointers, chars;
+   unsigned int j;
+
+   if (image->image_size != size || image->nodes == 0
+         || image->nodes > (size - IMAGE_HEADER_SIZE) / sizeof (json_value)
+         || nodes [0].parent)
+   {
+      return 0;
+   }
+
+   pointers = IMAGE_HEADER_SIZE + image->nodes * sizeof (json_value);
+   chars = pointers;
+
+   for (i = 0; i < image->nodes; ++ i)
+   {
+      if (nodes [i].type == json_array)
+         chars += (uint64_t) nodes [i].u.array.length * sizeof (json_value *);
+      else if (nodes [i].type == json_object)
+         chars += (uint64_t) nodes [i].u.object.length * sizeof (json_object_entry);
+   }
+
+   if (chars > size)
+      return 0;
+
+   for (i = 0; i < image->nodes; ++ i)
+   {
+      json_value * value = &nodes [i];
+
+      /* the parent offset was checked by image_child from the parent */
+      if (value->parent)
+         value->parent = (json_value *) IMAGE_POINTER (image, value->parent);
+
+      memset (&value->_reserved, 0, sizeof (value->_reserved));
+
+      switch (value->type)
+      {
+         case json_array:
+
+            if (!value->u.array.length)
+               break;
+
+            if ((uint64_t) (uintptr_t) value->u.array.values != pointers)
+               return 0;
+
+            pointers += (uint64_t) value->u.array.length * sizeof (json_value *);
+
+            value->u.array.values = (json_value **)
+               IMAGE_POINTER (image, value->u.array.values);
+
+            for (j = 0; j < value->u.array.length; ++ j)
+            {
+               if (!image_child (image, value->u.array.values [j], i))
+                  return 0;
+
+               value->u.array.values [j] = (json_value *)
+                  IMAGE_POINTER (image, value->u.array.values [j]);
+            }
+
+            break;
+
+         case json_object:
+
+            if (!value->u.object.length)
+               break;
+
+            if ((uint64_t) (uintptr_t) value->u.object.values != pointers)
+               return 0;
+
+            pointers += (uint64_t) value->u.object.length * sizeof (json_object_entry);
+
+            value->u.object.values = (json_object_entry *)
+               IMAGE_POINTER (image, value->u.object.values);
+
+            for (j = 0; j < value->u.object.length; ++ j)
+            {
+               json_object_entry * entry = &value->u.object.values [j];
+
+               if (!image_chars (image, entry->name, entry->name_length, &chars)
+                     || !image_child (image, entry->value, i))
+               {
+                  return 0;
+               }
+
+               entry->name = (json_char *) IMAGE_POINTER (image, entry->name);
+               entry->value = (json_value *) IMAGE_POINTER (image, entry->value);
+            }
+
+            break;
+
+         case json_string:
+
+            if (!image_chars (image, value->u.string.ptr, value->u.string.length, &chars))
+               return 0;
+
+            value->u.string.ptr = (json_char *)
+               IMAGE_POINTER (image, value->u.string.ptr);
+
+            break;
+
+         case json_integer:
+         case json_double:
+         case json_boolean:
+         case json_null:
+            break;
+
+         default:
+            return 0;
+      };
+   }
+
+   nodes [0]._reserved.object_mem = (void *) &json_image_marker;
+
+   return nodes;
+}
+
+static void image_release (json_settings * settings, json_value * root)
+{
+   json_image_header * image = (json_image_header *)
+      (((char *) root) - IMAGE_HEADER_SIZE);
+
+   if (image->release == IMAGE_RELEASE_SETTINGS)
+   {
+      settings->mem_free (image, settings->user_data);
+      return;
+   }
+
+   free (image);
+}
+
+/* Parse cache.
+ *
+ * The image of a parsed file is kept in <file>.jllc (or, when a cache
+ * directory is given, in <dir>/<hash of the path>.jllc) together with the
+ * size, modification time and FNV-1a hash of the file it was built from.
+ * On a hit the cache file is read into one allocated block and its offsets
+ * are relocated there in a single pass; nothing is parsed.  A block that is
+ * not laid out exactly as image_fill writes it is a miss.
+ */
+
+static uint64_t file_mtime (const struct stat * st)
+{
+   uint64_t mtime = ((uint64_t) st->st_mtime) * 1000000000ULL;
+
+   #if defined(__APPLE__)
+      mtime += st->st_mtimespec.tv_nsec;
+   #elif defined(__linux__) || defined(_POSIX_C_SOURCE)
+      mtime += st->st_mtim.tv_nsec;
+   #endif
+
+   return mtime;
+}
+
+static char * read_whole_file (const char * filename, size_t * length)
+{
+   FILE * file;
+   char * contents;
+   long size;
+
+   if (! (file = fopen (filename, "rb")))
+      return 0;
+
+   if (fseek (file, 0, SEEK_END) != 0 || (size = ftell (file)) < 0)
+   {
+      fclose (file);
+      return 0;
+   }
+
+   fseek (file, 0, SEEK_SET);
+
+   if (! (contents = (char *) malloc (size + 1)))
+   {
+      fclose (file);
+      return 0;
+   }
+
+   if (fread (contents, 1, size, file) != (size_t) size)
+   {
+      fclose (file);
+      free (contents);
+      return 0;
+   }
+
+   fclose (file);
+
+   contents [size] = 0;
+   *length = size;
+
+   return contents;
+}
+
+static void cache_filename (char * buf, size_t size, const char * filename,
+                            const char * cache_dir)
+{
+   if (cache_dir)
+   {
+      snprintf (buf, size, "%s/%016llx.jllc", cache_dir, (unsigned long long)
+                  fnv1a_64 (FNV1A_64_INIT, filename, strlen (filename)));
+   }
+   else
+      snprintf (buf, size, "%s.jllc", filename);
+}
+
+static json_value * cache_load (const char * cache_file, const char * filename,
+                                const struct stat * st)
+{
+   json_image_header header, * image;
+   json_value * value;
+   FILE * file;
+
+   if (! (file = fopen (cache_file, "rb")))
+      return 0;
+
+   if (fread (&header, sizeof (header), 1, file) != 1
+         || memcmp (header.magic, JSON_IMAGE_MAGIC, 4)
+         || header.version != JSON_IMAGE_VERSION
+         || header.value_size != sizeof (json_value)
+         || header.source_size != (uint64_t) st->st_size
+         || header.image_size < IMAGE_HEADER_SIZE + sizeof (json_value))
+   {
+      fclose (file);
+      return 0;
+   }
+
+   if (header.source_mtime != file_mtime (st))
+   {
+      /* Touched but possibly unchanged: compare contents before giving up,
+       * and refresh the stored time on a match.
+       */
+      size_t length;
+      char * contents = read_whole_file (filename, &length);
+      uint64_t hash;
+
+      if (!contents)
+      {
+         fclose (file);
+         return 0;
+      }
+
+      hash = fnv1a_64 (FNV1A_64_INIT, contents, length);
+      free (contents);
+
+      if (hash != header.source_hash)
+      {
+         fclose (file);
+         return 0;
+      }
+
+      fclose (file);
+
+      if ((file = fopen (cache_file, "r+b")))
+      {
+         header.source_mtime = file_mtime (st);
+         fwrite (&header, sizeof (header), 1, file);
+         fclose (file);
+      }
+
+      if (! (file = fopen (cache_file, "rb")))
+         return 0;
+   }
+
+   /* the block gets memory of its own: relocating a mapping of the file
+    * would write, and so copy, every one of its pages anyway
+    */
+   if (fseek (file, 0, SEEK_END) != 0
+         || (uint64_t) ftell (file) != header.image_size
+         || fseek (file, 0, SEEK_SET) != 0
+         || ! (image = (json_image_header *) malloc ((size_t) header.image_size)))
+   {
+      fclose (file);
+      return 0;
+   }
+
+   if (fread (image, 1, (size_t) header.image_size, file) != header.image_size)
+   {
+      fclose (file);
+      free (image);
+      return 0;
+   }
+
+   fclose (file);
+   image->release = IMAGE_RELEASE_FREE;
+
+   /* a damaged or foreign cache file is a miss: the source gets parsed */
+   if (! (value = image_relocate (image, (size_t) header.image_size)))
+      free (image);
+
+   return value;
+}
+
+static void cache_store (const char * cache_file, json_image_header * image)
+{
+   char tmp_file [FILENAME_SIZE + 32];
+   FILE * file;
+
+   snprintf (tmp_file, sizeof (tmp_file), "%s.tmp", cache_file);
+
+   if (! (file = fopen (tmp_file, "wb")))
+      return;
+
+   if (fwrite (image, 1, (size_t) image->image_size, file) != image->image_size)
+   {
+      fclose (file);
+      remove (tmp_file);
+      return;
+   }
+
+   fclose (file);
+
+   #ifdef _WIN32
+      remove (cache_file);
+   #endif
+
+   if (rename (tmp_file, cache_file) != 0)
+      remove (tmp_file);
+}
+
+json_value * json_parse_file_cached (json_settings * settings,
+                                     const char * filename,
+                                     const char * cache_dir,
+                                     char * error_buf)
+{
+   json_settings default_settings = { 0 };
+   char cache_file [FILENAME_SIZE];
+   json_image_header * image;
+   json_value * value;
+   struct stat st;
+   char * contents;
+   size_t length;
+
+   if (!settings)
+      settings = &default_settings;
+
+   if (stat (filename, &st) != 0)
+   {
+      if (error_buf)
+         sprintf (error_buf, "Unable to stat %.100s", filename);
+
+      return 0;
+   }
+
+   cache_filename (cache_file, sizeof (cache_file), filename, cache_dir);
+
+   /* extra per-value space and custom allocators can't be honoured by an
+    * image, so those callers always get a freshly parsed tree
+    */
+   if (!settings->value_extra && !settings->mem_alloc
+         && (value = cache_load (cache_file, filename, &st)))
+   {
+      return value;
+   }
+
+   if (! (contents = read_whole_file (filename, &length)))
+   {
+      if (error_buf)
+         sprintf (error_buf, "Unable to read %.100s", filename);
+
+      return 0;
+   }
+
+   value = json_parse_ex (settings, contents, length, error_buf);
+
+   if (!value || settings->value_extra || settings->mem_alloc)
+   {
+      free (contents);
+      return value;
+   }
+
+   if (! (image = image_build (value)))
+   {
+      free (contents);
+      return value;
+   }
+
+   image->source_size = length;
+   image->source_mtime = file_mtime (&st);
+   image->source_hash = fnv1a_64 (FNV1A_64_INIT, contents, length);
+
+   free (contents);
+
+   cache_store (cache_file, image);
+
+   json_value_free (value);
+
+   image->release = IMAGE_RELEASE_FREE;
+   return image_relocate (image, (size_t) image->image_size);
+}
+
+/* Shared images.
+ *
+ * The same offset-based block the parse cache stores can be published in
+ * POSIX shared memory and read in place by other processes: nothing in the
+ * block is relocated, the accessors below resolve offsets on the fly.
+ */
+
+struct _json_image
+{
+   json_image_header header;
+};
+
+json_image * json_image_create (const json_value * value)
+{
+   return (json_image *) image_build (value);
+}
+
+void json_image_free (json_image * image)
+{
+   free (image);
+}
+
+size_t json_image_size (const json_image * image)
+{
+   return (size_t) image->header.image_size;
+}
+
+#if defined(JSON_HAVE_MMAP) && defined(JSON_HAVE_ATOMICS)
+
+/* Each image is an object of its own, <name>.<generation>, never rewritten:
+ * readers keep the one they mapped.  The object under the name itself only
+ * holds the current generation, switched to a new image once that image is
+ * complete, so a reader finds either the old image or the new one.
+ *
+ * The magic of an image is the last thing its publisher writes, with a
+ * release store; a reader that sees it with an acquire load sees the whole
+ * block.
+ */
+
+#define JSON_IMAGE_NAME_MAGIC  "JLLN"
+
+typedef struct
+{
+   uint32_t magic;
+   uint32_t version;
+   uint64_t generation;  /* 0 until the first image is in place */
+
+} image_name;
+
+static int image_check (const json_image_header * image, size_t size)
+{
+   uint32_t magic, expected;
+
+   magic = json_atomic_load ((const uint32_t *) image->magic);
+   memcpy (&expected, JSON_IMAGE_MAGIC, 4);
+
+   return size >= IMAGE_HEADER_SIZE + sizeof (json_value)
+      && magic == expected
+      && image->version == JSON_IMAGE_VERSION
+      && image->value_size == sizeof (json_value)
+      && image->image_size == size;
+}
+
+static int image_generation_name (char * buf, size_t size, const char * name,
+                                  uint64_t generation)
+{
+   int length = snprintf (buf, size, "%s.%llu", name, (unsigned long long) generation);
+
+   return length > 0 && (size_t) length < size;
+}
+
+/* the object under name, mapped; created when writable and missing */
+static image_name * image_name_map (const char * name, int writable)
+{
+   image_name * names;
+   uint32_t magic;
+   struct stat st;
+   int fd, err;
+
+   if ((fd = shm_open (name, writable ? O_CREAT | O_RDWR : O_RDONLY, 0644)) == -1)
+      return 0;
+
+   /* publishers that race to create it size it alike */
+   if (fstat (fd, &st) != 0
+         || (writable && st.st_size == 0 && ftruncate (fd, sizeof (image_name)) != 0))
+   {
+      err = errno;
+      close (fd);
+      errno = err;
+      return 0;
+   }
+
+   if (st.st_size != 0 && st.st_size != sizeof (image_name))
+   {
+      close (fd);
+      errno = EINVAL;
+      return 0;
+   }
+
+   if (!writable && st.st_size == 0)
+   {
+      close (fd);
+      errno = EAGAIN;
+      return 0;
+   }
+
+   names = (image_name *) mmap (0, sizeof (image_name), writable ?
+      PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+   err = errno;
+   close (fd);
+
+   if (names == MAP_FAILED)
+   {
+      errno = err;
+      return 0;
+   }
+
+   memcpy (&magic, JSON_IMAGE_NAME_MAGIC, 4);
+
+   if (writable && !json_atomic_load (&names->magic))
+   {
+      names->version = JSON_IMAGE_VERSION;
+      json_atomic_store (&names->magic, magic);
+   }
+
+   if (json_atomic_load (&names->magic) != magic)
+   {
+      errno = json_atomic_load (&names->magic) ? EINVAL : EAGAIN;
+      munmap (names, sizeof (image_name));
+      return 0;
+   }
+
+   return names;
+}
+
+/* a new object holding the image of value; its generation in *generation */
+static int image_publish_new (const char * name, const json_value * value,
+                              uint64_t * generation)
+{
+   char object [FILENAME_SIZE];
+   json_image_header * image;
+   image_layout layout;
+   size_t size = image_measure (value, &layout);
+   uint32_t magic;
+   int fd, err;
+
+   if (!size)
+      return ENOMEM;
+
+   for (;;)
+   {
+      if (!image_generation_name (object, sizeof (object), name, ++ *generation))
+         return ENAMETOOLONG;
+
+      if ((fd = shm_open (object, O_CREAT | O_EXCL | O_RDWR, 0644)) != -1)
+         break;
+
+      if (errno != EEXIST)
+         return errno;
+   }
+
+   if (ftruncate (fd, (off_t) size) != 0)
+   {
+      err = errno;
+      close (fd);
+      shm_unlink (object);
+      return err;
+   }
+
+   image = (json_image_header *) mmap (0, size, PROT_READ | PROT_WRITE,
+                                       MAP_SHARED, fd, 0);
+   err = errno;
+   close (fd);
+
+   if (image == MAP_FAILED)
+   {
+      shm_unlink (object);
+      return err;
+   }
+
+   image_fill (image, value, &layout);
+
+   memcpy (&magic, JSON_IMAGE_MAGIC, 4);
+   json_atomic_store ((uint32_t *) image->magic, magic);
+
+   munmap (image, size);
+   return 0;
+}
+
+int json_image_publish (const char * name, const json_value * value)
+{
+   char object [FILENAME_SIZE];
+   image_name * names;
+   uint64_t generation, previous;
+   int err;
+
+   if (! (names = image_name_map (name, 1)))
+      return errno;
+
+   previous = generation = json_atomic_load (&names->generation);
+
+   if ((err = image_publish_new (name, value, &generation)))
+   {
+      munmap (names, sizeof (image_name));
+      return err;
+   }
+
+   /* whatever was current, a publisher racing this one included, is
+    * replaced and its object unlinked */
+   while (!json_atomic_swap (&names->generation, &previous, generation))
+      ;
+
+   munmap (names, sizeof (image_name));
+
+   if (previous && image_generation_name (object, sizeof (object), name, previous))
+      shm_unlink (object);
+
+   return 0;
+}
+
+json_image * json_image_attach (const char * name)
+{
+   char object [FILENAME_SIZE];
+   json_image_header * image;
+   image_name * names;
+   uint64_t generation;
+   struct stat st;
+   int fd, err;
+
+   if (! (names = image_name_map (name, 0)))
+      return 0;
+
+   for (;;)
+   {
+      if (! (generation = json_atomic_load (&names->generation)))
+      {
+         munmap (names, sizeof (image_name));
+         errno = EAGAIN;
+         return 0;
+      }
+
+      image_generation_name (object, sizeof (object), name, generation);
+
+      if ((fd = shm_open (object, O_RDONLY, 0)) != -1)
+         break;
+
+      /* replaced, and unlinked, since the generation was read */
+      if (errno != ENOENT || json_atomic_load (&names->generation) == generation)
+      {
+         err = errno;
+         munmap (names, sizeof (image_name));
+         errno = err;
+         return 0;
+      }
+   }
+
+   munmap (names, sizeof (image_name));
+
+   if (fstat (fd, &st) != 0 || (size_t) st.st_size < IMAGE_HEADER_SIZE)
+   {
+      close (fd);
+      return 0;
+   }
+
+   image = (json_image_header *) mmap (0, (size_t) st.st_size, PROT_READ,
+                                       MAP_SHARED, fd, 0);
+   close (fd);
+
+   if (image == MAP_FAILED)
+      return 0;
+
+   if (!image_check (image, (size_t) st.st_size))
+   {
+      munmap (image, (size_t) st.st_size);
+      errno = EINVAL;
+      return 0;
+   }
+
+   return (json_image *) image;
+}
+
+void json_image_detach (json_image * image)
+{
+   if (image)
+      munmap (image, (size_t) image->header.image_size);
+}
+
+int json_image_unlink (const char * name)
+{
+   char object [FILENAME_SIZE];
+   image_name * names;
+   uint64_t generation;
+
+   if ((names = image_name_map (name, 0)))
+   {
+      generation = json_atomic_load (&names->generation);
+      munmap (names, sizeof (image_name));
+
+      if (generation && image_generation_name (object, sizeof (object), name, generation))
+         shm_unlink (object);
+   }
+
+   return shm_unlink (name) == 0 ? 0 : errno;
+}
+
+#else
+
+int json_image_publish (const char * name, const json_value * value)
+{
+   (void) name;
+   (void) value;
+   return ENOSYS;
+}
+
+json_image * json_image_attach (const char * name)
+{
+   (void) name;
+   errno = ENOSYS;
+   return 0;
+}
+
+void json_image_detach (json_image * image)
+{
+   (void) image;
+}
+
+int json_image_unlink (const char * name)
+{
+   (void) name;
+   return ENOSYS;
+}
+
+#endif
+
+const json_value * json_image_root (const json_image * image)
+{
+   return IMAGE_NODES (image);
+}
+
+const json_value * json_image_parent (const json_image * image,
+                                      const json_value * value)
+{
+   return value->parent ?
+      (const json_value *) IMAGE_POINTER (image, value->parent) : 0;
+}
+
+const json_value * json_image_array_get (const json_image * image,
+                                         const json_value * array,
+                                         unsigned int index)
+{
+   json_value * const * values;
+
+   if (array->type != json_array || index >= array->u.array.length)
+      return 0;
+
+   values = (json_value * const *) IMAGE_POINTER (image, array->u.array.values);
+
+   return (const json_value *) IMAGE_POINTER (image, values [index]);
+}
+
+const json_char * json_image_object_key (const json_image * image,
+                                         const json_value * object,
+                                         unsigned int index)
+{
+   const json_object_entry * entries;
+
+   if (object->type != json_object || index >= object->u.object.length)
+      return 0;
+
+   entries = (const json_object_entry *)
+      IMAGE_POINTER (image, object->u.object.values);
+
+   return (const json_char *) IMAGE_POINTER (image, entries [index].name);
+}
+
+const json_value * json_image_object_value (const json_image * image,
+                                            const json_value * object,
+                                            unsigned int index)
+{
+   const json_object_entry * entries;
+
+   if (object->type != json_object || index >= object->u.object.length)
+      return 0;
+
+   entries = (const json_object_entry *)
+      IMAGE_POINTER (image, object->u.object.values);
+
+   return (const json_value *) IMAGE_POINTER (image, entries [index].value);
+}
+
+const json_value * json_image_object_get (const json_image * image,
+                                          const json_value * object,
+                                          const json_char * key)
+{
+   const json_object_entry * entries;
+   unsigned int i;
+
+   if (object->type != json_object || !object->u.object.length)
+      return 0;
+
+   entries = (const json_object_entry *)
+      IMAGE_POINTER (image, object->u.object.values);
+
+   for (i = 0; i < object->u.object.length; ++ i)
+   {
+      if (!strcmp ((const json_char *) IMAGE_POINTER (image, entries [i].name), key))
+         return (const json_value *) IMAGE_POINTER (image, entries [i].value);
+   }
+
+   return 0;
+}
+
+const json_char * json_image_string (const json_image * image,
+                                     const json_value * string)
+{
+   if (string->type != json_string)
+      return 0;
+
+   return (const json_char *) IMAGE_POINTER (image, string->u.string.ptr);
+}
+
+/* shortest of %.15g and %.17g that reads back as dbl; buf holds 32 */
+static int format_double (char * buf, double dbl)
+{
+   int length = c_snprintf (buf, 32, "%.15g", dbl);
+
+   if (c_strtod (buf, 0) != dbl)
+      length = c_snprintf (buf, 32, "%.17g", dbl);
+
+   /* keep the token a float */
+   if (!strpbrk (buf, ".eEn"))
+   {
+      buf [length ++] = '.';
+      buf [length ++] = '0';
+      buf [length] = 0;
+   }
+
+   return length;
+}
+
+static int emit_double (json_parser_callback callback, void * userdata, double dbl)
+{
+   char buf [32];
+   int length = format_double (buf, dbl);
+
+   return callback (userdata, JSON_FLOAT, buf, length);
+}
+
+static int emit_scalar (const json_value * value,
+                        json_parser_callback callback, void * userdata)
+{
+   char buf [32];
+
+   switch (value->type)
+   {
+      case json_integer:
+
+         return callback (userdata, JSON_INT, buf,
+            snprintf (buf, sizeof (buf), "%lld", (long long) value->u.integer));
+
+      case json_double:
+
+         return emit_double (callback, userdata, value->u.dbl);
+
+      case json_string:
+
+         return callback (userdata, JSON_STRING, value->u.string.ptr,
+                          value->u.string.length);
+
+      case json_boolean:
+
+         return value->u.boolean ?
+            callback (userdata, JSON_TRUE, "true", 4) :
+            callback (userdata, JSON_FALSE, "false", 5);
+
+      case json_null:
+
+         return callback (userdata, JSON_NULL, "null", 4);
+
+      default:
+         return 0;
+   };
+}
+
+static int emit_begin (const json_value * value,
+                       json_parser_callback callback, void * userdata)
+{
+   return callback (userdata, value->type == json_object ?
+                    JSON_OBJECT_BEGIN : JSON_ARRAY_BEGIN, 0, 0);
+}
+
+int json_value_emit (const json_value * value,
+                     json_parser_callback callback, void * userdata)
+{
+   walk_stack stack = { 0 };
+   const json_value * child;
+   walk_frame * frame;
+   int ret;
+
+   if (value->type != json_object && value->type != json_array)
+      return emit_scalar (value, callback, userdata);
+
+   if ((ret = emit_begin (value, callback, userdata)))
+      return ret;
+
+   if (!walk_push (&stack, value))
+      return JSON_ERROR_NO_MEMORY;
+
+   while (stack.depth > 0)
+   {
+      frame = &stack.frames [stack.depth - 1];
+      value = frame->value;
+
+      if (value->type == json_object && frame->index < value->u.object.length
+            && (ret = callback (userdata, JSON_KEY, value->u.object.values [frame->index].name,
+                                value->u.object.values [frame->index].name_length)))
+      {
+         break;
+      }
+
+      if (! (child = walk_child (frame)))
+      {
+         -- stack.depth;
+
+         if ((ret = callback (userdata, value->type == json_object ?
+                              JSON_OBJECT_END : JSON_ARRAY_END, 0, 0)))
+         {
+            break;
+         }
+
+         continue;
+      }
+
+      if (child->type != json_object && child->type != json_array)
+      {
+         if ((ret = emit_scalar (child, callback, userdata)))
+            break;
+
+         continue;
+      }
+
+      if ((ret = emit_begin (child, callback, userdata)))
+         break;
+
+      if (!walk_push (&stack, child))
+      {
+         ret = JSON_ERROR_NO_MEMORY;
+         break;
+      }
+   }
+
+   free (stack.frames);
+   return ret;
+}
+
+#ifdef JSON_HAVE_THREADS
+
+/* Parallel serialization.
+ *
+ * The tree is cut into subtrees of about total / (threads * 4) estimated
+ * bytes.  What is left of the containers that were cut open (brackets,
+ * keys, commas) is printed in document order into one glue buffer; the
+ * subtrees are printed by the workers, largest first, into buffers of
+ * their own.  Everything is then written out in order with writev.
+ */
+
+#define WRITE_TASKS_PER_THREAD 4
+#define WRITE_MAX_DEPTH 32
+
+#ifndef IOV_MAX
+   #define IOV_MAX 1024
+#endif
+
+typedef struct
+{
+   const json_value * value;  /* subtree, or 0 for a range of the glue */
+   size_t estimate;
+
+   char * buf;
+   size_t offset, length, size;
+   int failed;
+
+} write_piece;
+
+typedef struct
+{
+   size_t estimate;
+   size_t piece;
+
+} write_task;
+
+typedef struct
+{
+   size_t size;  /* of the container's subtree */
+   size_t next;  /* record after the subtree's own */
+
+} write_size;
+
+typedef struct
+{
+   write_piece * pieces;
+   size_t count, size;
+
+   json_printer glue_printer;
+   char * glue;
+   size_t glue_length, glue_size;
+
+   write_size * sizes;
+   size_t sizes_count, sizes_size;
+
+   write_task * order;
+   size_t tasks, next;
+   size_t target;
+   int failed;
+
+} write_job;
+
+static int write_grow (char ** buf, size_t * size, size_t needed)
+{
+   size_t new_size = *size ? *size : 256;
+   char * new_buf;
+
+   while (new_size < needed)
+      new_size *= 2;
+
+   if (! (new_buf = (char *) realloc (*buf, new_size)))
+      return 0;
+
+   *buf = new_buf;
+   *size = new_size;
+   return 1;
+}
+
+static write_piece * write_push (write_job * job)
+{
+   write_piece * pieces;
+
+   if (job->count == job->size)
+   {
+      size_t new_size = job->size ? job->size * 2 : 64;
+
+      if (! (pieces = (write_piece *) realloc (job->pieces,
+                                               new_size * sizeof (write_piece))))
+      {
+         return 0;
+      }
+
+      job->pieces = pieces;
+      job->size = new_size;
+   }
+
+   memset (&job->pieces [job->count], 0, sizeof (write_piece));
+   return &job->pieces [job->count ++];
+}
+
+/* printer callback of the glue: consecutive text makes one piece */
+static int write_glue (void * userdata, const char * data, uint32_t length)
+{
+   write_job * job = (write_job *) userdata;
+   write_piece * piece = job->count ? &job->pieces [job->count - 1] : 0;
+
+   if (job->glue_length + length > job->glue_size
+         && !write_grow (&job->glue, &job->glue_size, job->glue_length + length))
+   {
+      job->failed = 1;
+      return 1;
+   }
+
+   memcpy (job->glue + job->glue_length, data, length);
+
+   if (!piece || piece->value)
+   {
+      if (! (piece = write_push (job)))
+      {
+         job->failed = 1;
+         return 1;
+      }
+
+      piece->offset = job->glue_length;
+   }
+
+   piece->length += length;
+   job->glue_length += length;
+   return 0;
+}
+
+/* printer callback of a subtree */
+static int write_append (void * userdata, const char * data, uint32_t length)
+{
+   write_piece * piece = (write_piece *) userdata;
+
+   if (piece->length + length > piece->size
+         && !write_grow (&piece->buf, &piece->size, piece->length + length))
+   {
+      piece->failed = 1;
+      return 1;
+   }
+
+   memcpy (piece->buf + piece->length, data, length);
+   piece->length += length;
+   return 0;
+}
+
+static int write_event (void * userdata, int type, const char * data, uint32_t length)
+{
+   return json_print_raw ((json_printer *) userdata, type, data, length);
+}
+
+static size_t write_estimate_value (const json_value * value)
+{
+   switch (value->type)
+   {
+      case json_object:
+      {
+         size_t size = 2;
+         unsigned int i;
+
+         for (i = 0; i < value->u.object.length; ++ i)
+            size += value->u.object.values [i].name_length + 4;
+
+         return size;
+      }
+
+      case json_array:
+         return 2 + value->u.array.length;
+
+      case json_string:
+         return value->u.string.length + 2;
+
+      case json_integer:
+      case json_double:
+         return 16;
+
+      default:
+         return 5;
+   };
+}
+
+/* the tail of a subtree that isn't split any further: one piece, which a
+ * worker prints */
+static int write_leaf (write_job * job, const json_value * value, size_t estimate)
+{
+   json_printer * printer = &job->glue_printer;
+   write_piece * piece;
+
+   /* the subtree takes the place of a value: the glue gets the comma the
+    * printer would have put before it */
+   if (!printer->enter_object && !printer->afterkey)
+      write_glue (job, ",", 1);
+
+   printer->enter_object = 0;
+   printer->afterkey = 0;
+   printer->first = 0;
+
+   if (! (piece = write_push (job)))
+      return 0;
+
+   piece->value = value;
+   piece->estimate = estimate;
+   return !job->failed;
+}
+
+static int write_size_push (write_job * job, size_t size)
+{
+   write_size * sizes;
+
+   if (job->sizes_count == job->sizes_size)
+   {
+      size_t new_size = job->sizes_size ? job->sizes_size * 2 : 64;
+
+      if (! (sizes = (write_size *) realloc (job->sizes,
+                                             new_size * sizeof (write_size))))
+      {
+         return 0;
+      }
+
+      job->sizes = sizes;
+      job->sizes_size = new_size;
+   }
+
+   job->sizes [job->sizes_count].size = size;
+   job->sizes [job->sizes_count ++].next = 0;
+   return 1;
+}
+
+/* a rough size of the compact text, without looking into strings, taken in
+ * one walk: every container the split can reach gets its subtree's size in
+ * job->sizes, in the order the containers open.
+ * returns 0, ENOMEM, or EDOM for a NaN or an infinity, which JSON can't
+ * write */
+static int write_measure (write_job * job, const json_value * value, size_t * total)
+{
+   walk_stack stack = { 0 };
+   const json_value * child = value;
+   size_t open [WRITE_MAX_DEPTH + 1];  /* record of each open container */
+   size_t depth;
+   int err = 0;
+
+   *total = 0;
+
+   for (;;)
+   {
+      if (child)
+      {
+         size_t size;
+
+         if (child->type == json_double && !isfinite (child->u.dbl))
+         {
+            err = EDOM;
+            break;
+         }
+
+         size = write_estimate_value (child);
+         depth = stack.depth;
+
+         if (child->type == json_array || child->type == json_object)
+         {
+            if (!walk_push (&stack, child))
+            {
+               err = ENOMEM;
+               break;
+            }
+
+            if (depth <= WRITE_MAX_DEPTH)
+            {
+               if (!write_size_push (job, size))
+               {
+                  err = ENOMEM;
+                  break;
+               }
+
+               open [depth] = job->sizes_count - 1;
+               size = 0;
+            }
+         }
+
+         /* below the deepest record, sizes go to the record above */
+         if (!depth)
+            *total += size;
+         else
+            job->sizes [open [depth - 1 < WRITE_MAX_DEPTH ? depth - 1 : WRITE_MAX_DEPTH]].size += size;
+      }
+      else
+      {
+         depth = -- stack.depth;
+
+         if (depth <= WRITE_MAX_DEPTH)
+         {
+            write_size * record = &job->sizes [open [depth]];
+
+            record->next = job->sizes_count;
+
+            if (!depth)
+               *total = record->size;
+            else
+               job->sizes [open [depth - 1]].size += record->size;
+         }
+      }
+
+      if (!stack.depth)
+         break;
+
+      child = walk_child (&stack.frames [stack.depth - 1]);
+   }
+
+   free (stack.frames);
+   return err;
+}
+
+/* splits the top of the tree into the glue and pieces of about the target
+ * size, following the records write_measure left */
+static int write_split (write_job * job, const json_value * value)
+{
+   json_printer * printer = &job->glue_printer;
+   walk_stack stack = { 0 };
+   const json_value * child = value;
+   size_t record = 0;
+   int ok = 1;
+
+   for (;;)
+   {
+      if (child)
+      {
+         int container = (child->type == json_array || child->type == json_object);
+         size_t size = container ? job->sizes [record].size
+                                 : write_estimate_value (child);
+
+         if (container && size > job->target && stack.depth < WRITE_MAX_DEPTH
+               && (child->type == json_array ? child->u.array.length
+                                             : child->u.object.length) > 0)
+         {
+            if (!walk_push (&stack, child))
+            {
+               ok = 0;
+               break;
+            }
+
+            write_event (printer, child->type == json_array ? JSON_ARRAY_BEGIN
+                                                            : JSON_OBJECT_BEGIN, 0, 0);
+            ++ record;
+         }
+         else
+         {
+            if (container)
+               record = job->sizes [record].next;
+
+            if (!write_leaf (job, child, size))
+            {
+               ok = 0;
+               break;
+            }
+         }
+      }
+      else
+      {
+         -- stack.depth;
+
+         write_event (printer, stack.frames [stack.depth].value->type == json_array
+                               ? JSON_ARRAY_END : JSON_OBJECT_END, 0, 0);
+      }
+
+      if (!stack.depth)
+         break;
+
+      {
+         walk_frame * frame = &stack.frames [stack.depth - 1];
+
+         if (frame->value->type == json_object
+               && frame->index < frame->value->u.object.length)
+         {
+            write_event (printer, JSON_KEY,
+                         frame->value->u.object.values [frame->index].name,
+                         frame->value->u.object.values [frame->index].name_length);
+         }
+
+         child = walk_child (frame);
+      }
+   }
+
+   free (stack.frames);
+   return ok && !job->failed;
+}
+
+static void write_run (write_piece * piece)
+{
+   json_printer printer;
+
+   if (!write_grow (&piece->buf, &piece->size, piece->estimate + piece->estimate / 8))
+   {
+      piece->failed = 1;
+      return;
+   }
+
+   json_print_init (&printer, write_append, piece);
+   json_value_emit (piece->value, write_event, &printer);
+   json_print_free (&printer);
+}
+
+static void * write_worker (void * userdata)
+{
+   write_job * job = (write_job *) userdata;
+   size_t i;
+
+   while ((i = json_atomic_fetch_inc (&job->next)) < job->tasks)
+      write_run (&job->pieces [job->order [i].piece]);
+
+   return 0;
+}
+
+/* largest first */
+static int write_compare (const void * a, const void * b)
+{
+   size_t ea = ((const write_task *) a)->estimate;
+   size_t eb = ((const write_task *) b)->estimate;
+
+   return ea < eb ? 1 : ea > eb ? -1 : 0;
+}
+
+static int write_pieces (int fd, const write_job * job)
+{
+   struct iovec iov [IOV_MAX];
+   size_t i = 0, n, k;
+   ssize_t done;
+
+   while (i < job->count)
+   {
+      for (n = 0; n < IOV_MAX && i + n < job->count; ++ n)
+      {
+         const write_piece * piece = &job->pieces [i + n];
+
+         iov [n].iov_base = piece->value ? piece->buf : job->glue + piece->offset;
+         iov [n].iov_len = piece->length;
+      }
+
+      for (k = 0; k < n; )
+      {
+         if ((done = writev (fd, iov + k, (int) (n - k))) < 0)
+         {
+            if (errno == EINTR)
+               continue;
+
+            return errno;
+         }
+
+         /* step over what went out, partly written piece included */
+         while (k < n && (size_t) done >= iov [k].iov_len)
+            done -= iov [k ++].iov_len;
+
+         if (k < n)
+         {
+            iov [k].iov_base = (char *) iov [k].iov_base + done;
+            iov [k].iov_len -= done;
+         }
+      }
+
+      i += n;
+   }
+
+   return 0;
+}
+
+int json_value_write (const json_value * value, int fd, int threads)
+{
+   pthread_t * workers = 0;
+   write_job job;
+   size_t i, total, started = 0;
+   int err = 0;
+
+   if (threads <= 0)
+      threads = (int) sysconf (_SC_NPROCESSORS_ONLN);
+
+   if (threads <= 0)
+      threads = 1;
+
+   memset (&job, 0, sizeof (job));
+
+   /* a number JSON can't write fails the call before anything is written */
+   if ((err = write_measure (&job, value, &total)))
+   {
+      free (job.sizes);
+      return err;
+   }
+
+   json_print_init (&job.glue_printer, write_glue, &job);
+   job.target = total / ((size_t) threads * WRITE_TASKS_PER_THREAD) + 1;
+
+   if (!write_split (&job, value)
+         || ! (job.order = (write_task *) malloc ((job.count + 1) * sizeof (write_task))))
+   {
+      err = ENOMEM;
+      goto cleanup;
+   }
+
+   for (i = 0; i < job.count; ++ i)
+   {
+      if (job.pieces [i].value)
+      {
+         job.order [job.tasks].estimate = job.pieces [i].estimate;
+         job.order [job.tasks ++].piece = i;
+      }
+   }
+
+   qsort (job.order, job.tasks, sizeof (write_task), write_compare);
+
+   if ((size_t) threads > job.tasks)
+      threads = (int) job.tasks;
+
+   /* the calling thread is one of the workers */
+   if (threads > 1 && (workers = (pthread_t *) malloc ((threads - 1) * sizeof (pthread_t))))
+   {
+      for (; started < (size_t) threads - 1; ++ started)
+      {
+         if (pthread_create (&workers [started], 0, write_worker, &job) != 0)
+            break;
+      }
+   }
+
+   write_worker (&job);
+
+   for (i = 0; i < started; ++ i)
+      pthread_join (workers [i], 0);
+
+   for (i = 0; i < job.count; ++ i)
+   {
+      if (job.pieces [i].failed)
+         err = ENOMEM;
+   }
+
+   if (!err && job.failed)
+      err = ENOMEM;
+
+   if (!err)
+      err = write_pieces (fd, &job);
+
+cleanup:
+
+   for (i = 0; i < job.count; ++ i)
+      free (job.pieces [i].buf);
+
+   free (workers);
+   free (job.order);
+   free (job.pieces);
+   free (job.sizes);
+   free (job.glue);
+   return err;
+}
+
+#else
+
+int json_value_write (const json_value * value, int fd, int threads)
+{
+   (void) value;
+   (void) fd;
+   (void) threads;
+   return ENOSYS;
+}
+
+#endif
+
+/* Canonical form (RFC 8785): compact, object members sorted by the UTF-16
+ * code units of their names, numbers written the way ECMAScript writes a
+ * double, and only the escapes the printer already restricts itself to.
+ *
+ * Names are sorted with an MSD radix sort on their bytes.  UTF-8 byte order
+ * is code point order, which only differs from UTF-16 order in that the
+ * 4 byte sequences (surrogate pairs in UTF-16) sort before U+E000..U+FFFF:
+ * canonical_rank moves their lead bytes there.
+ */
+
+#define CANONICAL_BUFFER_SIZE 4096
+#define CANONICAL_INSERTION_SORT 16
+#define CANONICAL_MAX_RADIX_LEVEL 32
+
+/* a container being written: the next member or element, and for an
+ * object where its sorted members start in scratch */
+typedef struct
+{
+   const json_value * value;
+   size_t base, index;
+
+} canonical_frame;
+
+typedef struct
+{
+   json_printer * printer;
+   int nonfinite_null;  /* write NaN and infinities as null instead of failing */
+
+   /* sorted member pointers of the objects being written, innermost last */
+   const json_object_entry ** scratch;
+   size_t used, size;
+
+   /* the containers being written, innermost last */
+   canonical_frame * frames;
+   size_t depth, frames_size;
+
+} canonical_state;
+
+static unsigned int canonical_rank (unsigned char c)
+{
+   if (c < 0xee || c > 0xf4)
+      return c;
+
+   return c >= 0xf0 ? c - 2 : c + 5;
+}
+
+/* 0 past the end of the name, the rank of the byte + 1 otherwise */
+static unsigned int canonical_byte (const json_object_entry * entry, size_t depth)
+{
+   return depth < entry->name_length ?
+      canonical_rank ((unsigned char) entry->name [depth]) + 1 : 0;
+}
+
+static int canonical_compare (const json_object_entry * a,
+                              const json_object_entry * b, size_t depth)
+{
+   size_t i;
+
+   for (i = depth; i < a->name_length && i < b->name_length; ++ i)
+   {
+      if (a->name [i] != b->name [i])
+      {
+         return (int) canonical_rank ((unsigned char) a->name [i])
+              - (int) canonical_rank ((unsigned char) b->name [i]);
+      }
+   }
+
+   return (a->name_length > b->name_length) - (a->name_length < b->name_length);
+}
+
+static void canonical_insertion_sort (const json_object_entry ** entries,
+                                      size_t n, size_t depth)
+{
+   const json_object_entry * entry;
+   size_t i, j;
+
+   for (i = 1; i < n; ++ i)
+   {
+      entry = entries [i];
+
+      for (j = i; j > 0 && canonical_compare (entries [j - 1], entry, depth) > 0; -- j)
+         entries [j] = entries [j - 1];
+
+      entries [j] = entry;
+   }
+}
+
+/* for the few inputs (long shared prefixes that keep splitting) that would
+ * have the radix sort recurse too deep */
+static void canonical_merge_sort (const json_object_entry ** entries,
+                                  const json_object_entry ** tmp,
+                                  size_t n, size_t depth)
+{
+   size_t half = n / 2, i = 0, j = half, k = 0;
+
+   if (n <= CANONICAL_INSERTION_SORT)
+   {
+      canonical_insertion_sort (entries, n, depth);
+      return;
+   }
+
+   canonical_merge_sort (entries, tmp, half, depth);
+   canonical_merge_sort (entries + half, tmp + half, n - half, depth);
+
+   while (i < half && j < n)
+   {
+      tmp [k ++] = canonical_compare (entries [j], entries [i], depth) < 0 ?
+         entries [j ++] : entries [i ++];
+   }
+
+   while (i < half)
+      tmp [k ++] = entries [i ++];
+
+   while (j < n)
+      tmp [k ++] = entries [j ++];
+
+   memcpy (entries, tmp, n * sizeof (*entries));
+}
+
+/* stable; entries share their first depth bytes, tmp holds n */
+static void canonical_sort (const json_object_entry ** entries,
+                            const json_object_entry ** tmp,
+                            size_t n, size_t depth, int level)
+{
+   size_t count [258], start, i;
+   unsigned int b;
+
+   for (;;)
+   {
+      if (n <= CANONICAL_INSERTION_SORT)
+      {
+         canonical_insertion_sort (entries, n, depth);
+         return;
+      }
+
+      if (level > CANONICAL_MAX_RADIX_LEVEL)
+      {
+         canonical_merge_sort (entries, tmp, n, depth);
+         return;
+      }
+
+      memset (count, 0, sizeof (count));
+
+      for (i = 0; i < n; ++ i)
+         ++ count [canonical_byte (entries [i], depth) + 1];
+
+      b = canonical_byte (entries [0], depth);
+
+      if (count [b + 1] != n)
+         break;
+
+      /* all in one bucket: on to the next byte without recursing */
+      if (b == 0)
+         return;
+
+      ++ depth;
+   }
+
+   for (b = 1; b < 258; ++ b)
+      count [b] += count [b - 1];
+
+   for (i = 0; i < n; ++ i)
+      tmp [count [canonical_byte (entries [i], depth)] ++] = entries [i];
+
+   memcpy (entries, tmp, n * sizeof (*entries));
+
+   /* count [b] is now the end of bucket b; bucket 0 are equal names */
+   for (b = 1, start = count [0]; b < 257; start = count [b ++])
+   {
+      if (count [b] - start > 1)
+      {
+         canonical_sort (entries + start, tmp + start, count [b] - start,
+                         depth + 1, level + 1);
+      }
+   }
+}
+
+/* the shortest digits that read back as dbl, placed the way ECMAScript's
+ * Number.prototype.toString places them; buf holds 32 */
+static int format_es_double (char * buf, double dbl)
+{
+   char digits [32], * p = buf;
+   const char * c;
+   int precision, count = 0, point, i;
+
+   if (dbl == 0)
+   {
+      strcpy (buf, "0");
+      return 1;
+   }
+
+   for (precision = 1; precision <= 17; ++ precision)
+   {
+      c_snprintf (digits, sizeof (digits), "%.*e", precision - 1, dbl);
+
+      if (precision == 17 || c_strtod (digits, 0) == dbl)
+         break;
+   }
+
+   /* the digits, without the point */
+   for (c = digits; *c != 'e'; ++ c)
+   {
+      if (*c >= '0' && *c <= '9')
+         digits [count ++] = *c;
+   }
+
+   point = atoi (c + 1) + 1;
+
+   while (count > 1 && digits [count - 1] == '0')
+      -- count;
+
+   if (dbl < 0)
+      *p ++ = '-';
+
+   if (count <= point && point <= 21)
+   {
+      memcpy (p, digits, count);
+      p += count;
+
+      for (i = count; i < point; ++ i)
+         *p ++ = '0';
+   }
+   else if (0 < point && point <= 21)
+   {
+      memcpy (p, digits, point);
+      p += point;
+      *p ++ = '.';
+      memcpy (p, digits + point, count - point);
+      p += count - point;
+   }
+   else if (-6 < point && point <= 0)
+   {
+      *p ++ = '0';
+      *p ++ = '.';
+
+      for (i = point; i < 0; ++ i)
+         *p ++ = '0';
+
+      memcpy (p, digits, count);
+      p += count;
+   }
+   else
+   {
+      *p ++ = digits [0];
+
+      if (count > 1)
+      {
+         *p ++ = '.';
+         memcpy (p, digits + 1, count - 1);
+         p += count - 1;
+      }
+
+      p += sprintf (p, "e%c%d", point > 0 ? '+' : '-', abs (point - 1));
+   }
+
+   *p = 0;
+   return (int) (p - buf);
+}
+
+static int canonical_reserve (canonical_state * state, size_t n)
+{
+   const json_object_entry ** scratch;
+   size_t size = state->size ? state->size : 64;
+
+   if (state->used + n <= state->size)
+      return 1;
+
+   while (size < state->used + n)
+      size *= 2;
+
+   if (! (scratch = (const json_object_entry **)
+            realloc (state->scratch, size * sizeof (*scratch))))
+   {
+      return 0;
+   }
+
+   state->scratch = scratch;
+   state->size = size;
+   return 1;
+}
+
+static int canonical_scalar (canonical_state * state, const json_value * value)
+{
+   json_printer * printer = state->printer;
+   char buf [32];
+
+   switch (value->type)
+   {
+      case json_integer:
+
+         /* exact as a double: the digits are the ECMAScript ones */
+         if (value->u.integer >= -(1LL << 53) && value->u.integer <= (1LL << 53))
+         {
+            return json_print_raw (printer, JSON_INT, buf,
+               snprintf (buf, sizeof (buf), "%lld", (long long) value->u.integer));
+         }
+
+         return json_print_raw (printer, JSON_FLOAT, buf,
+                                format_es_double (buf, (double) value->u.integer));
+
+      case json_double:
+
+         if (!isfinite (value->u.dbl))
+         {
+            if (!state->nonfinite_null)
+               return EDOM;
+
+            return json_print_raw (printer, JSON_NULL, "null", 4);
+         }
+
+         return json_print_raw (printer, JSON_FLOAT, buf,
+                                format_es_double (buf, value->u.dbl));
+
+      case json_string:
+
+         return json_print_raw (printer, JSON_STRING, value->u.string.ptr,
+                                value->u.string.length);
+
+      case json_boolean:
+
+         return value->u.boolean ?
+            json_print_raw (printer, JSON_TRUE, "true", 4) :
+            json_print_raw (printer, JSON_FALSE, "false", 5);
+
+      default:
+
+         return json_print_raw (printer, JSON_NULL, "null", 4);
+   };
+}
+
+/* Writes the opening of a container and pushes its frame.  The members of
+ * an object are sorted into scratch here, where they stay until it closes.
+ */
+static int canonical_open (canonical_state * state, const json_value * value)
+{
+   canonical_frame * frame;
+   size_t n, i;
+
+   if (state->depth == state->frames_size)
+   {
+      size_t size = state->frames_size ? state->frames_size * 2 : 32;
+
+      if (! (frame = (canonical_frame *) realloc
+               (state->frames, size * sizeof (canonical_frame))))
+      {
+         return ENOMEM;
+      }
+
+      state->frames = frame;
+      state->frames_size = size;
+   }
+
+   frame = &state->frames [state->depth ++];
+   frame->value = value;
+   frame->base = state->used;
+   frame->index = 0;
+
+   if (value->type == json_array)
+      return json_print_raw (state->printer, JSON_ARRAY_BEGIN, 0, 0);
+
+   n = value->u.object.length;
+
+   if (!canonical_reserve (state, n * 2))
+      return ENOMEM;
+
+   for (i = 0; i < n; ++ i)
+      state->scratch [frame->base + i] = &value->u.object.values [i];
+
+   canonical_sort (state->scratch + frame->base,
+                   state->scratch + frame->base + n, n, 0, 0);
+
+   state->used = frame->base + n;
+
+   return json_print_raw (state->printer, JSON_OBJECT_BEGIN, 0, 0);
+}
+
+static int canonical_emit (canonical_state * state, const json_value * value)
+{
+   const json_object_entry * entry;
+   canonical_frame * frame;
+   int ret;
+
+   if (value->type != json_object && value->type != json_array)
+      return canonical_scalar (state, value);
+
+   ret = canonical_open (state, value);
+
+   while (!ret && state->depth > 0)
+   {
+      frame = &state->frames [state->depth - 1];
+      value = frame->value;
+
+      if (value->type == json_object)
+      {
+         if (frame->index == value->u.object.length)
+         {
+            state->used = frame->base;
+            -- state->depth;
+            ret = json_print_raw (state->printer, JSON_OBJECT_END, 0, 0);
+            continue;
+         }
+
+         /* scratch may have moved since: index it again each time */
+         entry = state->scratch [frame->base + frame->index ++];
+
+         if ((ret = json_print_raw (state->printer, JSON_KEY,
+                                    entry->name, entry->name_length)))
+         {
+            break;
+         }
+
+         value = entry->value;
+      }
+      else
+      {
+         if (frame->index == value->u.array.length)
+         {
+            -- state->depth;
+            ret = json_print_raw (state->printer, JSON_ARRAY_END, 0, 0);
+            continue;
+         }
+
+         value = value->u.array.values [frame->index ++];
+      }
+
+      if (value->type == json_object || value->type == json_array)
+         ret = canonical_open (state, value);
+      else
+         ret = canonical_scalar (state, value);
+   }
+
+   return ret;
+}
+
+static int canonical_write (const json_value * value, int nonfinite_null,
+                            json_printer_callback callback, void * userdata)
+{
+   canonical_state state;
+   json_printer printer;
+   int ret, flush;
+
+   memset (&state, 0, sizeof (state));
+   state.printer = &printer;
+   state.nonfinite_null = nonfinite_null;
+
+   json_print_init (&printer, callback, userdata);
+
+   if (json_print_set_buffer (&printer, CANONICAL_BUFFER_SIZE))
+      ret = ENOMEM;
+   else
+      ret = canonical_emit (&state, value);
+
+   flush = json_print_free (&printer);
+   free (state.scratch);
+   free (state.frames);
+
+   return ret ? ret : flush;
+}
+
+int json_value_canonical (const json_value * value,
+                          json_printer_callback callback, void * userdata)
+{
+   return canonical_write (value, 0, callback, userdata);
+}
+
+/* Content hash: XXH64 of the canonical text, fed from the printer's buffer
+ * as it fills, so the text never exists as a whole.
+ */
+
+#define HASH_PRIME1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME3 0x165667B19E3779F9ULL
+#define HASH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define HASH_PRIME5 0x27D4EB2F165667C5ULL
+
+#define HASH_ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+typedef struct
+{
+   uint64_t seed, total, v [4];
+
+   unsigned char stripe [32];
+   size_t length;
+
+} hash_state;
+
+typedef struct
+{
+   hash_state lanes [2];
+   int count;
+
+} hash_sink;
+
+static uint64_t hash_read64 (const unsigned char * p)
+{
+   return (uint64_t) p [0]         | (uint64_t) p [1] << 8
+        | (uint64_t) p [2] << 16   | (uint64_t) p [3] << 24
+        | (uint64_t) p [4] << 32   | (uint64_t) p [5] << 40
+        | (uint64_t) p [6] << 48   | (uint64_t) p [7] << 56;
+}
+
+static uint64_t hash_read32 (const unsigned char * p)
+{
+   return (uint64_t) p [0]         | (uint64_t) p [1] << 8
+        | (uint64_t) p [2] << 16   | (uint64_t) p [3] << 24;
+}
+
+static uint64_t hash_round (uint64_t acc, uint64_t input)
+{
+   acc += input * HASH_PRIME2;
+   return HASH_ROTL (acc, 31) * HASH_PRIME1;
+}
+
+static uint64_t hash_merge (uint64_t h, uint64_t v)
+{
+   h ^= hash_round (0, v);
+   return h * HASH_PRIME1 + HASH_PRIME4;
+}
+
+static void hash_init (hash_state * state, uint64_t seed)
+{
+   memset (state, 0, sizeof (*state));
+
+   state->seed = seed;
+   state->v [0] = seed + HASH_PRIME1 + HASH_PRIME2;
+   state->v [1] = seed + HASH_PRIME2;
+   state->v [2] = seed;
+   state->v [3] = seed - HASH_PRIME1;
+}
+
+static void hash_stripe (hash_state * state, const unsigned char * p)
+{
+   state->v [0] = hash_round (state->v [0], hash_read64 (p));
+   state->v [1] = hash_round (state->v [1], hash_read64 (p + 8));
+   state->v [2] = hash_round (state->v [2], hash_read64 (p + 16));
+   state->v [3] = hash_round (state->v [3], hash_read64 (p + 24));
+}
+
+static void hash_update (hash_state * state, const unsigned char * data, size_t length)
+{
+   size_t fill;
+
+   state->total += length;
+
+   if (state->length + length < 32)
+   {
+      memcpy (state->stripe + state->length, data, length);
+      state->length += length;
+      return;
+   }
+
+   if (state->length)
+   {
+      fill = 32 - state->length;
+      memcpy (state->stripe + state->length, data, fill);
+      hash_stripe (state, state->stripe);
+
+      data += fill;
+      length -= fill;
+      state->length = 0;
+   }
+
+   for (; length >= 32; data += 32, length -= 32)
+      hash_stripe (state, data);
+
+   memcpy (state->stripe, data, length);
+   state->length = length;
+}
+
+static uint64_t hash_final (const hash_state * state)
+{
+   const unsigned char * p = state->stripe;
+   size_t length = state->length;
+   uint64_t h;
+
+   if (state->total >= 32)
+   {
+      h = HASH_ROTL (state->v [0], 1) + HASH_ROTL (state->v [1], 7)
+        + HASH_ROTL (state->v [2], 12) + HASH_ROTL (state->v [3], 18);
+
+      h = hash_merge (h, state->v [0]);
+      h = hash_merge (h, state->v [1]);
+      h = hash_merge (h, state->v [2]);
+      h = hash_merge (h, state->v [3]);
+   }
+   else
+      h = state->seed + HASH_PRIME5;
+
+   h += state->total;
+
+   for (; length >= 8; p += 8, length -= 8)
+   {
+      h ^= hash_round (0, hash_read64 (p));
+      h = HASH_ROTL (h, 27) * HASH_PRIME1 + HASH_PRIME4;
+   }
+
+   if (length >= 4)
+   {
+      h ^= hash_read32 (p) * HASH_PRIME1;
+      h = HASH_ROTL (h, 23) * HASH_PRIME2 + HASH_PRIME3;
+      p += 4;
+      length -= 4;
+   }
+
+   for (; length > 0; ++ p, -- length)
+   {
+      h ^= *p * HASH_PRIME5;
+      h = HASH_ROTL (h, 11) * HASH_PRIME1;
+   }
+
+   h ^= h >> 33;
+   h *= HASH_PRIME2;
+   h ^= h >> 29;
+   h *= HASH_PRIME3;
+   h ^= h >> 32;
+
+   return h;
+}
+
+static int hash_sink_update (void * userdata, const char * data, uint32_t length)
+{
+   hash_sink * sink = (hash_sink *) userdata;
+   int i;
+
+   for (i = 0; i < sink->count; ++ i)
+      hash_update (&sink->lanes [i], (const unsigned char *) data, length);
+
+   return 0;
+}
+
+int json_value_hash (const json_value * value, uint64_t seed, uint64_t * hash)
+{
+   hash_sink sink;
+   int ret;
+
+   sink.count = 1;
+   hash_init (&sink.lanes [0], seed);
+
+   if ((ret = canonical_write (value, 1, hash_sink_update, &sink)))
+      return ret;
+
+   *hash = hash_final (&sink.lanes [0]);
+   return 0;
+}
+
+int json_value_hash128 (const json_value * value, uint64_t hash [2])
+{
+   hash_sink sink;
+   int ret;
+
+   sink.count = 2;
+   hash_init (&sink.lanes [0], 0);
+   hash_init (&sink.lanes [1], HASH_PRIME1);
+
+   if ((ret = canonical_write (value, 1, hash_sink_update, &sink)))
+      return ret;
+
+   hash [0] = hash_final (&sink.lanes [0]);
+   hash [1] = hash_final (&sink.lanes [1]);
+   return 0;
+}
+
+/* Deduplicated trees (json_enable_dedupe).
+ *
+ * Identical subtrees of a parsed tree are found bottom-up: a value is looked
+ * up by its type, its scalar or bytes, and the representatives of its
+ * children, so telling two candidates apart never goes more than one level
+ * down.  While this runs, each value's _reserved points at its
+ * representative (itself for the first occurrence).
+ *
+ * The representatives are then copied into one block laid out like an
+ * image, with pointers rather than offsets, every member name stored once.
+ * Representatives point at their copy from then on.  A shared value's
+ * parent is that of its first occurrence; the block is released through
+ * the image root tag.
+ */
+
+#define DEDUPE_MIN_SLOTS 256
+
+typedef struct
+{
+   const void ** slots;    /* json_value * or json_object_entry * */
+   uint64_t * hashes;
+   json_char ** copies;    /* names only: where the name went in the block */
+   size_t mask, count;
+
+} dedupe_table;
+
+typedef struct
+{
+   dedupe_table values, names;
+   image_layout layout;
+
+   /* the block being filled */
+   json_image_header * image;
+   json_value * nodes;
+   char * pointers, * chars;
+
+} dedupe_state;
+
+static uint64_t dedupe_hash_bytes (const void * data, size_t length)
+{
+   hash_state state;
+
+   hash_init (&state, 0);
+   hash_update (&state, (const unsigned char *) data, length);
+
+   return hash_final (&state);
+}
+
+static json_value * dedupe_rep (const json_value * value)
+{
+   return value->_reserved.next_alloc;
+}
+
+static int dedupe_same_value (const json_value * a, const json_value * b)
+{
+   unsigned int i;
+
+   if (a->type != b->type)
+      return 0;
+
+   switch (a->type)
+   {
+      case json_array:
+
+         if (a->u.array.length != b->u.array.length)
+            return 0;
+
+         for (i = 0; i < a->u.array.length; ++ i)
+         {
+            if (dedupe_rep (a->u.array.values [i]) != dedupe_rep (b->u.array.values [i]))
+               return 0;
+         }
+
+         return 1;
+
+      case json_object:
+
+         if (a->u.object.length != b->u.object.length)
+            return 0;
+
+         for (i = 0; i < a->u.object.length; ++ i)
+         {
+            const json_object_entry * x = &a->u.object.values [i],
+                                    * y = &b->u.object.values [i];
+
+            if (x->name_length != y->name_length
+                  || memcmp (x->name, y->name, x->name_length)
+                  || dedupe_rep (x->value) != dedupe_rep (y->value))
+            {
+               return 0;
+            }
+         }
+
+         return 1;
+
+      case json_integer:
+         return a->u.integer == b->u.integer;
+
+      case json_double:
+         return !memcmp (&a->u.dbl, &b->u.dbl, sizeof (double));
+
+      case json_string:
+         return a->u.string.length == b->u.string.length
+            && !memcmp (a->u.string.ptr, b->u.string.ptr, a->u.string.length);
+
+      case json_boolean:
+         return a->u.boolean == b->u.boolean;
+
+      default:
+         return 1;
+   };
+}
+
+static int dedupe_same_name (const json_object_entry * a, const json_object_entry * b)
+{
+   return a->name_length == b->name_length
+      && !memcmp (a->name, b->name, a->name_length);
+}
+
+static int dedupe_grow (dedupe_table * table)
+{
+   size_t size = table->mask ? (table->mask + 1) * 2 : DEDUPE_MIN_SLOTS, i, j;
+   const void ** slots;
+   uint64_t * hashes;
+
+   slots = (const void **) calloc (size, sizeof (*slots));
+   hashes = (uint64_t *) malloc (size * sizeof (*hashes));
+
+   if (!slots || !hashes)
+   {
+      free (slots);
+      free (hashes);
+      return 0;
+   }
+
+   for (i = 0; table->mask && i <= table->mask; ++ i)
+   {
+      if (!table->slots [i])
+         continue;
+
+      for (j = table->hashes [i] & (size - 1); slots [j]; j = (j + 1) & (size - 1))
+         ;
+
+      slots [j] = table->slots [i];
+      hashes [j] = table->hashes [i];
+   }
+
+   free (table->slots);
+   free (table->hashes);
+
+   table->slots = slots;
+   table->hashes = hashes;
+   table->mask = size - 1;
+
+   return 1;
+}
+
+/* the slot holding item or its equal, or the empty slot where it goes */
+static size_t dedupe_find (const dedupe_table * table, const void * item,
+                           uint64_t hash, int (* same) (const void *, const void *))
+{
+   size_t i;
+
+   for (i = hash & table->mask; table->slots [i]; i = (i + 1) & table->mask)
+   {
+      if (table->hashes [i] == hash && same (table->slots [i], item))
+         break;
+   }
+
+   return i;
+}
+
+static int dedupe_same_value_slot (const void * a, const void * b)
+{
+   return dedupe_same_value ((const json_value *) a, (const json_value *) b);
+}
+
+static int dedupe_same_name_slot (const void * a, const void * b)
+{
+   return dedupe_same_name ((const json_object_entry *) a,
+                            (const json_object_entry *) b);
+}
+
+/* 1 if item was new, 0 if an equal one was there (in *found), -1 on ENOMEM */
+static int dedupe_insert (dedupe_table * table, const void * item, uint64_t hash,
+                          int (* same) (const void *, const void *),
+                          const void ** found)
+{
+   size_t i;
+
+   if ((table->count + 1) * 2 > table->mask + 1 && !dedupe_grow (table))
+      return -1;
+
+   i = dedupe_find (table, item, hash, same);
+
+   if (table->slots [i])
+   {
+      *found = table->slots [i];
+      return 0;
+   }
+
+   table->slots [i] = item;
+   table->hashes [i] = hash;
+   ++ table->count;
+
+   return 1;
+}
+
+/* looks value up once its children have been, 0 when out of memory */
+static int dedupe_intern_value (dedupe_state * state, json_value * value)
+{
+   const void * found;
+   uint64_t hash = value->type;
+   unsigned int i;
+   int ret;
+
+   switch (value->type)
+   {
+      case json_array:
+
+         for (i = 0; i < value->u.array.length; ++ i)
+            hash = hash_round (hash, (uintptr_t) dedupe_rep (value->u.array.values [i]));
+
+         break;
+
+      case json_object:
+
+         for (i = 0; i < value->u.object.length; ++ i)
+         {
+            const json_object_entry * entry = &value->u.object.values [i];
+            uint64_t name_hash = dedupe_hash_bytes (entry->name, entry->name_length);
+
+            if ((ret = dedupe_insert (&state->names, entry, name_hash,
+                                      dedupe_same_name_slot, &found)) < 0)
+            {
+               return 0;
+            }
+
+            if (ret)
+               state->layout.char_bytes += entry->name_length + 1;
+
+            hash = hash_round (hash, name_hash);
+            hash = hash_round (hash, (uintptr_t) dedupe_rep (entry->value));
+         }
+
+         break;
+
+      case json_integer:
+         hash = hash_round (hash, (uint64_t) value->u.integer);
+         break;
+
+      case json_double:
+      {
+         uint64_t bits;
+
+         memcpy (&bits, &value->u.dbl, sizeof (bits));
+         hash = hash_round (hash, bits);
+         break;
+      }
+
+      case json_string:
+         hash = hash_round (hash, dedupe_hash_bytes (value->u.string.ptr,
+                                                     value->u.string.length));
+         break;
+
+      case json_boolean:
+         hash = hash_round (hash, (uint64_t) value->u.boolean);
+         break;
+
+      default:
+         break;
+   };
+
+   hash ^= hash >> 29;
+
+   if ((ret = dedupe_insert (&state->values, value, hash,
+                             dedupe_same_value_slot, &found)) < 0)
+   {
+      return 0;
+   }
+
+   if (!ret)
+   {
+      value->_reserved.next_alloc = (json_value *) found;
+      return 1;
+   }
+
+   value->_reserved.next_alloc = value;
+   ++ state->layout.nodes;
+
+   switch (value->type)
+   {
+      case json_array:
+         state->layout.pointer_bytes += value->u.array.length * sizeof (json_value *);
+         break;
+
+      case json_object:
+         state->layout.pointer_bytes += value->u.object.length * sizeof (json_object_entry);
+         break;
+
+      case json_string:
+         state->layout.char_bytes += value->u.string.length + 1;
+         break;
+
+      default:
+         break;
+   };
+
+   return 1;
+}
+
+/* children first, on the walk stack rather than the call stack */
+static int dedupe_intern (dedupe_state * state, json_value * root)
+{
+   walk_stack stack = { 0 };
+   const json_value * child;
+   int ret = 1;
+
+   if (root->type != json_array && root->type != json_object)
+      return dedupe_intern_value (state, root);
+
+   if (!walk_push (&stack, root))
+      return 0;
+
+   while (ret && stack.depth > 0)
+   {
+      walk_frame * frame = &stack.frames [stack.depth - 1];
+
+      if (! (child = walk_child (frame)))
+      {
+         -- stack.depth;
+         ret = dedupe_intern_value (state, (json_value *) frame->value);
+      }
+      else if (child->type == json_array || child->type == json_object)
+         ret = walk_push (&stack, child);
+      else
+         ret = dedupe_intern_value (state, (json_value *) child);
+   }
+
+   free (stack.frames);
+   return ret;
+}
+
+static json_char * dedupe_name (dedupe_state * state, const json_object_entry * entry)
+{
+   dedupe_table * names = &state->names;
+   size_t i = dedupe_find (names, entry,
+                           dedupe_hash_bytes (entry->name, entry->name_length),
+                           dedupe_same_name_slot);
+
+   if (!names->copies [i])
+   {
+      names->copies [i] = state->chars;
+      memcpy (state->chars, entry->name, entry->name_length + 1);
+      state->chars += entry->name_length + 1;
+   }
+
+   return names->copies [i];
+}
+
+/* The copy of src in the block.  When it is made here and has children
+ * still to copy, *open is set to the representative they are read from.
+ */
+static json_value * dedupe_copy_value (dedupe_state * state, const json_value * src,
+                                       json_value * parent, const json_value ** open)
+{
+   json_value * rep = dedupe_rep (src), * value,
+              * nodes = IMAGE_NODES (state->image);
+   unsigned int i;
+
+   *open = 0;
+
+   /* src was a representative, already copied */
+   if (rep >= nodes && rep < nodes + state->layout.nodes)
+      return rep;
+
+   if (rep->_reserved.next_alloc != rep)
+      return rep->_reserved.next_alloc;
+
+   value = state->nodes ++;
+   *value = *rep;
+   value->parent = parent;
+   value->_reserved.next_alloc = 0;
+   rep->_reserved.next_alloc = value;
+
+   switch (rep->type)
+   {
+      case json_array:
+
+         value->u.array.values = rep->u.array.length ?
+            (json_value **) state->pointers : 0;
+
+         state->pointers += rep->u.array.length * sizeof (json_value *);
+
+         if (rep->u.array.length)
+            *open = rep;
+
+         break;
+
+      case json_object:
+      {
+         json_object_entry * entries = (json_object_entry *) state->pointers;
+
+         state->pointers += rep->u.object.length * sizeof (json_object_entry);
+         value->u.object.values = rep->u.object.length ? entries : 0;
+
+         for (i = 0; i < rep->u.object.length; ++ i)
+         {
+            entries [i].name = dedupe_name (state, &rep->u.object.values [i]);
+            entries [i].name_length = rep->u.object.values [i].name_length;
+         }
+
+         if (rep->u.object.length)
+            *open = rep;
+
+         break;
+      }
+
+      case json_string:
+
+         memcpy (state->chars, rep->u.string.ptr, rep->u.string.length + 1);
+         value->u.string.ptr = state->chars;
+         state->chars += rep->u.string.length + 1;
+
+         break;
+
+      default:
+         break;
+   };
+
+   return value;
+}
+
+/* depth first from root, the children of a copied container filled in as
+ * they are copied.  0 when out of memory */
+static json_value * dedupe_copy (dedupe_state * state, const json_value * root)
+{
+   walk_stack stack = { 0 };
+   const json_value * child, * open;
+   json_value * copy, * parent, * value;
+   walk_frame * frame;
+
+   copy = dedupe_copy_value (state, root, 0, &open);
+
+   if (open && !walk_push (&stack, open))
+      return 0;
+
+   while (stack.depth > 0)
+   {
+      frame = &stack.frames [stack.depth - 1];
+
+      if (! (child = walk_child (frame)))
+      {
+         -- stack.depth;
+         continue;
+      }
+
+      /* a representative points at its copy once made */
+      parent = frame->value->_reserved.next_alloc;
+      value = dedupe_copy_value (state, child, parent, &open);
+
+      if (parent->type == json_array)
+         parent->u.array.values [frame->index - 1] = value;
+      else
+         parent->u.object.values [frame->index - 1].value = value;
+
+      if (open && !walk_push (&stack, open))
+      {
+         free (stack.frames);
+         return 0;
+      }
+   }
+
+   free (stack.frames);
+   return copy;
+}
+
+/* the deduplicated copy of root, root itself is freed; or root untouched
+ * when memory runs out */
+static json_value * dedupe_tree (json_settings * settings, json_value * root)
+{
+   dedupe_state state;
+   json_value * copy = 0;
+   size_t size;
+
+   memset (&state, 0, sizeof (state));
+
+   if (!dedupe_intern (&state, root))
+      goto cleanup;
+
+   size = IMAGE_HEADER_SIZE + state.layout.nodes * sizeof (json_value)
+            + state.layout.pointer_bytes + state.layout.char_bytes;
+
+   if (! (state.image = (json_image_header *) settings->mem_alloc
+            (size, 1, settings->user_data)))
+   {
+      goto cleanup;
+   }
+
+   if (! (state.names.copies = (json_char **)
+            calloc (state.names.mask + 1, sizeof (json_char *))))
+   {
+      settings->mem_free (state.image, settings->user_data);
+      goto cleanup;
+   }
+
+   state.image->version = JSON_IMAGE_VERSION;
+   state.image->release = IMAGE_RELEASE_SETTINGS;
+   state.image->value_size = sizeof (json_value);
+   state.image->image_size = size;
+   state.image->nodes = state.layout.nodes;
+
+   /* dedupe_copy moves these along */
+   state.nodes = IMAGE_NODES (state.image);
+   state.pointers = (char *) (state.nodes + state.layout.nodes);
+   state.chars = state.pointers + state.layout.pointer_bytes;
+
+   if (! (copy = dedupe_copy (&state, root)))
+   {
+      settings->mem_free (state.image, settings->user_data);
+      goto cleanup;
+   }
+
+   copy->_reserved.object_mem = (void *) &json_image_marker;
+
+   json_value_free_ex (settings, root);
+
+cleanup:
+
+   free (state.values.slots);
+   free (state.values.hashes);
+   free (state.names.slots);
+   free (state.names.hashes);
+   free (state.names.copies);
+
+   return copy ? copy : root;
+}
+
+/* Structural diff.
+ *
+ * Both trees first get a Merkle hash per value, kept in a side array that
+ * mirrors the tree (the children of a value are contiguous).  The walk then
+ * never enters values whose hashes are equal, so after the hashing pass the
+ * work and the patch are proportional to what changed.  Object members are
+ * hashed independently of their order.  Array elements are matched by hash:
+ * common ends are trimmed and the middle goes through Myers' O(ND)
+ * algorithm; replaced elements are diffed in place rather than rewritten.
+ */
+
+#define DIFF_MAX_EDITS 1024
+
+typedef struct _diff_node
+{
+   uint64_t hash;
+   struct _diff_node * children;
+
+} diff_node;
+
+typedef struct
+{
+   json_parser_callback callback;
+   void * userdata;
+
+   char * path;
+   size_t path_length, path_size;
+
+   /* Myers' state: v, and the v of every step for the way back */
+   size_t * v, * trace;
+   size_t v_size, trace_size;
+
+   /* the pairs of containers being compared, innermost last */
+   struct _diff_frame * frames;
+   size_t depth, frames_size;
+
+} diff_state;
+
+/* a pair of arrays or objects being compared, and where the comparison is */
+typedef struct _diff_frame
+{
+   const json_value * a, * b;
+   const diff_node * na, * nb;
+   size_t path_length;      /* of the path without this pair's token */
+
+   /* arrays: the matched pairs of the middle, the current gap and the
+    * element pairs left in it */
+   size_t * matches;
+   size_t start, count, gap, ax, by, index, pairs;
+   int in_gap;
+
+   /* objects: b's members by name, + 1 (0 is empty), and which of them
+    * were seen; ax then walks a's members and by b's */
+   unsigned int * slots;
+   unsigned char * seen;
+   size_t mask;
+
+} diff_frame;
+
+/* 0 when out of memory */
+static size_t diff_count (const json_value * value)
+{
+   walk_stack stack = { 0 };
+   const json_value * child;
+   size_t count = 1;
+
+   if (value->type != json_array && value->type != json_object)
+      return count;
+
+   if (!walk_push (&stack, value))
+      return 0;
+
+   while (stack.depth > 0)
+   {
+      if (! (child = walk_child (&stack.frames [stack.depth - 1])))
+      {
+         -- stack.depth;
+         continue;
+      }
+
+      ++ count;
+
+      if ((child->type == json_array || child->type == json_object)
+            && !walk_push (&stack, child))
+      {
+         free (stack.frames);
+         return 0;
+      }
+   }
+
+   free (stack.frames);
+   return count;
+}
+
+static uint64_t diff_mix (uint64_t hash)
+{
+   hash ^= hash >> 29;
+   hash *= HASH_PRIME3;
+   hash ^= hash >> 32;
+
+   return hash;
+}
+
+static uint64_t diff_scalar_hash (const json_value * value)
+{
+   uint64_t hash = value->type, bits;
+
+   switch (value->type)
+   {
+      case json_integer:
+         hash = hash_round (hash, (uint64_t) value->u.integer);
+         break;
+
+      case json_double:
+         memcpy (&bits, &value->u.dbl, sizeof (bits));
+         hash = hash_round (hash, bits);
+         break;
+
+      case json_string:
+         hash = hash_round (hash, dedupe_hash_bytes (value->u.string.ptr,
+                                                     value->u.string.length));
+         break;
+
+      case json_boolean:
+         hash = hash_round (hash, (uint64_t) value->u.boolean);
+         break;
+
+      default:
+         break;
+   };
+
+   return diff_mix (hash);
+}
+
+/* a container whose children are being hashed */
+typedef struct
+{
+   const json_value * value;
+   diff_node * node;
+   unsigned int index;
+   uint64_t hash, sum;
+
+} diff_hash_frame;
+
+/* folds the hash of the child just done into its container */
+static void diff_hash_fold (diff_hash_frame * frame, uint64_t hash)
+{
+   const json_value * value = frame->value;
+
+   if (value->type == json_array)
+      frame->hash = hash_round (frame->hash, hash);
+   else
+   {
+      const json_object_entry * entry = &value->u.object.values [frame->index - 1];
+
+      frame->sum += hash_round (dedupe_hash_bytes (entry->name, entry->name_length), hash);
+   }
+}
+
+/* The children of a node are handed out in depth-first order as each
+ * container is entered; hashes are made on the way back up.
+ */
+static diff_node * diff_build (const json_value * value)
+{
+   diff_hash_frame * frames = 0, * frame;
+   size_t depth = 0, size = 0, count;
+   diff_node * nodes, * next, * node;
+   unsigned int length;
+   uint64_t hash = 0;
+   int done;
+
+   if (! (count = diff_count (value))
+         || ! (nodes = (diff_node *) malloc (count * sizeof (diff_node))))
+   {
+      return 0;
+   }
+
+   next = nodes + 1;
+   node = nodes;
+
+   for (;;)
+   {
+      node->children = next;
+
+      if (value->type != json_array && value->type != json_object)
+      {
+         hash = node->hash = diff_scalar_hash (value);
+         done = 1;
+      }
+      else
+      {
+         length = value->type == json_array ?
+            value->u.array.length : value->u.object.length;
+
+         next += length;
+
+         if (depth == size)
+         {
+            size = size ? size * 2 : 32;
+
+            if (! (frame = (diff_hash_frame *) realloc
+                     (frames, size * sizeof (diff_hash_frame))))
+            {
+               free (frames);
+               free (nodes);
+               return 0;
+            }
+
+            frames = frame;
+         }
+
+         frame = &frames [depth ++];
+         frame->value = value;
+         frame->node = node;
+         frame->index = 0;
+         frame->hash = value->type;
+         frame->sum = 0;
+
+         done = 0;
+      }
+
+      /* close the containers that are done, innermost first */
+      for (;;)
+      {
+         if (!depth)
+         {
+            free (frames);
+            return nodes;
+         }
+
+         frame = &frames [depth - 1];
+
+         if (done)
+            diff_hash_fold (frame, hash);
+
+         done = 0;
+
+         length = frame->value->type == json_array ?
+            frame->value->u.array.length : frame->value->u.object.length;
+
+         if (frame->index < length)
+            break;
+
+         if (frame->value->type == json_object)
+            frame->hash = hash_round (hash_round (frame->hash, length), frame->sum);
+
+         hash = frame->node->hash = diff_mix (frame->hash);
+         done = 1;
+         -- depth;
+      }
+
+      node = &frame->node->children [frame->index];
+      value = frame->value->type == json_array ?
+         frame->value->u.array.values [frame->index] :
+         frame->value->u.object.values [frame->index].value;
+
+      ++ frame->index;
+   }
+}
+
+static int diff_grow (void ** buf, size_t * size, size_t needed, size_t item)
+{
+   size_t new_size = *size ? *size : 64;
+   void * new_buf;
+
+   if (needed <= *size)
+      return 1;
+
+   while (new_size < needed)
+      new_size *= 2;
+
+   if (! (new_buf = realloc (*buf, new_size * item)))
+      return 0;
+
+   *buf = new_buf;
+   *size = new_size;
+
+   return 1;
+}
+
+/* appends "/" and the JSON Pointer escaped token, returns the old length */
+static size_t diff_push (diff_state * state, const char * token, size_t length,
+                         int * failed)
+{
+   size_t old = state->path_length, i;
+
+   if (!diff_grow ((void **) &state->path, &state->path_size,
+                   old + length * 2 + 2, 1))
+   {
+      *failed = 1;
+      return old;
+   }
+
+   state->path [state->path_length ++] = '/';
+
+   for (i = 0; i < length; ++ i)
+   {
+      if (token [i] == '~' || token [i] == '/')
+      {
+         state->path [state->path_length ++] = '~';
+         state->path [state->path_length ++] = token [i] == '~' ? '0' : '1';
+      }
+      else
+         state->path [state->path_length ++] = token [i];
+   }
+
+   return old;
+}
+
+static size_t diff_push_index (diff_state * state, size_t index, int * failed)
+{
+   char buf [24];
+
+   return diff_push (state, buf, snprintf (buf, sizeof (buf), "%zu", index), failed);
+}
+
+static int diff_op (diff_state * state, const char * op, const json_value * value)
+{
+   json_parser_callback callback = state->callback;
+   void * userdata = state->userdata;
+   int ret;
+
+   if ((ret = callback (userdata, JSON_OBJECT_BEGIN, 0, 0))
+         || (ret = callback (userdata, JSON_KEY, "op", 2))
+         || (ret = callback (userdata, JSON_STRING, op, strlen (op)))
+         || (ret = callback (userdata, JSON_KEY, "path", 4))
+         || (ret = callback (userdata, JSON_STRING, state->path ? state->path : "",
+                             state->path_length)))
+   {
+      return ret;
+   }
+
+   if (value)
+   {
+      if ((ret = callback (userdata, JSON_KEY, "value", 5))
+            || (ret = json_value_emit (value, callback, userdata)))
+      {
+         return ret;
+      }
+   }
+
+   return callback (userdata, JSON_OBJECT_END, 0, 0);
+}
+
+/* the matched (a, b) pairs of the shortest edit script between the hashes
+ * of a [0, n) and b [0, m), in order; 0 when there are more than
+ * DIFF_MAX_EDITS edits (or memory ran out, then *failed is set) */
+static size_t diff_myers (diff_state * state, const diff_node * a, size_t n,
+                          const diff_node * b, size_t m, size_t * matches,
+                          int * failed)
+{
+   size_t max = n + m < DIFF_MAX_EDITS ? n + m : DIFF_MAX_EDITS;
+   size_t * v, x, y, count = 0;
+   long d, k, end = -1, prev;
+
+   if (!diff_grow ((void **) &state->v, &state->v_size, 2 * max + 3, sizeof (size_t)))
+   {
+      *failed = 1;
+      return 0;
+   }
+
+   /* v [k + max + 1] is the furthest x on diagonal k */
+   v = state->v + max + 1;
+   v [1] = 0;
+
+   for (d = 0; d <= (long) max && end < 0; ++ d)
+   {
+      for (k = -d; k <= d; k += 2)
+      {
+         x = (k == -d || (k != d && v [k - 1] < v [k + 1])) ? v [k + 1] : v [k - 1] + 1;
+         y = x - k;
+
+         while (x < n && y < m && a [x].hash == b [y].hash)
+            ++ x, ++ y;
+
+         v [k] = x;
+
+         if (x >= n && y >= m)
+            end = d;
+      }
+
+      if (!diff_grow ((void **) &state->trace, &state->trace_size,
+                      (size_t) (d + 1) * (d + 1), sizeof (size_t)))
+      {
+         *failed = 1;
+         return 0;
+      }
+
+      memcpy (state->trace + d * d, v - d, (2 * d + 1) * sizeof (size_t));
+   }
+
+   if (end < 0)
+      return 0;
+
+   /* back from (n, m), pairs come out last first */
+   for (x = n, y = m, d = end; d >= 0; -- d)
+   {
+      size_t px = 0, py = 0;
+
+      k = (long) x - (long) y;
+
+      if (d > 0)
+      {
+         const size_t * pv = state->trace + (d - 1) * (d - 1) + (d - 1);
+
+         prev = (k == -d || (k != d && pv [k - 1] < pv [k + 1])) ? k + 1 : k - 1;
+         px = pv [prev];
+         py = px - prev;
+      }
+
+      while (x > px && y > py)
+      {
+         -- x, -- y;
+         matches [count * 2] = x;
+         matches [count * 2 + 1] = y;
+         ++ count;
+      }
+
+      x = px;
+      y = py;
+   }
+
+   for (x = 0; x < count / 2; ++ x)
+   {
+      size_t i = x * 2, j = (count - 1 - x) * 2, t;
+
+      t = matches [i]; matches [i] = matches [j]; matches [j] = t;
+      t = matches [i + 1]; matches [i + 1] = matches [j + 1]; matches [j + 1] = t;
+   }
+
+   return count;
+}
+
+static void diff_close (diff_frame * frame)
+{
+   free (frame->matches);
+   free (frame->slots);
+   free (frame->seen);
+}
+
+/* Starts comparing two arrays: the common ends are trimmed and the middle
+ * matched by Myers.
+ */
+static int diff_open_array (diff_state * state, diff_frame * frame)
+{
+   const diff_node * na = frame->na, * nb = frame->nb;
+   size_t n = frame->a->u.array.length, m = frame->b->u.array.length, start = 0;
+   int failed = 0;
+
+   while (start < n && start < m && na->children [start].hash == nb->children [start].hash)
+      ++ start;
+
+   while (n > start && m > start
+            && na->children [n - 1].hash == nb->children [m - 1].hash)
+   {
+      -- n, -- m;
+   }
+
+   if (! (frame->matches = (size_t *) malloc
+            (((n < m ? n : m) - start + 1) * 2 * sizeof (size_t))))
+   {
+      return ENOMEM;
+   }
+
+   frame->count = diff_myers (state, na->children + start, n - start,
+                              nb->children + start, m - start, frame->matches, &failed);
+
+   if (failed)
+      return ENOMEM;
+
+   /* past the last match, the rest of both sides is one gap */
+   frame->matches [frame->count * 2] = n - start;
+   frame->matches [frame->count * 2 + 1] = m - start;
+
+   frame->start = frame->index = start;
+   return 0;
+}
+
+static int diff_open_object (diff_frame * frame)
+{
+   const json_value * b = frame->b;
+   unsigned int m = b->u.object.length, j;
+   size_t mask = 15, slot;
+
+   while (mask + 1 < (size_t) m * 2)
+      mask = mask * 2 + 1;
+
+   frame->mask = mask;
+   frame->slots = (unsigned int *) calloc (mask + 1, sizeof (*frame->slots));
+   frame->seen = (unsigned char *) calloc (m + 1, 1);
+
+   if (!frame->slots || !frame->seen)
+      return ENOMEM;
+
+   for (j = 0; j < m; ++ j)
+   {
+      const json_object_entry * entry = &b->u.object.values [j];
+
+      for (slot = dedupe_hash_bytes (entry->name, entry->name_length) & mask;
+           frame->slots [slot]; slot = (slot + 1) & mask)
+      {
+         if (dedupe_same_name (&b->u.object.values [frame->slots [slot] - 1], entry))
+            break;
+      }
+
+      /* with duplicate names the first one counts */
+      if (!frame->slots [slot])
+         frame->slots [slot] = j + 1;
+      else
+         frame->seen [j] = 1;
+   }
+
+   return 0;
+}
+
+static int diff_open (diff_state * state,
+                      const json_value * a, const diff_node * na,
+                      const json_value * b, const diff_node * nb, size_t path_length)
+{
+   diff_frame * frame;
+   int ret;
+
+   if (!diff_grow ((void **) &state->frames, &state->frames_size,
+                   state->depth + 1, sizeof (diff_frame)))
+   {
+      return ENOMEM;
+   }
+
+   frame = &state->frames [state->depth ++];
+   memset (frame, 0, sizeof (*frame));
+
+   frame->a = a;
+   frame->na = na;
+   frame->b = b;
+   frame->nb = nb;
+   frame->path_length = path_length;
+
+   ret = a->type == json_array ?
+      diff_open_array (state, frame) : diff_open_object (frame);
+
+   if (ret)
+   {
+      diff_close (frame);
+      -- state->depth;
+   }
+
+   return ret;
+}
+
+/* The next pair of elements to compare goes to child, its index pushed on
+ * the path (*old is the path before); removes and adds on the way are
+ * written out.  child [0] is left 0 once the arrays are done.
+ */
+static int diff_array_next (diff_state * state, diff_frame * frame,
+                            const void * child [4], size_t * old)
+{
+   const json_value * a = frame->a, * b = frame->b;
+   size_t start = frame->start, x, y;
+   int ret = 0, failed = 0;
+
+   for (; frame->gap <= frame->count; ++ frame->gap)
+   {
+      x = frame->matches [frame->gap * 2];
+      y = frame->matches [frame->gap * 2 + 1];
+
+      if (!frame->in_gap)
+      {
+         frame->pairs = x - frame->ax < y - frame->by ? x - frame->ax : y - frame->by;
+         frame->in_gap = 1;
+      }
+
+      if (frame->pairs > 0)
+      {
+         -- frame->pairs;
+
+         *old = diff_push_index (state, frame->index ++, &failed);
+
+         if (failed)
+            return ENOMEM;
+
+         child [0] = a->u.array.values [start + frame->ax];
+         child [1] = &frame->na->children [start + frame->ax ++];
+         child [2] = b->u.array.values [start + frame->by];
+         child [3] = &frame->nb->children [start + frame->by ++];
+
+         return 0;
+      }
+
+      for (; frame->ax < x && !ret; ++ frame->ax)
+      {
+         *old = diff_push_index (state, frame->index, &failed);
+         ret = failed ? ENOMEM : diff_op (state, "remove", 0);
+         state->path_length = *old;
+      }
+
+      for (; frame->by < y && !ret; ++ frame->by, ++ frame->index)
+      {
+         *old = diff_push_index (state, frame->index, &failed);
+         ret = failed ? ENOMEM : diff_op (state, "add", b->u.array.values [start + frame->by]);
+         state->path_length = *old;
+      }
+
+      if (ret)
+         return ret;
+
+      /* the match itself */
+      ++ frame->ax, ++ frame->by, ++ frame->index;
+      frame->in_gap = 0;
+   }
+
+   child [0] = 0;
+   return 0;
+}
+
+/* the same for objects: a's members in order, then the members only b has */
+static int diff_object_next (diff_state * state, diff_frame * frame,
+                             const void * child [4], size_t * old)
+{
+   const json_value * a = frame->a, * b = frame->b;
+   size_t slot, j;
+   int ret = 0, failed = 0;
+
+   while (frame->ax < a->u.object.length)
+   {
+      const json_object_entry * entry = &a->u.object.values [frame->ax];
+
+      for (slot = dedupe_hash_bytes (entry->name, entry->name_length) & frame->mask;
+           frame->slots [slot]; slot = (slot + 1) & frame->mask)
+      {
+         if (dedupe_same_name (&b->u.object.values [frame->slots [slot] - 1], entry))
+            break;
+      }
+
+      *old = diff_push (state, entry->name, entry->name_length, &failed);
+
+      if (failed)
+         return ENOMEM;
+
+      if (frame->slots [slot] && !frame->seen [j = frame->slots [slot] - 1])
+      {
+         frame->seen [j] = 1;
+
+         child [0] = entry->value;
+         child [1] = &frame->na->children [frame->ax ++];
+         child [2] = b->u.object.values [j].value;
+         child [3] = &frame->nb->children [j];
+
+         return 0;
+      }
+
+      if (!frame->slots [slot])
+         ret = diff_op (state, "remove", 0);
+
+      state->path_length = *old;
+      ++ frame->ax;
+
+      if (ret)
+         return ret;
+   }
+
+   for (; frame->by < b->u.object.length && !ret; ++ frame->by)
+   {
+      const json_object_entry * entry = &b->u.object.values [frame->by];
+
+      if (frame->seen [frame->by])
+         continue;
+
+      *old = diff_push (state, entry->name, entry->name_length, &failed);
+      ret = failed ? ENOMEM : diff_op (state, "add", entry->value);
+      state->path_length = *old;
+   }
+
+   child [0] = 0;
+   return ret;
+}
+
+/* Compares a and b.  Pairs of arrays or objects go on the frame stack and
+ * are walked one pair of children at a time; anything else that differs is
+ * replaced.
+ */
+static int diff_value (diff_state * state,
+                       const json_value * a, const diff_node * na,
+                       const json_value * b, const diff_node * nb)
+{
+   const void * child [4] = { 0 };
+   diff_frame * frame;
+   size_t old = state->path_length;
+   int ret = 0;
+
+   for (;;)
+   {
+      if (a != b && na->hash != nb->hash)
+      {
+         if ((a->type == json_array && b->type == json_array)
+               || (a->type == json_object && b->type == json_object))
+         {
+            if ((ret = diff_open (state, a, na, b, nb, old)))
+               break;
+         }
+         else
+         {
+            if ((ret = diff_op (state, "replace", b)))
+               break;
+
+            state->path_length = old;
+         }
+      }
+      else
+         state->path_length = old;
+
+      /* the next pair of children, from the innermost pair not done */
+      for (;;)
+      {
+         if (!state->depth)
+            return 0;
+
+         frame = &state->frames [state->depth - 1];
+
+         ret = frame->a->type == json_array ?
+            diff_array_next (state, frame, child, &old) :
+            diff_object_next (state, frame, child, &old);
+
+         if (ret || child [0])
+            break;
+
+         state->path_length = frame->path_length;
+         diff_close (frame);
+         -- state->depth;
+      }
+
+      if (ret)
+         break;
+
+      a = (const json_value *) child [0];
+      na = (const diff_node *) child [1];
+      b = (const json_value *) child [2];
+      nb = (const diff_node *) child [3];
+   }
+
+   while (state->depth > 0)
+      diff_close (&state->frames [-- state->depth]);
+
+   return ret;
+}
+
+int json_value_diff (const json_value * from, const json_value * to,
+                     json_parser_callback callback, void * userdata)
+{
+   diff_node * na = 0, * nb = 0;
+   diff_state state;
+   int ret;
+
+   memset (&state, 0, sizeof (state));
+   state.callback = callback;
+   state.userdata = userdata;
+
+   if (! (na = diff_build (from)) || ! (nb = diff_build (to)))
+      ret = ENOMEM;
+   else if (! (ret = callback (userdata, JSON_ARRAY_BEGIN, 0, 0))
+         && ! (ret = diff_value (&state, from, na, to, nb)))
+   {
+      ret = callback (userdata, JSON_ARRAY_END, 0, 0);
+   }
+
+   free (na);
+   free (nb);
+   free (state.path);
+   free (state.v);
+   free (state.trace);
+   free (state.frames);
+
+   return ret;
+}
+
+/* JSON Patch (RFC 6902).
+ *
+ * The document is edited in place and the patch is atomic: the first time
+ * an operation changes a container, its values are copied into a block of
+ * its own (with room to grow) and the original block is kept.  Rolling
+ * back puts the original blocks back and frees what the patch created;
+ * committing frees the original blocks and what the patch removed.
+ *
+ * Paths are resolved from the nodes of the previous path where the two
+ * share a prefix.  An edit only ever invalidates what lies below the
+ * container it changed, so the cache is cut back to that container.
+ *
+ * Values and blocks that end up in the tree come from the settings'
+ * mem_alloc and go back through their mem_free, like the parser's.
+ */
+
+#define PATCH_CACHE_DEPTH 64
+
+typedef struct
+{
+   json_value * value;
+
+   void * original;          /* values of value before the patch */
+   unsigned int length;      /* and their number */
+
+   int copied;               /* values is then a block of the patch's own */
+   size_t capacity, names_used, names_size;
+
+} patch_container;
+
+typedef struct
+{
+   json_settings settings;
+   json_value * root;
+
+   patch_container * containers;
+   size_t container_count, container_size;
+
+   size_t * slots;           /* containers by value, index + 1 */
+   size_t slot_mask;
+
+   json_value ** created, ** dropped;
+   size_t created_count, created_size, dropped_count, dropped_size;
+
+   /* the parent part of the last path resolved */
+   const json_char * cache_path;
+   size_t cache_ends [PATCH_CACHE_DEPTH + 1];
+   json_value * cache_nodes [PATCH_CACHE_DEPTH + 1];
+   size_t cache_depth;
+
+   json_char * token;
+   size_t token_length, token_size;
+
+   /* depth of the parent of the last path resolved */
+   size_t depth;
+
+   unsigned int op;
+   char * error;
+
+} patch_state;
+
+static int patch_error (patch_state * state, const char * format, ...)
+{
+   va_list args;
+   int length;
+
+   if (!state->error)
+      return 0;
+
+   length = snprintf (state->error, json_error_max, "op %u: ", state->op);
+
+   va_start (args, format);
+   vsnprintf (state->error + length, json_error_max - length, format, args);
+   va_end (args);
+
+   return 0;
+}
+
+static int patch_no_memory (patch_state * state)
+{
+   return patch_error (state, "Memory allocation failure");
+}
+
+static int patch_push (patch_state * state, json_value *** list, size_t * count,
+                       size_t * size, json_value * value)
+{
+   if (!diff_grow ((void **) list, size, *count + 1, sizeof (json_value *)))
+      return patch_no_memory (state);
+
+   (*list) [(*count) ++] = value;
+   return 1;
+}
+
+static int patch_drop (patch_state * state, json_value * value)
+{
+   return patch_push (state, &state->dropped, &state->dropped_count,
+                      &state->dropped_size, value);
+}
+
+static void * patch_alloc (patch_state * state, size_t size, int zero)
+{
+   return state->settings.mem_alloc (size, zero, state->settings.user_data);
+}
+
+static void patch_free (patch_state * state, void * ptr)
+{
+   state->settings.mem_free (ptr, state->settings.user_data);
+}
+
+/* A node of the copy of src, its names included, with no children yet:
+ * their number goes up as they are added, so that a copy cut short is a
+ * tree json_value_free_ex can free.
+ */
+static json_value * patch_copy_value (patch_state * state, const json_value * src,
+                                      json_value * parent)
+{
+   json_value * value;
+   unsigned int i;
+   size_t names = 0;
+   char * chars;
+
+   if (! (value = (json_value *) patch_alloc
+            (state, sizeof (json_value) + state->settings.value_extra, 1)))
+   {
+      return 0;
+   }
+
+   value->type = src->type;
+   value->parent = parent;
+
+   #ifdef JSON_TRACK_SOURCE
+      value->line = src->line;
+      value->col = src->col;
+   #endif
+
+   switch (src->type)
+   {
+      case json_array:
+
+         if (src->u.array.length
+               && ! (value->u.array.values = (json_value **) patch_alloc
+                        (state, src->u.array.length * sizeof (json_value *), 0)))
+         {
+            break;
+         }
+
+         return value;
+
+      case json_object:
+
+         for (i = 0; i < src->u.object.length; ++ i)
+            names += src->u.object.values [i].name_length + 1;
+
+         if (src->u.object.length
+               && ! (value->u.object.values = (json_object_entry *) patch_alloc
+                        (state, src->u.object.length * sizeof (json_object_entry) + names, 0)))
+         {
+            break;
+         }
+
+         chars = (char *) (value->u.object.values + src->u.object.length);
+
+         for (i = 0; i < src->u.object.length; ++ i)
+         {
+            const json_object_entry * entry = &src->u.object.values [i];
+            json_object_entry * copy = &value->u.object.values [i];
+
+            memcpy (chars, entry->name, entry->name_length + 1);
+            copy->name = chars;
+            copy->name_length = entry->name_length;
+            chars += entry->name_length + 1;
+         }
+
+         return value;
+
+      case json_string:
+
+         if (! (value->u.string.ptr = (json_char *) patch_alloc
+                  (state, src->u.string.length + 1, 0)))
+         {
+            break;
+         }
+
+         memcpy (value->u.string.ptr, src->u.string.ptr, src->u.string.length + 1);
+         value->u.string.length = src->u.string.length;
+
+         return value;
+
+      default:
+
+         value->u = src->u;
+         return value;
+   };
+
+   json_value_free_ex (&state->settings, value);
+   return 0;
+}
+
+/* a copy of src laid out the way the parser lays out its trees, so that
+ * json_value_free_ex can free it.  The copy being filled is followed down
+ * and back up through the parent pointers of its nodes */
+static json_value * patch_copy (patch_state * state, const json_value * src)
+{
+   walk_stack stack = { 0 };
+   json_value * copy, * dest, * value;
+   const json_value * child;
+
+   if (! (copy = dest = patch_copy_value (state, src, 0)))
+      return 0;
+
+   if ((src->type == json_array || src->type == json_object)
+         && !walk_push (&stack, src))
+   {
+      json_value_free_ex (&state->settings, copy);
+      return 0;
+   }
+
+   while (stack.depth > 0)
+   {
+      if (! (child = walk_child (&stack.frames [stack.depth - 1])))
+      {
+         -- stack.depth;
+         dest = dest->parent;
+         continue;
+      }
+
+      if (! (value = patch_copy_value (state, child, dest)))
+         break;
+
+      if (dest->type == json_array)
+         dest->u.array.values [dest->u.array.length ++] = value;
+      else
+         dest->u.object.values [dest->u.object.length ++].value = value;
+
+      if (child->type == json_array || child->type == json_object)
+      {
+         if (!walk_push (&stack, child))
+            break;
+
+         dest = value;
+      }
+   }
+
+   free (stack.frames);
+
+   if (stack.depth > 0)
+   {
+      json_value_free_ex (&state->settings, copy);
+      return 0;
+   }
+
+   return copy;
+}
+
+/* a and b alone, without their children */
+static int patch_equal_value (const json_value * a, const json_value * b)
+{
+   if ((a->type == json_integer || a->type == json_double)
+         && (b->type == json_integer || b->type == json_double))
+   {
+      if (a->type == json_integer && b->type == json_integer)
+         return a->u.integer == b->u.integer;
+
+      return (a->type == json_integer ? (double) a->u.integer : a->u.dbl)
+          == (b->type == json_integer ? (double) b->u.integer : b->u.dbl);
+   }
+
+   if (a->type != b->type)
+      return 0;
+
+   switch (a->type)
+   {
+      case json_array:
+         return a->u.array.length == b->u.array.length;
+
+      case json_object:
+         return a->u.object.length == b->u.object.length;
+
+      case json_string:
+         return a->u.string.length == b->u.string.length
+            && !memcmp (a->u.string.ptr, b->u.string.ptr, a->u.string.length);
+
+      case json_boolean:
+         return a->u.boolean == b->u.boolean;
+
+      default:
+         return 1;
+   };
+}
+
+/* 1 when equal, 0 when not, -1 when out of memory.  The containers being
+ * compared are walked on a stack of pairs: a's frame, b's value at the same
+ * depth in bs */
+static int patch_equal (const json_value * a, const json_value * b)
+{
+   walk_stack stack = { 0 };
+   const json_value ** bs = 0, ** grown;
+   size_t bs_size = 0;
+   walk_frame * frame;
+   unsigned int j;
+   int ret = 1;
+
+   for (;;)
+   {
+      if (!patch_equal_value (a, b))
+      {
+         ret = 0;
+         break;
+      }
+
+      if ((a->type == json_array && a->u.array.length)
+            || (a->type == json_object && a->u.object.length))
+      {
+         if (stack.depth == bs_size)
+         {
+            bs_size = bs_size ? bs_size * 2 : 32;
+
+            if (! (grown = (const json_value **) realloc (bs, bs_size * sizeof (*bs))))
+            {
+               ret = -1;
+               break;
+            }
+
+            bs = grown;
+         }
+
+         bs [stack.depth] = b;
+
+         if (!walk_push (&stack, a))
+         {
+            ret = -1;
+            break;
+         }
+      }
+
+      /* the next pair, from the innermost containers not done */
+      while (stack.depth > 0 && ! (a = walk_child (frame = &stack.frames [stack.depth - 1])))
+         -- stack.depth;
+
+      if (!stack.depth)
+         break;
+
+      b = bs [stack.depth - 1];
+
+      if (b->type == json_array)
+      {
+         b = b->u.array.values [frame->index - 1];
+         continue;
+      }
+
+      for (j = 0; j < b->u.object.length; ++ j)
+      {
+         if (dedupe_same_name (&frame->value->u.object.values [frame->index - 1],
+                               &b->u.object.values [j]))
+         {
+            break;
+         }
+      }
+
+      if (j == b->u.object.length)
+      {
+         ret = 0;
+         break;
+      }
+
+      b = b->u.object.values [j].value;
+   }
+
+   free (stack.frames);
+   free (bs);
+   return ret;
+}
+
+static size_t patch_slot (const patch_state * state, const json_value * value)
+{
+   size_t i;
+
+   for (i = ((uintptr_t) value >> 4) * HASH_PRIME1 >> 32 & state->slot_mask;
+        state->slots [i]; i = (i + 1) & state->slot_mask)
+   {
+      if (state->containers [state->slots [i] - 1].value == value)
+         break;
+   }
+
+   return i;
+}
+
+/* the record of value, made on the first edit; 0 when out of memory */
+static patch_container * patch_touch (patch_state * state, json_value * value)
+{
+   patch_container * container;
+   size_t i, size;
+
+   if (state->slots && state->slots [i = patch_slot (state, value)])
+      return &state->containers [state->slots [i] - 1];
+
+   if ((state->container_count + 1) * 2 > state->slot_mask + 1)
+   {
+      size_t * old = state->slots, old_size = old ? state->slot_mask + 1 : 0;
+
+      size = old_size ? old_size * 2 : 64;
+
+      if (! (state->slots = (size_t *) calloc (size, sizeof (size_t))))
+      {
+         state->slots = old;
+         return 0;
+      }
+
+      state->slot_mask = size - 1;
+
+      for (i = 0; i < old_size; ++ i)
+      {
+         if (old [i])
+            state->slots [patch_slot (state, state->containers [old [i] - 1].value)] = old [i];
+      }
+
+      free (old);
+   }
+
+   if (!diff_grow ((void **) &state->containers, &state->container_size,
+                   state->container_count + 1, sizeof (patch_container)))
+   {
+      return 0;
+   }
+
+   container = &state->containers [state->container_count ++];
+   memset (container, 0, sizeof (*container));
+   container->value = value;
+
+   if (value->type == json_array)
+   {
+      container->original = value->u.array.values;
+      container->length = value->u.array.length;
+   }
+   else
+   {
+      container->original = value->u.object.values;
+      container->length = value->u.object.length;
+   }
+
+   state->slots [patch_slot (state, value)] = state->container_count;
+   return container;
+}
+
+/* value's values in a block of the patch's own, with room for extra more */
+static int patch_array_reserve (patch_state * state, json_value * value, size_t extra)
+{
+   patch_container * container = patch_touch (state, value);
+   size_t needed = value->u.array.length + extra, capacity;
+   json_value ** values;
+
+   if (!container)
+      return patch_no_memory (state);
+
+   if (container->copied && needed <= container->capacity)
+      return 1;
+
+   capacity = container->capacity * 2 > needed ? container->capacity * 2 : needed;
+
+   if (capacity < 8)
+      capacity = 8;
+
+   if (! (values = (json_value **) patch_alloc (state, capacity * sizeof (json_value *), 0)))
+      return patch_no_memory (state);
+
+   if (value->u.array.length)
+      memcpy (values, value->u.array.values, value->u.array.length * sizeof (json_value *));
+
+   if (container->copied)
+      patch_free (state, value->u.array.values);
+
+   value->u.array.values = values;
+   container->copied = 1;
+   container->capacity = capacity;
+
+   return 1;
+}
+
+/* the same for objects, whose block also holds the names */
+static int patch_object_reserve (patch_state * state, json_value * value,
+                                 size_t extra, size_t extra_names)
+{
+   patch_container * container = patch_touch (state, value);
+   size_t needed = value->u.object.length + extra, capacity, names = 0, names_size, i;
+   json_object_entry * entries;
+   char * chars;
+
+   if (!container)
+      return patch_no_memory (state);
+
+   if (container->copied && needed <= container->capacity
+         && container->names_used + extra_names <= container->names_size)
+   {
+      return 1;
+   }
+
+   for (i = 0; i < value->u.object.length; ++ i)
+      names += value->u.object.values [i].name_length + 1;
+
+   capacity = container->capacity * 2 > needed ? container->capacity * 2 : needed;
+   names_size = container->names_size * 2 > names + extra_names ?
+      container->names_size * 2 : names + extra_names;
+
+   if (capacity < 8)
+      capacity = 8;
+
+   if (! (entries = (json_object_entry *) patch_alloc
+            (state, capacity * sizeof (json_object_entry) + names_size, 0)))
+   {
+      return patch_no_memory (state);
+   }
+
+   chars = (char *) (entries + capacity);
+
+   for (i = 0; i < value->u.object.length; ++ i)
+   {
+      const json_object_entry * entry = &value->u.object.values [i];
+
+      memcpy (chars, entry->name, entry->name_length + 1);
+      entries [i] = *entry;
+      entries [i].name = chars;
+      chars += entry->name_length + 1;
+   }
+
+   if (container->copied)
+      patch_free (state, value->u.object.values);
+
+   value->u.object.values = entries;
+   container->copied = 1;
+   container->capacity = capacity;
+   container->names_used = names;
+   container->names_size = names_size;
+
+   return 1;
+}
+
+/* the unescaped token of path [start, end) into state->token */
+static int patch_token (patch_state * state, const json_char * path,
+                        size_t start, size_t end)
+{
+   size_t i;
+
+   if (!diff_grow ((void **) &state->token, &state->token_size, end - start + 1, 1))
+      return patch_no_memory (state);
+
+   for (i = start, state->token_length = 0; i < end; ++ i)
+   {
+      json_char c = path [i];
+
+      if (c == '~')
+      {
+         if (i + 1 == end || (path [i + 1] != '0' && path [i + 1] != '1'))
+            return patch_error (state, "Invalid escape in path");
+
+         c = path [++ i] == '0' ? '~' : '/';
+      }
+
+      state->token [state->token_length ++] = c;
+   }
+
+   state->token [state->token_length] = 0;
+   return 1;
+}
+
+/* the index a token names in an array of length values; "-" is length
+ * itself, which only adding accepts */
+static int patch_index (patch_state * state, size_t length, int adding, size_t * index)
+{
+   const json_char * token = state->token;
+   size_t i;
+
+   if (state->token_length == 1 && token [0] == '-' && adding)
+   {
+      *index = length;
+      return 1;
+   }
+
+   if (!state->token_length || state->token_length > 10
+         || (token [0] == '0' && state->token_length > 1))
+   {
+      return patch_error (state, "Invalid array index: %s", token);
+   }
+
+   for (i = 0, *index = 0; i < state->token_length; ++ i)
+   {
+      if (token [i] < '0' || token [i] > '9')
+         return patch_error (state, "Invalid array index: %s", token);
+
+      *index = *index * 10 + (token [i] - '0');
+   }
+
+   if (*index > length || (*index == length && !adding))
+      return patch_error (state, "Array index out of range: %s", token);
+
+   return 1;
+}
+
+static unsigned int patch_member (const json_value * object, const json_char * name,
+                                  size_t length)
+{
+   unsigned int i;
+
+   for (i = 0; i < object->u.object.length; ++ i)
+   {
+      if (object->u.object.values [i].name_length == length
+            && !memcmp (object->u.object.values [i].name, name, length))
+      {
+         break;
+      }
+   }
+
+   return i;
+}
+
+/* the container holding the last token of path, which is left unescaped in
+ * state->token; 0 (with the error set) when it does not exist */
+static json_value * patch_parent (patch_state * state, const json_char * path,
+                                  size_t length)
+{
+   size_t end, common, start, depth, i;
+   json_value * node;
+
+   if (length && path [0] != '/')
+   {
+      patch_error (state, "Path must start with /: %s", path);
+      return 0;
+   }
+
+   for (end = length; end > 0 && path [end - 1] != '/'; -- end)
+      ;
+
+   /* path [0, end - 1) is the parent; find what the cache shares of it */
+   end = end ? end - 1 : 0;
+   common = 0;
+
+   if (state->cache_path)
+   {
+      size_t cached = state->cache_ends [state->cache_depth];
+
+      while (common < end && common < cached
+               && path [common] == state->cache_path [common])
+      {
+         ++ common;
+      }
+   }
+
+   for (depth = state->cache_path ? state->cache_depth : 0; depth > 0; -- depth)
+   {
+      i = state->cache_ends [depth];
+
+      if (i <= common && (i == end || path [i] == '/'))
+         break;
+   }
+
+   node = state->cache_nodes [depth];
+   start = state->cache_ends [depth];
+
+   while (start < end)
+   {
+      for (i = start + 1; i < end && path [i] != '/'; ++ i)
+         ;
+
+      if (!patch_token (state, path, start + 1, i))
+         return 0;
+
+      if (node->type == json_object)
+      {
+         unsigned int member = patch_member (node, state->token, state->token_length);
+
+         if (member == node->u.object.length)
+         {
+            patch_error (state, "No such member: %s", state->token);
+            return 0;
+         }
+
+         node = node->u.object.values [member].value;
+      }
+      else if (node->type == json_array)
+      {
+         size_t index;
+
+         if (!patch_index (state, node->u.array.length, 0, &index))
+            return 0;
+
+         node = node->u.array.values [index];
+      }
+      else
+      {
+         patch_error (state, "Not a container: %s", state->token);
+         return 0;
+      }
+
+      ++ depth;
+
+      if (depth <= PATCH_CACHE_DEPTH)
+      {
+         state->cache_nodes [depth] = node;
+         state->cache_ends [depth] = i;
+      }
+
+      start = i;
+   }
+
+   state->cache_path = path;
+   state->cache_depth = depth < PATCH_CACHE_DEPTH ? depth : PATCH_CACHE_DEPTH;
+   state->depth = depth;
+
+   if (!patch_token (state, path, end + (length > 0), length))
+      return 0;
+
+   if (node->type != json_object && node->type != json_array)
+   {
+      patch_error (state, "Not a container: %s", path);
+      return 0;
+   }
+
+   return node;
+}
+
+/* what lies below the container just edited may have moved */
+static void patch_edited (patch_state * state)
+{
+   if (state->cache_depth > state->depth)
+      state->cache_depth = state->depth;
+}
+
+static void patch_set_root (patch_state * state, json_value * value)
+{
+   value->parent = 0;
+   state->root = state->cache_nodes [0] = value;
+   state->cache_depth = 0;
+}
+
+/* the value at path, or 0 */
+static json_value * patch_get (patch_state * state, const json_char * path, size_t length)
+{
+   json_value * parent;
+   unsigned int member;
+   size_t index;
+
+   if (!length)
+      return state->root;
+
+   if (! (parent = patch_parent (state, path, length)))
+      return 0;
+
+   if (parent->type == json_array)
+   {
+      if (!patch_index (state, parent->u.array.length, 0, &index))
+         return 0;
+
+      return parent->u.array.values [index];
+   }
+
+   member = patch_member (parent, state->token, state->token_length);
+
+   if (member == parent->u.object.length)
+   {
+      patch_error (state, "No such member: %s", state->token);
+      return 0;
+   }
+
+   return parent->u.object.values [member].value;
+}
+
+/* puts value (already the patch's) at path */
+static int patch_add (patch_state * state, const json_char * path, size_t length,
+                      json_value * value)
+{
+   json_value * parent;
+   patch_container * container;
+   unsigned int member;
+   size_t index;
+
+   if (!length)
+   {
+      if (!patch_drop (state, state->root))
+         return 0;
+
+      patch_set_root (state, value);
+      return 1;
+   }
+
+   if (! (parent = patch_parent (state, path, length)))
+      return 0;
+
+   value->parent = parent;
+
+   if (parent->type == json_array)
+   {
+      if (!patch_index (state, parent->u.array.length, 1, &index)
+            || !patch_array_reserve (state, parent, 1))
+      {
+         return 0;
+      }
+
+      memmove (parent->u.array.values + index + 1, parent->u.array.values + index,
+               (parent->u.array.length - index) * sizeof (json_value *));
+
+      parent->u.array.values [index] = value;
+      ++ parent->u.array.length;
+   }
+   else if ((member = patch_member (parent, state->token, state->token_length))
+               < parent->u.object.length)
+   {
+      if (!patch_object_reserve (state, parent, 0, 0)
+            || !patch_drop (state, parent->u.object.values [member].value))
+      {
+         return 0;
+      }
+
+      parent->u.object.values [member].value = value;
+   }
+   else
+   {
+      json_object_entry * entry;
+      char * chars;
+
+      if (!patch_object_reserve (state, parent, 1, state->token_length + 1))
+         return 0;
+
+      container = patch_touch (state, parent);
+      chars = (char *) (parent->u.object.values + container->capacity)
+                 + container->names_used;
+
+      memcpy (chars, state->token, state->token_length + 1);
+      container->names_used += state->token_length + 1;
+
+      entry = &parent->u.object.values [parent->u.object.length ++];
+      entry->name = chars;
+      entry->name_length = (unsigned int) state->token_length;
+      entry->value = value;
+   }
+
+   patch_edited (state);
+   return 1;
+}
+
+/* detaches the value at path and returns it, or 0 */
+static json_value * patch_take (patch_state * state, const json_char * path, size_t length)
+{
+   json_value * parent, * value;
+   unsigned int member;
+   size_t index;
+
+   if (!length)
+   {
+      patch_error (state, "Cannot remove the whole document");
+      return 0;
+   }
+
+   if (! (parent = patch_parent (state, path, length)))
+      return 0;
+
+   if (parent->type == json_array)
+   {
+      if (!patch_index (state, parent->u.array.length, 0, &index)
+            || !patch_array_reserve (state, parent, 0))
+      {
+         return 0;
+      }
+
+      value = parent->u.array.values [index];
+
+      memmove (parent->u.array.values + index, parent->u.array.values + index + 1,
+               (parent->u.array.length - index - 1) * sizeof (json_value *));
+
+      -- parent->u.array.length;
+   }
+   else
+   {
+      member = patch_member (parent, state->token, state->token_length);
+
+      if (member == parent->u.object.length)
+      {
+         patch_error (state, "No such member: %s", state->token);
+         return 0;
+      }
+
+      if (!patch_object_reserve (state, parent, 0, 0))
+         return 0;
+
+      value = parent->u.object.values [member].value;
+
+      memmove (parent->u.object.values + member, parent->u.object.values + member + 1,
+               (parent->u.object.length - member - 1) * sizeof (json_object_entry));
+
+      -- parent->u.object.length;
+   }
+
+   patch_edited (state);
+   return value;
+}
+
+static int patch_replace (patch_state * state, const json_char * path, size_t length,
+                          json_value * value)
+{
+   json_value * parent, ** slot;
+   unsigned int member;
+   size_t index;
+
+   if (!length)
+      return patch_add (state, path, length, value);
+
+   if (! (parent = patch_parent (state, path, length)))
+      return 0;
+
+   if (parent->type == json_array)
+   {
+      if (!patch_index (state, parent->u.array.length, 0, &index)
+            || !patch_array_reserve (state, parent, 0))
+      {
+         return 0;
+      }
+
+      slot = &parent->u.array.values [index];
+   }
+   else
+   {
+      member = patch_member (parent, state->token, state->token_length);
+
+      if (member == parent->u.object.length)
+         return patch_error (state, "No such member: %s", state->token);
+
+      if (!patch_object_reserve (state, parent, 0, 0))
+         return 0;
+
+      slot = &parent->u.object.values [member].value;
+   }
+
+   if (!patch_drop (state, *slot))
+      return 0;
+
+   value->parent = parent;
+   *slot = value;
+
+   patch_edited (state);
+   return 1;
+}
+
+static const json_value * patch_field (const json_value * op, const char * name)
+{
+   unsigned int member = patch_member (op, name, strlen (name));
+
+   return member < op->u.object.length ? op->u.object.values [member].value : 0;
+}
+
+static int patch_string_field (patch_state * state, const json_value * op,
+                               const char * name, const json_value ** field)
+{
+   if (! (*field = patch_field (op, name)) || (*field)->type != json_string)
+      return patch_error (state, "Missing or invalid \"%s\"", name);
+
+   return 1;
+}
+
+/* a copy of the "value" of op, as one of the patch's values */
+static json_value * patch_value (patch_state * state, const json_value * op)
+{
+   const json_value * field = patch_field (op, "value");
+   json_value * value;
+
+   if (!field)
+   {
+      patch_error (state, "Missing \"value\"");
+      return 0;
+   }
+
+   if (! (value = patch_copy (state, field)))
+   {
+      patch_no_memory (state);
+      return 0;
+   }
+
+   if (!patch_push (state, &state->created, &state->created_count,
+                    &state->created_size, value))
+   {
+      json_value_free_ex (&state->settings, value);
+      return 0;
+   }
+
+   return value;
+}
+
+static int patch_op (patch_state * state, const json_value * op)
+{
+   const json_value * kind, * path, * from = 0;
+   const json_char * name;
+   json_value * value;
+
+   if (op->type != json_object)
+      return patch_error (state, "Not an object");
+
+   if (!patch_string_field (state, op, "op", &kind)
+         || !patch_string_field (state, op, "path", &path))
+   {
+      return 0;
+   }
+
+   name = kind->u.string.ptr;
+
+   if (!strcmp (name, "move") || !strcmp (name, "copy"))
+   {
+      if (!patch_string_field (state, op, "from", &from))
+         return 0;
+   }
+
+   if (!strcmp (name, "add"))
+   {
+      return (value = patch_value (state, op))
+         && patch_add (state, path->u.string.ptr, path->u.string.length, value);
+   }
+
+   if (!strcmp (name, "remove"))
+   {
+      return (value = patch_take (state, path->u.string.ptr, path->u.string.length))
+         && patch_drop (state, value);
+   }
+
+   if (!strcmp (name, "replace"))
+   {
+      return (value = patch_value (state, op))
+         && patch_replace (state, path->u.string.ptr, path->u.string.length, value);
+   }
+
+   if (!strcmp (name, "move"))
+   {
+      size_t length = from->u.string.length;
+
+      if (length == path->u.string.length
+            && !memcmp (from->u.string.ptr, path->u.string.ptr, length))
+      {
+         return patch_get (state, from->u.string.ptr, length) != 0;
+      }
+
+      if (length < path->u.string.length && path->u.string.ptr [length] == '/'
+            && !memcmp (from->u.string.ptr, path->u.string.ptr, length))
+      {
+         return patch_error (state, "Cannot move a value into itself");
+      }
+
+      return (value = patch_take (state, from->u.string.ptr, length))
+         && patch_add (state, path->u.string.ptr, path->u.string.length, value);
+   }
+
+   if (!strcmp (name, "copy"))
+   {
+      const json_value * src;
+
+      if (! (src = patch_get (state, from->u.string.ptr, from->u.string.length)))
+         return 0;
+
+      if (! (value = patch_copy (state, src)))
+         return patch_no_memory (state);
+
+      if (!patch_push (state, &state->created, &state->created_count,
+                       &state->created_size, value))
+      {
+         json_value_free_ex (&state->settings, value);
+         return 0;
+      }
+
+      return patch_add (state, path->u.string.ptr, path->u.string.length, value);
+   }
+
+   if (!strcmp (name, "test"))
+   {
+      const json_value * expected = patch_field (op, "value");
+
+      if (!expected)
+         return patch_error (state, "Missing \"value\"");
+
+      if (! (value = patch_get (state, path->u.string.ptr, path->u.string.length)))
+         return 0;
+
+      switch (patch_equal (value, expected))
+      {
+         case -1:
+            return patch_no_memory (state);
+
+         case 0:
+            return patch_error (state, "Test failed: %s", path->u.string.ptr);
+
+         default:
+            return 1;
+      };
+   }
+
+   return patch_error (state, "Unknown op: %s", name);
+}
+
+static void patch_rollback (patch_state * state)
+{
+   size_t i;
+   unsigned int j;
+
+   for (i = state->container_count; i-- > 0; )
+   {
+      patch_container * container = &state->containers [i];
+      json_value * value = container->value;
+
+      if (container->copied)
+      {
+         if (value->type == json_array)
+            patch_free (state, value->u.array.values);
+         else
+            patch_free (state, value->u.object.values);
+      }
+
+      if (value->type == json_array)
+      {
+         value->u.array.values = (json_value **) container->original;
+         value->u.array.length = container->length;
+
+         for (j = 0; j < container->length; ++ j)
+            value->u.array.values [j]->parent = value;
+      }
+      else
+      {
+         value->u.object.values = (json_object_entry *) container->original;
+         value->u.object.length = container->length;
+
+         for (j = 0; j < container->length; ++ j)
+            value->u.object.values [j].value->parent = value;
+      }
+   }
+
+   for (i = 0; i < state->created_count; ++ i)
+      json_value_free_ex (&state->settings, state->created [i]);
+}
+
+static void patch_commit (patch_state * state)
+{
+   size_t i;
+
+   for (i = 0; i < state->container_count; ++ i)
+   {
+      if (state->containers [i].copied)
+         patch_free (state, state->containers [i].original);
+   }
+
+   for (i = 0; i < state->dropped_count; ++ i)
+      json_value_free_ex (&state->settings, state->dropped [i]);
+}
+
+int json_patch_apply_ex (json_settings * settings, json_value ** doc,
+                         const json_value * patch, char * error)
+{
+   json_value * image = 0, * thawed = 0;
+   patch_state state;
+   unsigned int i;
+   int ok = 1;
+
+   memset (&state, 0, sizeof (state));
+   state.settings = *settings;
+   state.error = error;
+   state.root = *doc;
+
+   if (!state.settings.mem_alloc)
+      state.settings.mem_alloc = default_alloc;
+
+   if (!state.settings.mem_free)
+      state.settings.mem_free = default_free;
+
+   if (patch->type != json_array)
+      return patch_error (&state, "Patch is not an array");
+
+   /* images are read-only: the patch edits a copy of the tree */
+   if (is_image_root (*doc))
+   {
+      if (! (thawed = state.root = patch_copy (&state, *doc)))
+         return patch_no_memory (&state);
+
+      image = *doc;
+   }
+
+   state.cache_nodes [0] = state.root;
+
+   for (i = 0; i < patch->u.array.length && ok; ++ i)
+   {
+      state.op = i;
+      ok = patch_op (&state, patch->u.array.values [i]);
+   }
+
+   if (ok)
+   {
+      patch_commit (&state);
+
+      if (image)
+         json_value_free_ex (&state.settings, image);
+
+      *doc = state.root;
+   }
+   else
+   {
+      patch_rollback (&state);
+
+      if (thawed)
+         json_value_free_ex (&state.settings, thawed);
+   }
+
+   free (state.containers);
+   free (state.slots);
+   free (state.created);
+   free (state.dropped);
+   free (state.token);
+
+   return ok;
+}
+
+int json_patch_apply (json_value ** doc, const json_value * patch, char * error)
+{
+   json_settings settings = { 0 };
+   return json_patch_apply_ex (&settings, doc, patch, error);
+}
+
+/* Patch log stores.
+ *
+ * The document lives in its base file, untouched between compactions, and
+ * every edit is appended to <file>.log as one record: the compact text of
+ * the patch, its length and its XXH64.  The log starts with the size and
+ * hash of the base it applies to.  Opening replays the log; a torn record
+ * at its end (a crash while appending) is cut off.
+ *
+ * Compaction prints the document into memory and starts <file>.log.next
+ * for the new base; until the new base has replaced the old one, records
+ * go to both logs.  A crash at any point leaves either the old base and its
+ * full log, or the new base and a .log.next that matches it.
+ */
+
+#define STORE_LOG_MAGIC    "JLLP"
+#define STORE_LOG_VERSION  1
+
+#define STORE_SYNC_BATCH         64
+#define STORE_COMPACT_MIN_LOG    (1 << 20)
+
+typedef struct
+{
+   char magic [4];
+   uint32_t version;
+
+   uint64_t base_size;
+   uint64_t base_hash;
+
+} store_log_header;
+
+typedef struct
+{
+   uint64_t length;
+   uint64_t hash;
+
+} store_record;
+
+typedef struct
+{
+   char * buf;
+   size_t length, size;
+   int failed;
+
+} store_text;
+
+#ifdef JSON_HAVE_MMAP
+
+struct _json_store
+{
+   char filename [FILENAME_SIZE];
+   char log_name [FILENAME_SIZE + 8];
+   char next_name [FILENAME_SIZE + 8];
+
+   json_value * root;
+
+   int log_fd;
+   uint64_t base_size, log_size;
+   unsigned int unsynced;
+   int failed, pending;
+
+   /* while a compaction runs */
+   int next_fd;
+   uint64_t compact_log_start;
+   store_text base;
+   int compact_result, compact_done;
+
+   #ifdef JSON_HAVE_THREADS
+      pthread_t compactor;
+   #endif
+};
+
+static uint64_t store_hash (const void * data, size_t length)
+{
+   return dedupe_hash_bytes (data, length);
+}
+
+static int store_text_append (void * userdata, const char * data, uint32_t length)
+{
+   store_text * text = (store_text * ) userdata;
+
+   if (!diff_grow ((void **) &text->buf, &text->size, text->length + length, 1))
+   {
+      text->failed = 1;
+      return 1;
+   }
+
+   memcpy (text->buf + text->length, data, length);
+   text->length += length;
+
+   return 0;
+}
+
+static int store_text_event (void * userdata, int type, const char * data, uint32_t length)
+{
+   return json_print_raw ((json_printer *) userdata, type, data, length);
+}
+
+/* the compact text of value; 0 when out of memory */
+static int store_print (const json_value * value, store_text * text)
+{
+   json_printer printer;
+   int ret;
+
+   memset (text, 0, sizeof (*text));
+
+   json_print_init (&printer, store_text_append, text);
+   ret = json_value_emit (value, store_text_event, &printer);
+   ret = json_print_free (&printer) || ret;
+
+   if (ret || text->failed)
+   {
+      free (text->buf);
+      return 0;
+   }
+
+   return 1;
+}
+
+static int store_write (int fd, const void * data, size_t length)
+{
+   const char * p = (const char *) data;
+   ssize_t written;
+
+   while (length > 0)
+   {
+      if ((written = write (fd, p, length)) < 0)
+      {
+         if (errno == EINTR)
+            continue;
+
+         return errno;
+      }
+
+      p += written;
+      length -= (size_t) written;
+   }
+
+   return 0;
+}
+
+/* makes the renames in the directory of filename durable */
+static void store_sync_dir (const char * filename)
+{
+   char dir [FILENAME_SIZE];
+   const char * slash = strrchr (filename, '/');
+   int fd;
+
+   if (!slash)
+      strcpy (dir, ".");
+   else
+      snprintf (dir, sizeof (dir), "%.*s", (int) (slash - filename + 1), filename);
+
+   if ((fd = open (dir, O_RDONLY)) != -1)
+   {
+      fsync (fd);
+      close (fd);
+   }
+}
+
+/* a new, synced log for the base of that size and hash */
+static int store_log_create (const char * name, uint64_t base_size, uint64_t base_hash)
+{
+   store_log_header header;
+   int fd, err;
+
+   if ((fd = open (name, O_CREAT | O_TRUNC | O_WRONLY | O_APPEND, 0644)) == -1)
+      return -1;
+
+   memset (&header, 0, sizeof (header));
+   memcpy (header.magic, STORE_LOG_MAGIC, 4);
+   header.version = STORE_LOG_VERSION;
+   header.base_size = base_size;
+   header.base_hash = base_hash;
+
+   if ((err = store_write (fd, &header, sizeof (header))) || fsync (fd) != 0)
+   {
+      err = err ? err : errno;
+      close (fd);
+      errno = err;
+      return -1;
+   }
+
+   return fd;
+}
+
+/* reads the log written for that base into *log.  returns 0, ENOENT when
+ * there is none or it ends inside its header (it holds no edits), EINVAL
+ * when it was written for another base, or an errno value
+ */
+static int store_log_read (const char * name, uint64_t base_size,
+                           uint64_t base_hash, char ** log, size_t * length)
+{
+   store_log_header header;
+
+   errno = 0;
+
+   if (! (*log = read_whole_file (name, length)))
+      return errno ? errno : EIO;
+
+   if (*length < sizeof (header))
+   {
+      free (*log);
+      *log = 0;
+      return ENOENT;
+   }
+
+   memcpy (&header, *log, sizeof (header));
+
+   if (memcmp (header.magic, STORE_LOG_MAGIC, 4)
+         || header.version != STORE_LOG_VERSION
+         || header.base_size != base_size || header.base_hash != base_hash)
+   {
+      free (*log);
+      *log = 0;
+      return EINVAL;
+   }
+
+   return 0;
+}
+
+/* applies the records of log in order; returns where the valid records end */
+static size_t store_replay (json_store * store, const char * log, size_t length,
+                            char * error)
+{
+   size_t offset = sizeof (store_log_header);
+   store_record record;
+   json_value * patch;
+   int ok;
+
+   while (length - offset >= sizeof (record))
+   {
+      memcpy (&record, log + offset, sizeof (record));
+
+      if (record.length > length - offset - sizeof (record)
+            || store_hash (log + offset + sizeof (record), (size_t) record.length)
+                  != record.hash)
+      {
+         break;
+      }
+
+      if (! (patch = json_parse (log + offset + sizeof (record), (size_t) record.length)))
+      {
+         if (error)
+            strcpy (error, "Unreadable patch in the log");
+
+         return 0;
+      }
+
+      ok = json_patch_apply (&store->root, patch, error);
+      json_value_free (patch);
+
+      if (!ok)
+         return 0;
+
+      offset += sizeof (record) + (size_t) record.length;
+   }
+
+   return offset;
+}
+
+json_store * json_store_open (const char * filename, char * error)
+{
+   json_settings settings = { 0 };
+   json_store * store;
+   char * text, * log = 0;
+   size_t length, log_length = 0, valid;
+   uint64_t hash;
+   int err;
+
+   if (strlen (filename) >= FILENAME_SIZE)
+   {
+      if (error)
+         strcpy (error, "File name too long");
+
+      return 0;
+   }
+
+   if (! (store = (json_store *) calloc (1, sizeof (json_store))))
+   {
+      if (error)
+         strcpy (error, "Memory allocation failure");
+
+      return 0;
+   }
+
+   strcpy (store->filename, filename);
+   snprintf (store->log_name, sizeof (store->log_name), "%s.log", filename);
+   snprintf (store->next_name, sizeof (store->next_name), "%s.log.next", filename);
+   store->log_fd = store->next_fd = -1;
+
+   if (! (text = read_whole_file (filename, &length)))
+   {
+      if (error)
+         snprintf (error, json_error_max, "Cannot read %.100s", filename);
+
+      free (store);
+      return 0;
+   }
+
+   hash = store_hash (text, length);
+   store->root = json_parse_ex (&settings, text, length, error);
+   store->base_size = length;
+   free (text);
+
+   if (!store->root)
+   {
+      free (store);
+      return 0;
+   }
+
+   /* a compaction that got as far as replacing the base left its log here */
+   if (! (err = store_log_read (store->next_name, length, hash, &log, &log_length)))
+   {
+      if (rename (store->next_name, store->log_name) != 0)
+      {
+         if (error)
+            snprintf (error, json_error_max, "Cannot rename %.100s", store->next_name);
+
+         free (log);
+         json_store_close (store);
+         return 0;
+      }
+
+      store_sync_dir (filename);
+   }
+   else
+   {
+      /* empty, or for a base that never replaced this one */
+      if (err == ENOENT || err == EINVAL)
+         remove (store->next_name);
+
+      if ((err = store_log_read (store->log_name, length, hash, &log, &log_length))
+            && err != ENOENT)
+      {
+         /* its edits are not in this file: leave them for whoever edited it */
+         if (error && err == EINVAL)
+            snprintf (error, json_error_max, "%.100s is for another version",
+                      store->log_name);
+         else if (error)
+            snprintf (error, json_error_max, "Cannot read %.100s", store->log_name);
+
+         json_store_close (store);
+         return 0;
+      }
+   }
+
+   if (log)
+   {
+      valid = store_replay (store, log, log_length, error);
+      free (log);
+
+      if (!valid || (store->log_fd = open (store->log_name, O_WRONLY | O_APPEND)) == -1
+            || (valid < log_length && ftruncate (store->log_fd, (off_t) valid) != 0))
+      {
+         if (valid && error)
+            snprintf (error, json_error_max, "Cannot open %.100s", store->log_name);
+
+         json_store_close (store);
+         return 0;
+      }
+
+      store->log_size = valid;
+   }
+   else
+   {
+      if ((store->log_fd = store_log_create (store->log_name, length, hash)) == -1)
+      {
+         if (error)
+            snprintf (error, json_error_max, "Cannot create %.100s", store->log_name);
+
+         json_store_close (store);
+         return 0;
+      }
+
+      store_sync_dir (filename);
+      store->log_size = sizeof (store_log_header);
+   }
+
+   return store;
+}
+
+const json_value * json_store_root (const json_store * store)
+{
+   return store->root;
+}
+
+/* the writing of the new base, on its own thread when there are threads */
+static void * store_compact_run (void * userdata)
+{
+   json_store * store = (json_store *) userdata;
+   char tmp_file [FILENAME_SIZE + 8];
+   int fd, err;
+
+   snprintf (tmp_file, sizeof (tmp_file), "%s.tmp", store->filename);
+
+   if ((fd = open (tmp_file, O_CREAT | O_TRUNC | O_WRONLY, 0644)) == -1)
+      err = errno;
+   else
+   {
+      if (! (err = store_write (fd, store->base.buf, store->base.length))
+            && fsync (fd) != 0)
+      {
+         err = errno;
+      }
+
+      close (fd);
+
+      if (!err && rename (tmp_file, store->filename) != 0)
+         err = errno;
+
+      if (err)
+         remove (tmp_file);
+      else
+         store_sync_dir (store->filename);
+   }
+
+   store->compact_result = err;
+   json_atomic_store (&store->compact_done, 1);
+
+   return 0;
+}
+
+/* once the new base is in place, its log becomes the log */
+static int store_compact_finish (json_store * store, int wait)
+{
+   int err;
+
+   if (store->next_fd == -1)
+      return 0;
+
+   if (!wait && !json_atomic_load (&store->compact_done))
+      return 0;
+
+   #ifdef JSON_HAVE_THREADS
+      pthread_join (store->compactor, 0);
+   #endif
+
+   if (! (err = store->compact_result))
+   {
+      /* the new base is in place, so its log is the log even when it keeps
+       * the name .log.next: json_store_open renames it then */
+      if (rename (store->next_name, store->log_name) == 0)
+         store_sync_dir (store->filename);
+      else
+         err = errno;
+
+      close (store->log_fd);
+      store->log_fd = store->next_fd;
+      store->next_fd = -1;
+      store->base_size = store->base.length;
+      store->log_size = sizeof (store_log_header) + store->log_size - store->compact_log_start;
+   }
+
+   if (store->next_fd != -1)
+   {
+      /* the old base and its log are still the store */
+      close (store->next_fd);
+      store->next_fd = -1;
+      remove (store->next_name);
+   }
+
+   free (store->base.buf);
+   memset (&store->base, 0, sizeof (store->base));
+
+   return err;
+}
+
+int json_store_compact (json_store * store)
+{
+   uint64_t hash;
+   int err;
+
+   if ((err = store_compact_finish (store, 0)) || store->next_fd != -1)
+      return err;
+
+   if (!store_print (store->root, &store->base))
+      return ENOMEM;
+
+   hash = store_hash (store->base.buf, store->base.length);
+
+   if ((store->next_fd = store_log_create (store->next_name, store->base.length, hash)) == -1)
+   {
+      err = errno;
+      free (store->base.buf);
+      memset (&store->base, 0, sizeof (store->base));
+      return err;
+   }
+
+   store->compact_log_start = store->log_size;
+   store->compact_done = 0;
+
+   #ifdef JSON_HAVE_THREADS
+      if (pthread_create (&store->compactor, 0, store_compact_run, store) == 0)
+         return 0;
+   #endif
+
+   store_compact_run (store);
+   return store_compact_finish (store, 1);
+}
+
+static int store_sync (json_store * store)
+{
+   int err = store_compact_finish (store, 0);
+
+   if (fsync (store->log_fd) != 0 || (store->next_fd != -1 && fsync (store->next_fd) != 0))
+      return errno;
+
+   store->unsynced = 0;
+   return err;
+}
+
+/* holds an error of json_store_patch's own upkeep for the next report */
+static void store_defer (json_store * store, int err)
+{
+   if (err && !store->pending)
+      store->pending = err;
+}
+
+/* the write error that stopped the store, else a held error, else err */
+static int store_report (json_store * store, int err)
+{
+   int pending = store->pending;
+
+   store->pending = 0;
+
+   if (store->failed)
+      return store->failed;
+
+   return pending ? pending : err;
+}
+
+int json_store_sync (json_store * store)
+{
+   return store_report (store, store_sync (store));
+}
+
+int json_store_patch (json_store * store, const json_value * patch, char * error)
+{
+   store_record record;
+   store_text text;
+   int err;
+
+   if (store->failed)
+      return store->failed;
+
+   store_defer (store, store_compact_finish (store, 0));
+
+   if (!store_print (patch, &text))
+      return ENOMEM;
+
+   /* the record goes out in one write, after its header */
+   if (!diff_grow ((void **) &text.buf, &text.size, text.length + sizeof (record), 1))
+   {
+      free (text.buf);
+      return ENOMEM;
+   }
+
+   memmove (text.buf + sizeof (record), text.buf, text.length);
+   record.length = text.length;
+   record.hash = store_hash (text.buf + sizeof (record), text.length);
+   memcpy (text.buf, &record, sizeof (record));
+   text.length += sizeof (record);
+
+   if (!json_patch_apply (&store->root, patch, error))
+   {
+      free (text.buf);
+      return EINVAL;
+   }
+
+   err = store_write (store->log_fd, text.buf, text.length);
+
+   if (!err && store->next_fd != -1)
+      err = store_write (store->next_fd, text.buf, text.length);
+
+   free (text.buf);
+
+   if (err)
+   {
+      /* the edit is in memory only, so the store takes no more.  a torn
+       * record left at the end fails its hash, and replay stops there */
+      if (ftruncate (store->log_fd, (off_t) store->log_size) != 0)
+         store_defer (store, errno);
+
+      if (store->next_fd != -1 && ftruncate (store->next_fd, (off_t)
+            (sizeof (store_log_header) + store->log_size - store->compact_log_start)) != 0)
+      {
+         store_defer (store, errno);
+      }
+
+      store->failed = err;
+      return err;
+   }
+
+   store->log_size += text.length;
+
+   /* the edit is applied and logged: what fails from here on is reported by
+    * the next json_store_sync or json_store_close */
+   if (++ store->unsynced >= STORE_SYNC_BATCH)
+      store_defer (store, store_sync (store));
+
+   if (store->next_fd == -1 && store->log_size > store->base_size
+         && store->log_size > STORE_COMPACT_MIN_LOG)
+   {
+      store_defer (store, json_store_compact (store));
+   }
+
+   return 0;
+}
+
+int json_store_close (json_store * store)
+{
+   int err = 0;
+
+   if (!store)
+      return 0;
+
+   if (store->next_fd != -1)
+      err = store_compact_finish (store, 1);
+
+   if (store->log_fd != -1)
+   {
+      if (fsync (store->log_fd) != 0 && !err)
+         err = errno;
+
+      close (store->log_fd);
+   }
+
+   err = store_report (store, err);
+
+   json_value_free (store->root);
+   free (store);
+
+   return err;
+}
+
+#else
+
+struct _json_store
+{
+   int unused;
+};
+
+json_store * json_store_open (const char * filename, char * error)
+{
+   (void) filename;
+
+   if (error)
+      strcpy (error, "Patch log stores need POSIX file I/O");
+
+   return 0;
+}
+
+const json_value * json_store_root (const json_store * store)
+{
+   (void) store;
+   return 0;
+}
+
+int json_store_patch (json_store * store, const json_value * patch, char * error)
+{
+   (void) store;
+   (void) patch;
+   (void) error;
+   return ENOSYS;
+}
+
+int json_store_sync (json_store * store)
+{
+   (void) store;
+   return ENOSYS;
+}
+
+int json_store_compact (json_store * store)
+{
+   (void) store;
+   return ENOSYS;
+}
+
+int json_store_close (json_store * store)
+{
+   (void) store;
+   return 0;
+}
+
+#endif
+
+ void print_depth_shift(int depth)
+{
+        int j;
+        for (j=0; j < depth; j++) {
+                printf(" ");
+        }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+void process_value(json_value* value, int depth);
+
+ void process_object(json_value* value, int depth)
+{
+        int length, x;
+        if (value == NULL) {
+                return;
+        }
+        length = value->u.object.length;
+        for (x = 0; x < length; x++) {
+                print_depth_shift(depth);
+                printf("object[%d].name = %s\n", x, value->u.object.values[x].name);
+                process_value(value->u.object.values[x].value, depth+1);
+                
+        }
+}
+
+ void process_array(json_value* value, int depth)
+{
+        int length, x;
+        if (value == NULL) {
+                return;
+        }
+        length = value->u.array.length;
+        printf("array\n");
+        for (x = 0; x < length; x++) {
+                process_value(value->u.array.values[x], depth);
+        }
+}
+
+ void process_value(json_value* value, int depth)
+{
+
+
+        if (value == NULL) {
+                return;
+        }
+        if (value->type != json_object) {
+                print_depth_shift(depth);
+        }
+        switch (value->type) {
+                case json_none:
+                        printf("none\n");
+                        
+                        break;
+                case json_null:
+                        printf("null\n");
+                                                
+                        break;
+                case json_object:
+                        process_object(value, depth+1);
+                                                
+                        break;
+                case json_array:
+                        process_array(value, depth+1);
+                                                
+                        break;
+                case json_integer:
+                        printf("int: %10ld\n", (long)value->u.integer);
+                                                
+                        break;
+                case json_double:
+                        printf("double: %f\n", value->u.dbl);
+                                                
+                        break;
+                case json_string:
+                        printf("string: %s\n", value->u.string.ptr);
+                                                
+                        break;
+                case json_boolean:
+                        printf("bool: %d\n", value->u.boolean);
+                                                
+                        break;
+        }
+
+}
+
+void getter(json_value* value)
+{
+int depth=0;
+            int length,j;
+      
+        length = value->u.object.length;
+       
+        do {
+        printf("give object index : ");
+        scanf("%d", &j);}while(j>length);
+        
+        
+              
+                printf("\n");
+                print_depth_shift(depth);
+                printf("depth %d\n",depth);
+                printf("key of object[%d] : %s\n", j, value->u.object.values[j].name);
+                printf("value is ");
+                process_value(value->u.object.values[j].value, depth);
+                printf("\n");
+}
+
+void get_key(json_value* value)
+{
+int depth=0;
+            int length,j;
+      
+        length = value->u.object.length;
+       
+        do {
+        printf("give object index : ");
+        scanf("%d", &j);}while(j>length);
+        
+        
+              
+                printf("\n");
+                print_depth_shift(depth);
+                printf("key of object[%d] : %s\n", j, value->u.object.values[j].name);
+                printf("\n");
+}
+
+void get_value(json_value* value)
+{
+int depth=0;
+            int length,j;
+      
+        length = value->u.object.length;
+       
+        do {
+        printf("give object index : ");
+        scanf("%d", &j);}while(j>length);
+        
+        
+              
+                printf("\n");
+                print_depth_shift(depth);
+                printf("value of object[%d] : ", j);
+                process_value(value->u.object.values[j].value, depth+1);
+                printf("\n");
+}
+
+
+
+int setter(int argc, char **argv)
 {
 
 
@@ -1516,6 +7485,26 @@ static char const *character_escape[] = {
 	"\\u00f8", "\\u00f9", "\\u00fa", "\\u00fb", "\\u00fc", "\\u00fd", "\\u00fe", "\\u00ff", /* f8-ff */
 };
 
+/* strlen of each character_escape entry */
+static const uint8_t character_escape_length[256] = {
+/* 00 */ 6, 6, 6, 6, 6, 6, 6, 6, 2, 2, 2, 6, 2, 2, 6, 6,
+/* 10 */ 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
+/* 20 */ 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+/* 30 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+/* 40 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+/* 50 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 1, 1, 1,
+/* 60 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+/* 70 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 6,
+/* 80 */ 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
+/* 90 */ 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
+/* a0 */ 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
+/* b0 */ 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
+/* c0 */ 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
+/* d0 */ 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
+/* e0 */ 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
+/* f0 */ 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
+};
+
 /* define all states and actions that will be taken on each transition.
  *
  * states are defined first because of the fact they are use as index in the
@@ -1577,6 +7566,14 @@ enum actions {
 #define NR_CLASSES	(C_HASH + 1)
 
 #define IS_STATE_ACTION(s) ((s) & 0x80)
+/* state_transition_table and buffer_policy_table are the readable source
+ * of the fused state_table the parser runs on. after changing them,
+ * regenerate state_table with:
+ *   gcc -DJSON_GENERATE_TABLES -o gentables json.c -lm -lpthread
+ *   ./gentables
+ * and replace the block between the GENERATED markers with its output.
+ * builds with TRACING_ENABLE check that both stay in sync. */
+#if defined(JSON_GENERATE_TABLES) || defined(TRACING_ENABLE)
 #define S(x) STATE_##x
 #define PT_(a,b,c,d,e,f,g,h,i,j,k,l,m,n,o,p,q,r,s,t,u,v,w,x,y,z,a1,b1,c1,d1,e1,f1,g1,h1)	\
 	{ S(a),S(b),S(c),S(d),S(e),S(f),S(g),S(h),S(i),S(j),S(k),S(l),S(m),S(n),		\
@@ -1678,8 +7675,188 @@ static const uint8_t buffer_policy_table[NR_STATES][NR_CLASSES] = {
 /*D1*/ { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 },
 /*D2*/ { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 },
 };
+#endif
+
+/* fused transition: next state (or action, or STATE___) in the low byte,
+ * buffer policy in the high byte */
+#define F(x, policy) ((uint16_t) (STATE_##x | (policy) << 8))
+#define STATE_NEXT(entry)   ((entry) & 0xff)
+#define STATE_POLICY(entry) ((entry) >> 8)
+
+/* BEGIN GENERATED TABLES */
+static const uint16_t state_table[NR_STATES][NR_CLASSES] = {
+/*GO*/ { F(GO,0), F(GO,0), F(GO,0), F(OB,0), F(__,0), F(AB,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(CB,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(YB,0) },
+/*OK*/ { F(OK,0), F(OK,0), F(OK,0), F(__,0), F(OE,0), F(__,0), F(AE,0), F(__,0), F(SP,0), F(__,0), F(__,0), F(CB,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(YB,0) },
+/*_O*/ { F(_O,0), F(_O,0), F(_O,0), F(__,0), F(OE,0), F(__,0), F(__,0), F(__,0), F(__,0), F(_S,0), F(__,0), F(CB,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(YB,0) },
+/*_K*/ { F(_K,0), F(_K,0), F(_K,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(_S,0), F(__,0), F(CB,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(YB,0) },
+/*CO*/ { F(CO,0), F(CO,0), F(CO,0), F(__,0), F(__,0), F(__,0), F(__,0), F(KS,0), F(__,0), F(__,0), F(__,0), F(CB,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(YB,0) },
+/*_V*/ { F(_V,0), F(_V,0), F(_V,0), F(OB,0), F(__,0), F(AB,0), F(__,0), F(__,0), F(__,0), F(_S,0), F(__,0), F(CB,0),
+        F(__,0), F(MX,1), F(__,0), F(ZX,1), F(IX,1), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(F1,0), F(__,0),
+        F(N1,0), F(__,0), F(__,0), F(T1,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(YB,0) },
+/*_A*/ { F(_A,0), F(_A,0), F(_A,0), F(OB,0), F(__,0), F(AB,0), F(AE,0), F(__,0), F(__,0), F(_S,0), F(__,0), F(CB,0),
+        F(__,0), F(MX,1), F(__,0), F(ZX,1), F(IX,1), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(F1,0), F(__,0),
+        F(N1,0), F(__,0), F(__,0), F(T1,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(YB,0) },
+/*_S*/ { F(_S,1), F(__,0), F(__,0), F(_S,1), F(_S,1), F(_S,1), F(_S,1), F(_S,1), F(_S,1), F(SE,0), F(E0,0), F(_S,1),
+        F(_S,1), F(_S,1), F(_S,1), F(_S,1), F(_S,1), F(_S,1), F(_S,1), F(_S,1), F(_S,1), F(_S,1), F(_S,1), F(_S,1),
+        F(_S,1), F(_S,1), F(_S,1), F(_S,1), F(_S,1), F(_S,1), F(_S,1), F(_S,1), F(_S,1), F(_S,1) },
+/*E0*/ { F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(_S,2), F(_S,2), F(_S,2),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(_S,2), F(__,0), F(__,0), F(__,0), F(_S,2), F(__,0),
+        F(_S,2), F(_S,2), F(__,0), F(_S,2), F(U1,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0) },
+/*U1*/ { F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(U2,1), F(U2,1), F(U2,1), F(U2,1), F(U2,1), F(U2,1), F(U2,1), F(U2,1), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(U2,1), F(U2,1), F(__,0), F(__,0), F(__,0) },
+/*U2*/ { F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(U3,1), F(U3,1), F(U3,1), F(U3,1), F(U3,1), F(U3,1), F(U3,1), F(U3,1), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(U3,1), F(U3,1), F(__,0), F(__,0), F(__,0) },
+/*U3*/ { F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(U4,1), F(U4,1), F(U4,1), F(U4,1), F(U4,1), F(U4,1), F(U4,1), F(U4,1), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(U4,1), F(U4,1), F(__,0), F(__,0), F(__,0) },
+/*U4*/ { F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(UC,1), F(UC,1), F(UC,1), F(UC,1), F(UC,1), F(UC,1), F(UC,1), F(UC,1), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(UC,1), F(UC,1), F(__,0), F(__,0), F(__,0) },
+/*M0*/ { F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(Z0,1), F(I0,1), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0) },
+/*Z0*/ { F(OK,0), F(OK,0), F(OK,0), F(__,0), F(OE,0), F(__,0), F(AE,0), F(__,0), F(SP,0), F(__,0), F(__,0), F(CB,0),
+        F(__,0), F(__,0), F(DF,1), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(YB,0) },
+/*I0*/ { F(OK,0), F(OK,0), F(OK,0), F(__,0), F(OE,0), F(__,0), F(AE,0), F(__,0), F(SP,0), F(__,0), F(__,0), F(CB,0),
+        F(__,0), F(__,0), F(DF,1), F(I0,1), F(I0,1), F(__,0), F(__,0), F(__,0), F(__,0), F(DE,1), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(DE,1), F(__,0), F(__,0), F(YB,0) },
+/*R1*/ { F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(R2,1), F(R2,1), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0) },
+/*R2*/ { F(OK,0), F(OK,0), F(OK,0), F(__,0), F(OE,0), F(__,0), F(AE,0), F(__,0), F(SP,0), F(__,0), F(__,0), F(CB,0),
+        F(__,0), F(__,0), F(__,0), F(R2,1), F(R2,1), F(__,0), F(__,0), F(__,0), F(__,0), F(X1,1), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(X1,1), F(__,0), F(__,0), F(YB,0) },
+/*X1*/ { F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0),
+        F(X2,1), F(X2,1), F(__,0), F(X3,1), F(X3,1), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0) },
+/*X2*/ { F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(X3,1), F(X3,1), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0) },
+/*X3*/ { F(OK,0), F(OK,0), F(OK,0), F(__,0), F(OE,0), F(__,0), F(AE,0), F(__,0), F(SP,0), F(__,0), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(X3,1), F(X3,1), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0) },
+/*T1*/ { F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0),
+        F(__,0), F(T2,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0) },
+/*T2*/ { F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(T3,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0) },
+/*T3*/ { F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(TR,0), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0) },
+/*F1*/ { F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(F2,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0) },
+/*F2*/ { F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(F3,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0) },
+/*F3*/ { F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(F4,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0) },
+/*F4*/ { F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(FA,0), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0) },
+/*N1*/ { F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(N2,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0) },
+/*N2*/ { F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(N3,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0) },
+/*N3*/ { F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(NU,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0) },
+/*C1*/ { F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(C2,0), F(__,0) },
+/*C2*/ { F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C2,0),
+        F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C2,0),
+        F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C3,0), F(C2,0) },
+/*C3*/ { F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(CE,0),
+        F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C2,0),
+        F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C2,0), F(C3,0), F(C2,0) },
+/*Y1*/ { F(Y1,0), F(CE,0), F(Y1,0), F(Y1,0), F(Y1,0), F(Y1,0), F(Y1,0), F(Y1,0), F(Y1,0), F(Y1,0), F(Y1,0), F(Y1,0),
+        F(Y1,0), F(Y1,0), F(Y1,0), F(Y1,0), F(Y1,0), F(Y1,0), F(Y1,0), F(Y1,0), F(Y1,0), F(Y1,0), F(Y1,0), F(Y1,0),
+        F(Y1,0), F(Y1,0), F(Y1,0), F(Y1,0), F(Y1,0), F(Y1,0), F(Y1,0), F(Y1,0), F(Y1,0), F(Y1,0) },
+/*D1*/ { F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(D2,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0) },
+/*D2*/ { F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0),
+        F(__,0), F(__,0), F(__,0), F(__,0), F(U1,0), F(__,0), F(__,0), F(__,0), F(__,0), F(__,0) },
+};
+/* END GENERATED TABLES */
+#undef F
+
+#if defined(JSON_GENERATE_TABLES) || defined(TRACING_ENABLE)
+static const char *state_names[] = {
+	"GO", "OK", "_O", "_K", "CO", "_V", "_A", "_S", "E0",
+	"U1", "U2", "U3", "U4", "M0", "Z0", "I0", "R1", "R2", "X1", "X2", "X3",
+	"T1", "T2", "T3", "F1", "F2", "F3", "F4", "N1", "N2", "N3",
+	"C1", "C2", "C3", "Y1", "D1", "D2",
+};
+
+static const char *action_names[] = {
+	"KS", "SP", "AB", "AE", "OB", "OE", "CB", "YB", "CE",
+	"FA", "TR", "NU", "DE", "DF", "SE", "MX", "ZX", "IX", "UC",
+};
+
+/* return the number of entries of state_table out of sync with the
+ * source tables */
+static int state_table_check(void)
+{
+	int state, class, errors = 0;
+
+	for (state = 0; state < NR_STATES; state++)
+		for (class = 0; class < NR_CLASSES; class++)
+			if (state_table[state][class] != (state_transition_table[state][class]
+			                                  | buffer_policy_table[state][class] << 8))
+				errors++;
+	return errors;
+}
+#endif
+
+#ifdef JSON_GENERATE_TABLES
+int main(void)
+{
+	int state, class;
+
+	printf("static const uint16_t state_table[NR_STATES][NR_CLASSES] = {\n");
+	for (state = 0; state < NR_STATES; state++) {
+		printf("/*%s*/ {", state_names[state]);
+		for (class = 0; class < NR_CLASSES; class++) {
+			uint8_t next = state_transition_table[state][class];
+			const char *name = (next == STATE___) ? "__"
+			                 : IS_STATE_ACTION(next) ? action_names[next & ~0x80]
+			                 : state_names[next];
+			if (class && class % 12 == 0)
+				printf("\n       ");
+			printf(" F(%s,%d)%s", name, buffer_policy_table[state][class],
+			       (class == NR_CLASSES - 1) ? "" : ",");
+		}
+		printf(" },\n");
+	}
+	printf("};\n");
+	fprintf(stderr, "%d entries were out of date\n", state_table_check());
+	return 0;
+}
+#endif
 
 #define __ 0xff
+/* number of continuation bytes following a lead byte. overlong leads
+ * (c0, c1) and leads past U+10FFFF (f5-ff) are invalid */
 static const uint8_t utf8_header_table[256] =
 {
 /* 00 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
@@ -1694,30 +7871,10 @@ static const uint8_t utf8_header_table[256] =
 /* 90 */__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,
 /* a0 */__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,
 /* b0 */__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,
-/* c0 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+/* c0 */__,__, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
 /* d0 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
 /* e0 */ 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
-/* f0 */ 3, 3, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5,__,__,
-};
-
-static const uint8_t utf8_continuation_table[256] =
-{
-/*__0 */__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,
-/* 10 */__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,
-/* 20 */__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,
-/* 30 */__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,
-/* 40 */__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,
-/* 50 */__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,
-/* 60 */__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,
-/* 70 */__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,
-/* 80 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-/* 90 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-/* a0 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-/* b0 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-/* c0 */__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,
-/* d0 */__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,
-/* e0 */__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,
-/* f0 */__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,
+/* f0 */ 3, 3, 3, 3, 3,__,__,__,__,__,__,__,__,__,__,__,
 };
 #undef __
 
@@ -1774,6 +7931,19 @@ static int state_pop(json_parser *parser, int mode)
 	return 0;
 }
 
+static const uint8_t hextable[] = {
+	255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+	255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+	255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+	  0,  1,  2,  3,  4,  5,  6,  7,  8,  9,255,255,255,255,255,255,
+	255, 10, 11, 12, 13, 14, 15,255,255,255,255,255,255,255,255,255,
+	255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+	255, 10, 11, 12, 13, 14, 15,255,255,255,255,255,255,255,255,255,
+	255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+};
+
+#define hex(c) (hextable[(uint8_t) c])
+
 static int buffer_grow(json_parser *parser)
 {
 	uint32_t newsize;
@@ -1798,6 +7968,14 @@ static int buffer_push(json_parser *parser, unsigned char c)
 {
 	int ret;
 
+	/* nothing is kept when validating, except the digits of a \uXXXX
+	 * escape which are needed for the surrogate checks */
+	if (parser->config.validate_only) {
+		if (parser->state >= STATE_U1 && parser->state <= STATE_U4)
+			parser->unicode_value = (parser->unicode_value << 4) | hex(c);
+		return 0;
+	}
+
 	if (parser->buffer_offset + 1 >= parser->buffer_size) {
 		ret = buffer_grow(parser);
 		if (ret)
@@ -1807,28 +7985,322 @@ static int buffer_push(json_parser *parser, unsigned char c)
 	return 0;
 }
 
+/* append a whole run, growing the buffer once. on failure nothing is
+ * appended so the caller can retry byte per byte */
+static int buffer_append(json_parser *parser, const char *s, uint32_t length)
+{
+	int ret;
+
+	if (parser->config.validate_only)
+		return 0;
+
+	while (parser->buffer_offset + length >= parser->buffer_size) {
+		ret = buffer_grow(parser);
+		if (ret)
+			return ret;
+	}
+	memcpy(parser->buffer + parser->buffer_offset, s, length);
+	parser->buffer_offset += length;
+	return 0;
+}
+
+/* room kept at the end of the buffer in partial_strings mode: the longest
+ * an escape sequence makes the buffer grow before it is decoded */
+#define PARTIAL_MARGIN 8
+
+/* zero_copy: a token is left in the caller's chunk as long as it is one
+ * contiguous run of plain bytes starting on an empty buffer */
+static int direct_take(json_parser *parser, const char *s, uint32_t length)
+{
+	uint32_t max = parser->config.max_data;
+
+	if (!parser->config.zero_copy || parser->config.validate_only)
+		return 0;
+	/* let the buffered path report the data limit */
+	if (max > 0 && parser->direct_length + length >= max)
+		return 0;
+	/* and cut long strings into parts */
+	if (parser->config.partial_strings && !parser->binary
+	    && parser->direct_length + length + PARTIAL_MARGIN >= parser->buffer_size)
+		return 0;
+
+	if (parser->direct_ptr) {
+		if (parser->direct_ptr + parser->direct_length != s)
+			return 0;
+	} else {
+		if (parser->buffer_offset != 0)
+			return 0;
+		if (parser->state != STATE__S && parser->state != STATE__V && parser->state != STATE__A)
+			return 0;
+		parser->direct_ptr = s;
+	}
+	parser->direct_length += length;
+	return 1;
+}
+
+/* copy the pending zero_copy token into the buffer */
+static int direct_flush(json_parser *parser)
+{
+	const char *s = parser->direct_ptr;
+	uint32_t length = parser->direct_length;
+
+	if (!s)
+		return 0;
+	parser->direct_ptr = NULL;
+	parser->direct_length = 0;
+	return buffer_append(parser, s, length);
+}
+
+/* hand the pending events over to the batch callback */
+static int batch_flush(json_parser *parser)
+{
+	int ret;
+
+	if (parser->batch_count == 0)
+		return 0;
+	ret = (*parser->batch_callback)(parser->userdata, parser->batch,
+	                                parser->batch_count, parser->arena);
+	parser->batch_count = 0;
+	parser->arena_offset = 0;
+	return ret;
+}
+
+static int batch_push(json_parser *parser, int type, const char *data, uint32_t length)
+{
+	json_event *event;
+	int ret;
+
+	if (parser->batch_count == parser->batch_size) {
+		ret = batch_flush(parser);
+		if (ret)
+			return ret;
+	}
+	if (parser->arena_offset + length + 1 > parser->arena_size) {
+		uint32_t newsize = (parser->arena_size) ? parser->arena_size * 2 : LIBJSON_DEFAULT_BUFFER_SIZE;
+		void *ptr;
+
+		while (parser->arena_offset + length + 1 > newsize)
+			newsize *= 2;
+		ptr = parser_realloc(parser, parser->arena, newsize);
+		if (!ptr)
+			return JSON_ERROR_NO_MEMORY;
+		parser->arena = ptr;
+		parser->arena_size = newsize;
+	}
+
+	event = &parser->batch[parser->batch_count++];
+	event->type = type;
+	event->offset = parser->arena_offset;
+	event->length = length;
+	if (length)
+		memcpy(parser->arena + parser->arena_offset, data, length);
+	parser->arena[parser->arena_offset + length] = '\0';
+	parser->arena_offset += length + 1;
+	return 0;
+}
+
+static int reader_take(json_reader *reader, int type, const char *data, uint32_t length);
+
 static int do_callback_withbuf(json_parser *parser, int type)
 {
+	if (parser->config.validate_only)
+		return 0;
+	if (parser->reader) {
+		if (parser->direct_ptr)
+			return reader_take(parser->reader, type, parser->direct_ptr, parser->direct_length);
+		return reader_take(parser->reader, type, parser->buffer, parser->buffer_offset);
+	}
+	if (parser->batch_callback) {
+		if (parser->direct_ptr)
+			return batch_push(parser, type, parser->direct_ptr, parser->direct_length);
+		return batch_push(parser, type, parser->buffer, parser->buffer_offset);
+	}
 	if (!parser->callback)
 		return 0;
+	if (parser->direct_ptr)
+		return (*parser->callback)(parser->userdata, type, parser->direct_ptr, parser->direct_length);
 	parser->buffer[parser->buffer_offset] = '\0';
 	return (*parser->callback)(parser->userdata, type, parser->buffer, parser->buffer_offset);
 }
 
 static int do_callback(json_parser *parser, int type)
 {
+	if (parser->config.validate_only)
+		return 0;
+	if (parser->reader)
+		return reader_take(parser->reader, type, NULL, 0);
+	if (parser->batch_callback)
+		return batch_push(parser, type, NULL, 0);
 	if (!parser->callback)
 		return 0;
 	return (*parser->callback)(parser->userdata, type, NULL, 0);
 }
 
+/* exact powers of ten: a mantissa below 2^53 scaled by one of these is
+ * correctly rounded (Clinger's fast path) */
+static const double number_pow10[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+/* strtod in the C locale, for the numbers the fast path can't round */
+static double number_strtod(const char *s, uint32_t length)
+{
+	char local[64];
+	char *copy = local;
+	double d;
+
+	if (length >= sizeof(local)) {
+		copy = malloc(length + 1);
+		if (!copy)
+			return NAN;
+	}
+	memcpy(copy, s, length);
+	copy[length] = '\0';
+	d = c_strtod(copy, NULL);
+	if (copy != local)
+		free(copy);
+	return d;
+}
+
+/* numbers are converted while they are scanned when someone takes them */
+#define NUMBER_SCAN(parser) ((parser)->number_callback || (parser)->reader)
+
+static inline void number_digit(struct json_number_scan *n, int digit)
+{
+	if (n->in_exponent) {
+		if (n->exponent < 100000)
+			n->exponent = n->exponent * 10 + digit;
+		return;
+	}
+	if (n->digits < 19) {
+		n->mantissa = n->mantissa * 10 + digit;
+		if (n->fraction)
+			n->scale--;
+	} else if (!n->fraction)
+		n->scale++;
+	if (n->mantissa)
+		n->digits++;
+}
+
+/* a run of digits, in the integer part, the fraction or the exponent */
+static void number_digits(json_parser *parser, const char *s, uint32_t length)
+{
+	uint32_t i;
+
+	for (i = 0; i < length; i++)
+		number_digit(&parser->number, s[i] - '0');
+}
+
+/* any other byte of a number, the state machine having accepted it */
+static void number_char(json_parser *parser, unsigned char ch)
+{
+	struct json_number_scan *n = &parser->number;
+
+	switch (ch) {
+	case '-':
+		if (n->in_exponent)
+			n->exponent_negative = 1;
+		else
+			n->negative = 1;
+		break;
+	case '+':
+		break;
+	case '.':
+		n->fraction = 1;
+		break;
+	case 'e': case 'E':
+		n->in_exponent = 1;
+		break;
+	default:
+		number_digit(n, ch - '0');
+		break;
+	}
+}
+
+/* the number scanned so far, whose text is s */
+static void number_finish(json_parser *parser, json_number *number, int type,
+                          const char *s, uint32_t length)
+{
+	struct json_number_scan *n = &parser->number;
+	int scale;
+
+	number->type = type;
+	number->overflow = 0;
+	number->raw = s;
+	number->raw_length = length;
+
+	if (type == JSON_INT) {
+		if (n->digits < 19 || (n->digits == 19 && !n->scale
+		                       && n->mantissa <= (uint64_t) INT64_MAX + n->negative)) {
+			number->i = (n->negative) ? (int64_t) (0 - n->mantissa) : (int64_t) n->mantissa;
+			number->d = (double) number->i;
+		} else {
+			number->overflow = 1;
+			number->i = (n->negative) ? INT64_MIN : INT64_MAX;
+			number->d = number_strtod(s, length);
+		}
+		memset(n, 0, sizeof(*n));
+		return;
+	}
+
+	scale = n->scale + ((n->exponent_negative) ? -n->exponent : n->exponent);
+	if (n->digits <= 19 && n->mantissa <= ((uint64_t) 1 << 53) && scale >= -22 && scale <= 22) {
+		number->d = (scale < 0)
+			? (double) n->mantissa / number_pow10[-scale]
+			: (double) n->mantissa * number_pow10[scale];
+		if (n->negative)
+			number->d = -number->d;
+	} else
+		number->d = number_strtod(s, length);
+	number->overflow = isinf(number->d);
+	if (number->d >= 9223372036854775807.0)
+		number->i = INT64_MAX;
+	else if (number->d <= -9223372036854775808.0)
+		number->i = INT64_MIN;
+	else
+		number->i = (int64_t) number->d;
+	memset(n, 0, sizeof(*n));
+}
+
+/* a number goes the way of the other events: queued with its value for a
+ * reader, after the pending batch for the number callback */
+static int do_number_callback(json_parser *parser, int type)
+{
+	const char *s = (parser->direct_ptr) ? parser->direct_ptr : parser->buffer;
+	uint32_t length = (parser->direct_ptr) ? parser->direct_length : parser->buffer_offset;
+	json_number number;
+	int ret;
+
+	number_finish(parser, &number, type, s, length);
+	if (parser->reader) {
+		ret = reader_take(parser->reader, type, s, length);
+		if (!ret)
+			parser->reader->queue[parser->reader->queue_tail - 1].number = number;
+		return ret;
+	}
+	if (parser->batch_callback) {
+		ret = batch_flush(parser);
+		if (ret)
+			return ret;
+	}
+	return (*parser->number_callback)(parser->userdata, &number);
+}
+
 static int do_buffer(json_parser *parser)
 {
 	int ret = 0;
 
 	switch (parser->type) {
-	case JSON_KEY: case JSON_STRING:
 	case JSON_FLOAT: case JSON_INT:
+		if (NUMBER_SCAN(parser) && !parser->config.validate_only) {
+			ret = do_number_callback(parser, parser->type);
+			if (ret)
+				return ret;
+			break;
+		}
+		/* fall through */
+	case JSON_KEY: case JSON_STRING:
 	case JSON_NULL: case JSON_TRUE: case JSON_FALSE:
 		ret = do_callback_withbuf(parser, parser->type);
 		if (ret)
@@ -1837,23 +8309,15 @@ static int do_buffer(json_parser *parser)
 	default:
 		break;
 	}
+	/* a scalar took the place of a binary string */
+	if (parser->type != JSON_NONE)
+		parser->binary = 0;
 	parser->buffer_offset = 0;
+	parser->direct_ptr = NULL;
+	parser->direct_length = 0;
 	return ret;
 }
 
-static const uint8_t hextable[] = {
-	255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
-	255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
-	255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
-	  0,  1,  2,  3,  4,  5,  6,  7,  8,  9,255,255,255,255,255,255,
-	255, 10, 11, 12, 13, 14, 15,255,255,255,255,255,255,255,255,255,
-	255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
-	255, 10, 11, 12, 13, 14, 15,255,255,255,255,255,255,255,255,255,
-	255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
-};
-
-#define hex(c) (hextable[(uint8_t) c])
-
 /* high surrogate range from d800 to dbff */
 /* low surrogate range dc00 to dfff */
 #define IS_HIGH_SURROGATE(uc) (((uc) & 0xfc00) == 0xd800)
@@ -1866,6 +8330,21 @@ static int decode_unicode_char(json_parser *parser)
 	char *b = parser->buffer;
 	int offset = parser->buffer_offset;
 
+	/* validating: only the surrogate pairing matters */
+	if (parser->config.validate_only) {
+		uval = parser->unicode_value;
+		parser->unicode_value = 0;
+		if (parser->unicode_multi) {
+			if (!IS_LOW_SURROGATE(uval))
+				return JSON_ERROR_UNICODE_MISSING_LOW_SURROGATE;
+			parser->unicode_multi = 0;
+		} else if (IS_LOW_SURROGATE(uval))
+			return JSON_ERROR_UNICODE_UNEXPECTED_LOW_SURROGATE;
+		else if (IS_HIGH_SURROGATE(uval))
+			parser->unicode_multi = uval;
+		return 0;
+	}
+
 	uval = (hex(b[offset - 4]) << 12) | (hex(b[offset - 3]) << 8)
 	     | (hex(b[offset - 2]) << 4) | hex(b[offset - 1]);
 
@@ -1936,32 +8415,263 @@ static int act_uc(json_parser *parser)
 	return 0;
 }
 
-static int act_yb(json_parser *parser)
+static int act_yb(json_parser *parser)
+{
+	if (!parser->config.allow_yaml_comments)
+		return JSON_ERROR_COMMENT_NOT_ALLOWED;
+	parser->save_state = parser->state;
+	return 0;
+}
+
+static int act_cb(json_parser *parser)
+{
+	if (!parser->config.allow_c_comments)
+		return JSON_ERROR_COMMENT_NOT_ALLOWED;
+	parser->save_state = parser->state;
+	return 0;
+}
+
+static int act_ce(json_parser *parser)
+{
+	parser->state = (parser->save_state > STATE__A) ? STATE_OK : parser->save_state;
+	return 0;
+}
+
+/* base64, in the standard alphabet or the url and filename safe one */
+static const char base64_alphabet[2][65] = {
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/",
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_",
+};
+
+/* the decoder takes either alphabet */
+#define __ 0xff
+static const uint8_t base64_value[256] = {
+/* 00 */ __,__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,
+/* 10 */ __,__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,
+/* 20 */ __,__,__,__,__,__,__,__,__,__,__,62,__,62,__,63,
+/* 30 */ 52,53,54,55,56,57,58,59,60,61,__,__,__,__,__,__,
+/* 40 */ __, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9,10,11,12,13,14,
+/* 50 */ 15,16,17,18,19,20,21,22,23,24,25,__,__,__,__,63,
+/* 60 */ __,26,27,28,29,30,31,32,33,34,35,36,37,38,39,40,
+/* 70 */ 41,42,43,44,45,46,47,48,49,50,51,__,__,__,__,__,
+/* 80 */ __,__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,
+/* 90 */ __,__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,
+/* a0 */ __,__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,
+/* b0 */ __,__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,
+/* c0 */ __,__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,
+/* d0 */ __,__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,
+/* e0 */ __,__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,
+/* f0 */ __,__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,
+};
+#undef __
+
+#ifdef JSON_HAVE_SSSE3_DISPATCH
+
+/* 12 bytes to 16 characters per round: the bytes are spread to one 6 bit
+ * group per output byte with two multiplies, then each group is moved to
+ * its character by an offset picked from its range */
+__attribute__((target("ssse3")))
+static uint32_t base64_encode_ssse3(char *out, const char *in, uint32_t length, int url)
+{
+	const __m128i spread = _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+	const __m128i offsets = _mm_setr_epi8(
+		'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		(url ? '-' : '+') - 62, (url ? '_' : '/') - 63, 'A', 0, 0);
+	uint32_t i;
+
+	for (i = 0; i + 16 <= length; i += 12) {
+		__m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (in + i)), spread);
+		__m128i hi = _mm_mulhi_epu16(_mm_and_si128(v, _mm_set1_epi32(0x0fc0fc00)),
+		                             _mm_set1_epi32(0x04000040));
+		__m128i lo = _mm_mullo_epi16(_mm_and_si128(v, _mm_set1_epi32(0x003f03f0)),
+		                             _mm_set1_epi32(0x01000010));
+		__m128i groups = _mm_or_si128(hi, lo);
+		/* 0: a-z, 1-10: 0-9, 11: 62, 12: 63, 13: A-Z */
+		__m128i range = _mm_or_si128(_mm_subs_epu8(groups, _mm_set1_epi8(51)),
+			_mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), groups), _mm_set1_epi8(13)));
+
+		_mm_storeu_si128((__m128i *) (out + i / 3 * 4),
+		                 _mm_add_epi8(groups, _mm_shuffle_epi8(offsets, range)));
+	}
+	return i;
+}
+
+/* 16 characters to 12 bytes per round, up to the first block holding
+ * anything else than base64 characters. the 16 byte store runs 4 bytes
+ * ahead of the output, which 8 more characters in the input make room for */
+__attribute__((target("ssse3")))
+static uint32_t base64_decode_ssse3(char *out, const char *in, uint32_t length)
+{
+	const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	uint32_t i;
+
+	for (i = 0; i + 24 <= length; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (in + i));
+		__m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+		                              _mm_cmpgt_epi8(_mm_set1_epi8('Z' + 1), v));
+		__m128i lower = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('a' - 1)),
+		                              _mm_cmpgt_epi8(_mm_set1_epi8('z' + 1), v));
+		__m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+		                              _mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), v));
+		__m128i c62 = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('+')),
+		                           _mm_cmpeq_epi8(v, _mm_set1_epi8('-')));
+		__m128i c63 = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('/')),
+		                           _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+		__m128i special = _mm_or_si128(c62, c63);
+		__m128i groups;
+
+		if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(upper, lower),
+		                                   _mm_or_si128(digit, special))) != 0xffff)
+			break;
+		groups = _mm_add_epi8(v, _mm_or_si128(_mm_and_si128(upper, _mm_set1_epi8(-'A')),
+			_mm_or_si128(_mm_and_si128(lower, _mm_set1_epi8(26 - 'a')),
+			             _mm_and_si128(digit, _mm_set1_epi8(52 - '0')))));
+		groups = _mm_or_si128(_mm_andnot_si128(special, groups),
+			_mm_or_si128(_mm_and_si128(c62, _mm_set1_epi8(62)), _mm_and_si128(c63, _mm_set1_epi8(63))));
+
+		/* 4 groups of 6 bits to 24 bits, big endian */
+		groups = _mm_maddubs_epi16(groups, _mm_set1_epi32(0x01400140));
+		groups = _mm_madd_epi16(groups, _mm_set1_epi32(0x00011000));
+		_mm_storeu_si128((__m128i *) (out + i / 4 * 3), _mm_shuffle_epi8(groups, pack));
+	}
+	return i;
+}
+
+static int base64_have_ssse3 = -1;
+#endif
+
+/** json_base64_encode writes length bytes of in as base64 to out */
+uint32_t json_base64_encode(char *out, const char *in, uint32_t length, int variant)
+{
+	const unsigned char *u = (const unsigned char *) in;
+	int url = (variant == JSON_BASE64_URL);
+	const char *alphabet = base64_alphabet[url];
+	uint32_t i = 0, o;
+
+#ifdef JSON_HAVE_SSSE3_DISPATCH
+	if (base64_have_ssse3 < 0)
+		base64_have_ssse3 = __builtin_cpu_supports("ssse3") ? 1 : 0;
+	if (base64_have_ssse3)
+		i = base64_encode_ssse3(out, in, length, url);
+#endif
+	for (o = i / 3 * 4; i + 3 <= length; i += 3, o += 4) {
+		uint32_t v = (u[i] << 16) | (u[i + 1] << 8) | u[i + 2];
+		out[o] = alphabet[v >> 18];
+		out[o + 1] = alphabet[(v >> 12) & 0x3f];
+		out[o + 2] = alphabet[(v >> 6) & 0x3f];
+		out[o + 3] = alphabet[v & 0x3f];
+	}
+	if (i < length) {
+		uint32_t v = (u[i] << 16) | ((i + 1 < length) ? u[i + 1] << 8 : 0);
+		out[o++] = alphabet[v >> 18];
+		out[o++] = alphabet[(v >> 12) & 0x3f];
+		if (i + 1 < length)
+			out[o++] = alphabet[(v >> 6) & 0x3f];
+		else if (!url)
+			out[o++] = '=';
+		if (!url)
+			out[o++] = '=';
+	}
+	return o;
+}
+
+/** json_base64_decode writes the bytes of length base64 characters to out */
+int json_base64_decode(char *out, uint32_t *out_length, const char *in, uint32_t length)
 {
-	if (!parser->config.allow_yaml_comments)
-		return JSON_ERROR_COMMENT_NOT_ALLOWED;
-	parser->save_state = parser->state;
+	const unsigned char *u = (const unsigned char *) in;
+	uint32_t i = 0, o, pad = 0, v;
+
+	while (length > 0 && pad < 2 && in[length - 1] == '=') {
+		length--;
+		pad++;
+	}
+	if ((pad && (length + pad) % 4) || length % 4 == 1)
+		return JSON_ERROR_BASE64;
+
+#ifdef JSON_HAVE_SSSE3_DISPATCH
+	if (base64_have_ssse3 < 0)
+		base64_have_ssse3 = __builtin_cpu_supports("ssse3") ? 1 : 0;
+	if (base64_have_ssse3)
+		i = base64_decode_ssse3(out, in, length);
+#endif
+	for (o = i / 4 * 3; i + 4 <= length; i += 4, o += 3) {
+		uint8_t a = base64_value[u[i]], b = base64_value[u[i + 1]];
+		uint8_t c = base64_value[u[i + 2]], d = base64_value[u[i + 3]];
+		if ((a | b | c | d) & 0x80)
+			return JSON_ERROR_BASE64;
+		v = (a << 18) | (b << 12) | (c << 6) | d;
+		out[o] = v >> 16;
+		out[o + 1] = v >> 8;
+		out[o + 2] = v;
+	}
+	if (i < length) {
+		/* 2 or 3 characters left, whose bits past the last byte are 0 */
+		uint8_t a = base64_value[u[i]], b = base64_value[u[i + 1]];
+		uint8_t c = (i + 2 < length) ? base64_value[u[i + 2]] : 0;
+		if ((a | b | c) & 0x80)
+			return JSON_ERROR_BASE64;
+		v = (a << 18) | (b << 12) | (c << 6);
+		if (v & ((i + 2 < length) ? 0xff : 0xffff))
+			return JSON_ERROR_BASE64;
+		out[o++] = v >> 16;
+		if (i + 2 < length)
+			out[o++] = v >> 8;
+	}
+	*out_length = o;
 	return 0;
 }
 
-static int act_cb(json_parser *parser)
+/* JSON_CALLBACK_BINARY: the string is decoded in place, as it only shrinks */
+static int binary_string(json_parser *parser)
 {
-	if (!parser->config.allow_c_comments)
-		return JSON_ERROR_COMMENT_NOT_ALLOWED;
-	parser->save_state = parser->state;
-	return 0;
+	uint32_t length;
+	int ret;
+
+	parser->binary = 0;
+	CHK(direct_flush(parser));
+	CHK(json_base64_decode(parser->buffer, &length, parser->buffer, parser->buffer_offset));
+	parser->buffer_offset = length;
+	return do_callback_withbuf(parser, JSON_BSTRING);
 }
 
-static int act_ce(json_parser *parser)
+/* how far along a skipped value the parser is */
+enum skip_mode {
+	SKIP_NONE,
+	SKIP_VALUE,  /* the value of a key, once its colon is read */
+	SKIP_NESTED, /* inside brackets or a string */
+	SKIP_SCALAR, /* a number or a constant */
+};
+
+#define SKIP_INNER     0x01 /* stop on the bracket closing the structure */
+#define SKIP_STRING    0x02
+#define SKIP_ESCAPE    0x04
+#define SKIP_SLASH     0x08
+#define SKIP_C_COMMENT 0x10
+#define SKIP_STAR      0x20
+#define SKIP_YAML      0x40
+
+/* a callback asking to skip what follows its event, or to have the
+ * string value of a key decoded */
+static int callback_request(json_parser *parser, int ret, int mode)
 {
-	parser->state = (parser->save_state > STATE__A) ? STATE_OK : parser->save_state;
+	if (ret == JSON_CALLBACK_BINARY && mode == SKIP_VALUE) {
+		parser->binary = 1;
+		return 0;
+	}
+	if (ret != JSON_CALLBACK_SKIP)
+		return ret;
+	parser->skip = mode;
+	parser->skip_flags = (mode == SKIP_NESTED) ? SKIP_INNER : 0;
+	parser->skip_depth = (mode == SKIP_NESTED) ? 1 : 0;
 	return 0;
 }
 
 static int act_ob(json_parser *parser)
 {
 	int ret;
-	CHK(do_callback(parser, JSON_OBJECT_BEGIN));
+	parser->binary = 0;
+	CHK(callback_request(parser, do_callback(parser, JSON_OBJECT_BEGIN), SKIP_NESTED));
 	CHK(state_push(parser, MODE_OBJECT));
 	parser->expecting_key = 1;
 	return 0;
@@ -1979,7 +8689,8 @@ static int act_oe(json_parser *parser)
 static int act_ab(json_parser *parser)
 {
 	int ret;
-	CHK(do_callback(parser, JSON_ARRAY_BEGIN));
+	parser->binary = 0;
+	CHK(callback_request(parser, do_callback(parser, JSON_ARRAY_BEGIN), SKIP_NESTED));
 	CHK(state_push(parser, MODE_ARRAY));
 	return 0;
 }
@@ -1995,8 +8706,15 @@ static int act_ae(json_parser *parser)
 static int act_se(json_parser *parser)
 {
 	int ret;
-	CHK(do_callback_withbuf(parser, (parser->expecting_key) ? JSON_KEY : JSON_STRING));
+	if (parser->expecting_key)
+		CHK(callback_request(parser, do_callback_withbuf(parser, JSON_KEY), SKIP_VALUE));
+	else if (parser->binary)
+		CHK(binary_string(parser));
+	else
+		CHK(do_callback_withbuf(parser, JSON_STRING));
 	parser->buffer_offset = 0;
+	parser->direct_ptr = NULL;
+	parser->direct_length = 0;
 	parser->state = (parser->expecting_key) ? STATE_CO : STATE_OK;
 	parser->expecting_key = 0;
 	return 0;
@@ -2014,51 +8732,136 @@ static int act_sp(json_parser *parser)
 	return 0;
 }
 
-struct action_descr
-{
-	int (*call)(json_parser *parser);
-	uint8_t type;
-	uint8_t state; /* 0 if we let the callback set the value it want */
-	uint8_t dobuffer;
-};
+#if defined(__GNUC__) && !defined(__STRICT_ANSI__)
+#define JSON_HAVE_COMPUTED_GOTO
+#endif
 
-static struct action_descr actions_map[] = {
-	{ NULL,   JSON_NONE,  STATE__V, 0 }, /* KS */
-	{ act_sp, JSON_NONE,  0,        1 }, /* SP */
-	{ act_ab, JSON_NONE,  STATE__A, 0 }, /* AB */
-	{ act_ae, JSON_NONE,  STATE_OK, 1 }, /* AE */
-	{ act_ob, JSON_NONE,  STATE__O, 0 }, /* OB */
-	{ act_oe, JSON_NONE,  STATE_OK, 1 }, /* OE */
-	{ act_cb, JSON_NONE,  STATE_C1, 1 }, /* CB */
-	{ act_yb, JSON_NONE,  STATE_Y1, 1 }, /* YB */
-	{ act_ce, JSON_NONE,  0,        0 }, /* CE */
-	{ NULL,   JSON_FALSE, STATE_OK, 0 }, /* FA */
-	{ NULL,   JSON_TRUE,  STATE_OK, 0 }, /* TR */
-	{ NULL,   JSON_NULL,  STATE_OK, 0 }, /* NU */
-	{ NULL,   JSON_FLOAT, STATE_X1, 0 }, /* DE */
-	{ NULL,   JSON_FLOAT, STATE_R1, 0 }, /* DF */
-	{ act_se, JSON_NONE,  0,        0 }, /* SE */
-	{ NULL,   JSON_INT,   STATE_M0, 0 }, /* MX */
-	{ NULL,   JSON_INT,   STATE_Z0, 0 }, /* ZX */
-	{ NULL,   JSON_INT,   STATE_I0, 0 }, /* IX */
-	{ act_uc, JSON_NONE,  0,        0 }, /* UC */
-};
+/* each action is a case of the switch and a label of the computed goto
+ * table, whichever the compiler can do */
+#define ACTION(x) case STATE_##x: action_##x
 
-static int do_action(json_parser *parser, int next_state)
+/* multi_document: once the root value is closed, report it and start over
+ * on the same stack and buffer */
+static int document_end(json_parser *parser)
 {
-	struct action_descr *descr = &actions_map[next_state & ~0x80];
+	int ret;
 
-	if (descr->call) {
-		int ret;
-		if (descr->dobuffer)
-			CHK(do_buffer(parser));
-		CHK((descr->call)(parser));
+	CHK(do_callback(parser, JSON_DOCUMENT_END));
+	parser->state = STATE_GO;
+	parser->expecting_key = 0;
+	parser->unicode_multi = 0;
+	return 0;
+}
+
+static inline int do_action(json_parser *parser, int next_state)
+{
+	int ret;
+#ifdef JSON_HAVE_COMPUTED_GOTO
+	static const void *const actions[] = {
+		&&action_KS, &&action_SP, &&action_AB, &&action_AE, &&action_OB,
+		&&action_OE, &&action_CB, &&action_YB, &&action_CE, &&action_FA,
+		&&action_TR, &&action_NU, &&action_DE, &&action_DF, &&action_SE,
+		&&action_MX, &&action_ZX, &&action_IX, &&action_UC,
+	};
+
+	goto *actions[next_state & ~0x80];
+#endif
+	switch (next_state) {
+	ACTION(KS):
+		parser->state = STATE__V;
+		parser->type = JSON_NONE;
+		return 0;
+	ACTION(SP):
+		CHK(do_buffer(parser));
+		CHK(act_sp(parser));
+		parser->type = JSON_NONE;
+		return 0;
+	ACTION(AB):
+		CHK(act_ab(parser));
+		parser->state = STATE__A;
+		parser->type = JSON_NONE;
+		return 0;
+	ACTION(AE):
+		CHK(do_buffer(parser));
+		CHK(act_ae(parser));
+		parser->state = STATE_OK;
+		parser->type = JSON_NONE;
+		if (parser->stack_offset == 0 && parser->config.multi_document)
+			return document_end(parser);
+		return 0;
+	ACTION(OB):
+		CHK(act_ob(parser));
+		parser->state = STATE__O;
+		parser->type = JSON_NONE;
+		return 0;
+	ACTION(OE):
+		CHK(do_buffer(parser));
+		CHK(act_oe(parser));
+		parser->state = STATE_OK;
+		parser->type = JSON_NONE;
+		if (parser->stack_offset == 0 && parser->config.multi_document)
+			return document_end(parser);
+		return 0;
+	ACTION(CB):
+		CHK(do_buffer(parser));
+		CHK(act_cb(parser));
+		parser->state = STATE_C1;
+		parser->type = JSON_NONE;
+		return 0;
+	ACTION(YB):
+		CHK(do_buffer(parser));
+		CHK(act_yb(parser));
+		parser->state = STATE_Y1;
+		parser->type = JSON_NONE;
+		return 0;
+	ACTION(CE):
+		CHK(act_ce(parser));
+		parser->type = JSON_NONE;
+		return 0;
+	ACTION(FA):
+		parser->state = STATE_OK;
+		parser->type = JSON_FALSE;
+		return 0;
+	ACTION(TR):
+		parser->state = STATE_OK;
+		parser->type = JSON_TRUE;
+		return 0;
+	ACTION(NU):
+		parser->state = STATE_OK;
+		parser->type = JSON_NULL;
+		return 0;
+	ACTION(DE):
+		parser->state = STATE_X1;
+		parser->type = JSON_FLOAT;
+		return 0;
+	ACTION(DF):
+		parser->state = STATE_R1;
+		parser->type = JSON_FLOAT;
+		return 0;
+	ACTION(SE):
+		CHK(act_se(parser));
+		parser->type = JSON_NONE;
+		return 0;
+	ACTION(MX):
+		parser->state = STATE_M0;
+		parser->type = JSON_INT;
+		return 0;
+	ACTION(ZX):
+		parser->state = STATE_Z0;
+		parser->type = JSON_INT;
+		return 0;
+	ACTION(IX):
+		parser->state = STATE_I0;
+		parser->type = JSON_INT;
+		return 0;
+	ACTION(UC):
+		CHK(act_uc(parser));
+		parser->type = JSON_NONE;
+		return 0;
 	}
-	if (descr->state)
-		parser->state = descr->state;
-	parser->type = descr->type;
 	return 0;
 }
+#undef ACTION
 
 /** json_parser_init initialize a parser structure taking a config,
  * a config and its userdata.
@@ -2069,6 +8872,11 @@ int json_parser_init(json_parser *parser, json_config *config,
 {
 	memset(parser, 0, sizeof(*parser));
 
+#ifdef TRACING_ENABLE
+	if (state_table_check())
+		TRACING("state_table is out of sync with its source tables\n");
+#endif
+
 	if (config)
 		memcpy(&parser->config, config, sizeof(json_config));
 	parser->callback = callback;
@@ -2087,10 +8895,16 @@ int json_parser_init(json_parser *parser, json_config *config,
 	if (!parser->stack)
 		return JSON_ERROR_NO_MEMORY;
 
+	/* no parse buffer when only validating */
+	if (parser->config.validate_only)
+		return 0;
+
 	/* initialize the parse buffer */
 	parser->buffer_size = (parser->config.buffer_initial_size > 0)
 		? parser->config.buffer_initial_size
 		: LIBJSON_DEFAULT_BUFFER_SIZE;
+	if (parser->config.partial_strings && parser->buffer_size < LIBJSON_PARTIAL_MIN_BUFFER_SIZE)
+		parser->buffer_size = LIBJSON_PARTIAL_MIN_BUFFER_SIZE;
 
 	if (parser->config.max_data > 0 && parser->buffer_size > parser->config.max_data)
 		parser->buffer_size = parser->config.max_data;
@@ -2110,74 +8924,676 @@ int json_parser_free(json_parser *parser)
 		return 0;
 	free(parser->stack);
 	free(parser->buffer);
+	free(parser->arena);
 	parser->stack = NULL;
 	parser->buffer = NULL;
+	parser->arena = NULL;
+	return 0;
+}
+
+/** json_parser_set_number_callback delivers converted numbers to callback */
+int json_parser_set_number_callback(json_parser *parser, json_parser_number_callback callback)
+{
+	parser->number_callback = callback;
+	return 0;
+}
+
+/** json_parser_set_batch switches the parser to batched events */
+int json_parser_set_batch(json_parser *parser, json_event *events, uint32_t nr_events,
+                          json_parser_batch_callback callback)
+{
+	if (callback && (!events || nr_events == 0))
+		return JSON_ERROR_DATA_LIMIT;
+	parser->batch_callback = callback;
+	parser->batch = events;
+	parser->batch_size = nr_events;
+	parser->batch_count = 0;
 	return 0;
 }
 
 /** json_parser_is_done return 0 is the parser isn't in a finish state. !0 if it is */
 int json_parser_is_done(json_parser *parser)
 {
-	/* need to compare the state to !GO to not accept empty document */
-	return parser->stack_offset == 0 && parser->state != STATE_GO;
+	/* a stream of documents is complete between two of them */
+	if (parser->config.multi_document)
+		return parser->stack_offset == 0 && parser->state == STATE_GO;
+	/* need to compare the state to !GO to not accept empty document */
+	return parser->stack_offset == 0 && parser->state != STATE_GO;
+}
+
+/* utf8 is validated a whole chunk at a time, ahead of the state machine,
+ * which then only has to classify ascii bytes. sequences split across
+ * chunks are carried in utf8_multibyte_left and the bounds of the next
+ * continuation byte. */
+static uint32_t utf8_validate_bytes(json_parser *parser, const unsigned char *s,
+                                    uint32_t i, uint32_t length)
+{
+	for (; i < length; i++) {
+		unsigned char ch = s[i];
+
+		if (parser->utf8_multibyte_left > 0) {
+			if (ch < parser->utf8_next_min || ch > parser->utf8_next_max)
+				return i;
+			parser->utf8_multibyte_left--;
+			parser->utf8_next_min = 0x80;
+			parser->utf8_next_max = 0xbf;
+			continue;
+		}
+		if (ch < 0x80)
+			continue;
+
+		parser->utf8_multibyte_left = utf8_header_table[ch];
+		if (parser->utf8_multibyte_left == 0xff) {
+			parser->utf8_multibyte_left = 0;
+			return i;
+		}
+		/* second byte bounds rejecting overlongs, surrogates and
+		 * values past U+10FFFF */
+		parser->utf8_next_min = (ch == 0xe0) ? 0xa0 : (ch == 0xf0) ? 0x90 : 0x80;
+		parser->utf8_next_max = (ch == 0xed) ? 0x9f : (ch == 0xf4) ? 0x8f : 0xbf;
+	}
+	return length;
+}
+
+#ifdef JSON_HAVE_SSSE3_DISPATCH
+
+/* step back from a position where the bytes before are known to be valid
+ * to the start of the sequence it might be in the middle of */
+static uint32_t utf8_boundary(const unsigned char *s, uint32_t i, uint32_t start)
+{
+	uint32_t k;
+
+	for (k = 1; k <= 3 && k <= i - start; k++) {
+		unsigned char ch = s[i - k];
+		if (ch < 0x80)
+			break;
+		if (ch >= 0xc0)
+			return (utf8_header_table[ch] >= k) ? i - k : i;
+	}
+	return i;
+}
+
+#define U8_TOO_SHORT   (1 << 0)
+#define U8_TOO_LONG    (1 << 1)
+#define U8_OVERLONG_3  (1 << 2)
+#define U8_TOO_LARGE   (1 << 3)
+#define U8_SURROGATE   (1 << 4)
+#define U8_OVERLONG_2  (1 << 5)
+#define U8_TOO_LARGE_1000 (1 << 6)
+#define U8_OVERLONG_4  (1 << 6)
+#define U8_TWO_CONTS   (1 << 7)
+#define U8_CARRY       (U8_TOO_SHORT | U8_TOO_LONG | U8_TWO_CONTS)
+
+/* lookup method: the high nibble of the previous byte, its low nibble and
+ * the high nibble of the current byte each select the set of errors they
+ * allow; any error present in all three sets is real. only the 3rd and 4th
+ * bytes of long sequences need the extra prev2/prev3 check. */
+__attribute__((target("ssse3")))
+static uint32_t utf8_validate_ssse3(const unsigned char *s, uint32_t i, uint32_t length)
+{
+	const __m128i byte_1_high_table = _mm_setr_epi8(
+		U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+		U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+		U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS,
+		U8_TOO_SHORT | U8_OVERLONG_2,
+		U8_TOO_SHORT,
+		U8_TOO_SHORT | U8_OVERLONG_3 | U8_SURROGATE,
+		U8_TOO_SHORT | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_OVERLONG_4);
+	const __m128i byte_1_low_table = _mm_setr_epi8(
+		U8_CARRY | U8_OVERLONG_3 | U8_OVERLONG_2 | U8_OVERLONG_4,
+		U8_CARRY | U8_OVERLONG_2,
+		U8_CARRY,
+		U8_CARRY,
+		U8_CARRY | U8_TOO_LARGE,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_SURROGATE,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000);
+	const __m128i byte_2_high_table = _mm_setr_epi8(
+		U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+		U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+		U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE_1000 | U8_OVERLONG_4,
+		U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE,
+		U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE,
+		U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE,
+		U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT);
+	/* last bytes of a block that still expect continuations */
+	const __m128i incomplete_max = _mm_setr_epi8(
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		0xf0 - 1, 0xe0 - 1, 0xc0 - 1);
+	const __m128i nibble = _mm_set1_epi8(0x0f);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i prev = zero, incomplete = zero;
+	uint32_t start = i;
+
+	for (; i + 16 <= length; i += 16) {
+		__m128i input = _mm_loadu_si128((const __m128i *) (s + i));
+		__m128i error;
+
+		if (!_mm_movemask_epi8(input)) {
+			error = incomplete;
+		} else {
+			__m128i prev1 = _mm_alignr_epi8(input, prev, 15);
+			__m128i prev2 = _mm_alignr_epi8(input, prev, 14);
+			__m128i prev3 = _mm_alignr_epi8(input, prev, 13);
+			__m128i special, must23;
+
+			special = _mm_and_si128(_mm_and_si128(
+				_mm_shuffle_epi8(byte_1_high_table, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+				_mm_shuffle_epi8(byte_1_low_table, _mm_and_si128(prev1, nibble))),
+				_mm_shuffle_epi8(byte_2_high_table, _mm_and_si128(_mm_srli_epi16(input, 4), nibble)));
+			must23 = _mm_or_si128(_mm_subs_epu8(prev2, _mm_set1_epi8(0xe0 - 0x80)),
+			                      _mm_subs_epu8(prev3, _mm_set1_epi8(0xf0 - 0x80)));
+			must23 = _mm_and_si128(must23, _mm_set1_epi8((char) 0x80));
+			error = _mm_xor_si128(must23, special);
+		}
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(error, zero)) != 0xffff)
+			break;
+		incomplete = _mm_subs_epu8(input, incomplete_max);
+		prev = input;
+	}
+	/* everything before i is valid, except maybe a trailing sequence */
+	return utf8_boundary(s, i, start);
+}
+
+static int utf8_have_ssse3 = -1;
+#endif
+
+/* return the offset of the first invalid byte, or length */
+static uint32_t utf8_validate(json_parser *parser, const char *s, uint32_t length)
+{
+	const unsigned char *u = (const unsigned char *) s;
+	uint32_t i = 0;
+
+	/* finish a sequence left over by the previous chunk */
+	if (parser->utf8_multibyte_left > 0) {
+		i = utf8_validate_bytes(parser, u, 0, parser->utf8_multibyte_left < length
+		                                      ? parser->utf8_multibyte_left : length);
+		if (parser->utf8_multibyte_left > 0)
+			return i;
+	}
+
+#ifdef JSON_HAVE_SSSE3_DISPATCH
+	if (utf8_have_ssse3 < 0)
+		utf8_have_ssse3 = __builtin_cpu_supports("ssse3") ? 1 : 0;
+	if (utf8_have_ssse3)
+		i = utf8_validate_ssse3(u, i, length);
+#endif
+#ifdef JSON_HAVE_SSE2
+	/* pure ascii blocks skip the byte loop */
+	while (i < length) {
+		uint32_t end = (i + 16 <= length) ? i + 16 : length;
+
+		if (end - i == 16 && parser->utf8_multibyte_left == 0
+		    && !_mm_movemask_epi8(_mm_loadu_si128((const __m128i *) (u + i)))) {
+			i = end;
+			continue;
+		}
+		i = utf8_validate_bytes(parser, u, i, end);
+		if (i < end)
+			return i;
+	}
+	return length;
+#else
+	return utf8_validate_bytes(parser, u, i, length);
+#endif
+}
+
+/* partial_strings: hand the complete utf8 characters of the buffer over as
+ * a string part and keep the bytes of a character cut in the middle */
+static int string_part_flush(json_parser *parser)
+{
+	uint32_t length = parser->buffer_offset;
+	uint32_t keep = 0, k;
+	char saved;
+	int ret;
+
+	for (k = 1; k <= 3 && k <= length; k++) {
+		unsigned char ch = parser->buffer[length - k];
+		if (ch < 0x80)
+			break;
+		if (ch >= 0xc0) {
+			if (utf8_header_table[ch] >= k)
+				keep = k;
+			break;
+		}
+	}
+	length -= keep;
+
+	saved = parser->buffer[length];
+	parser->buffer_offset = length;
+	ret = do_callback_withbuf(parser, (parser->expecting_key) ? JSON_KEY_PART : JSON_STRING_PART);
+	parser->buffer[length] = saved;
+	if (ret)
+		return ret;
+
+	memmove(parser->buffer, parser->buffer + length, keep);
+	parser->buffer_offset = keep;
+	return 0;
+}
+
+/* partial_strings: append a run of string bytes without growing the buffer */
+static int partial_append(json_parser *parser, const char *s, uint32_t length)
+{
+	uint32_t room;
+	int ret;
+
+	if (parser->config.validate_only)
+		return 0;
+
+	while (length > 0) {
+		if (parser->buffer_offset + PARTIAL_MARGIN >= parser->buffer_size) {
+			CHK(string_part_flush(parser));
+			continue;
+		}
+		room = parser->buffer_size - PARTIAL_MARGIN - parser->buffer_offset;
+		if (room > length)
+			room = length;
+		memcpy(parser->buffer + parser->buffer_offset, s, room);
+		parser->buffer_offset += room;
+		s += room;
+		length -= room;
+	}
+	return 0;
+}
+
+/* append a plain run found by the span scanners */
+static int span_append(json_parser *parser, const char *s, uint32_t length)
+{
+	int ret;
+
+	if (direct_take(parser, s, length))
+		return 0;
+	CHK(direct_flush(parser));
+	if (parser->state == STATE__S && parser->config.partial_strings && !parser->binary)
+		return partial_append(parser, s, length);
+	return buffer_append(parser, s, length);
+}
+
+/* end of the run of plain string bytes starting at i: stops at a quote,
+ * a backslash or a control character */
+static uint32_t string_span(const char *s, uint32_t i, uint32_t length)
+{
+#ifdef JSON_HAVE_SSE2
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i backslash = _mm_set1_epi8('\\');
+	const __m128i control = _mm_set1_epi8(0x1f);
+
+	for (; i + 16 <= length; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+		__m128i stop = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+			_mm_cmpeq_epi8(_mm_max_epu8(v, control), control));
+		int mask = _mm_movemask_epi8(stop);
+		if (mask)
+			return i + mask_ctz(mask);
+	}
+#endif
+	for (; i < length; i++) {
+		unsigned char ch = s[i];
+		if (ch == '"' || ch == '\\' || ch < 0x20)
+			break;
+	}
+	return i;
+}
+
+static uint32_t digit_span(const char *s, uint32_t i, uint32_t length)
+{
+	while (i < length && s[i] >= '0' && s[i] <= '9')
+		i++;
+	return i;
+}
+
+/* the skipped value is over: resume after it, or on the bracket closing
+ * the structure whose content is skipped */
+static uint32_t skip_done(json_parser *parser, uint32_t i)
+{
+	if (!(parser->skip_flags & SKIP_INNER))
+		parser->state = STATE_OK;
+	parser->skip = SKIP_NONE;
+	return i;
+}
+
+/* one byte of a skipped structure or string. returns how many bytes are
+ * consumed and over: 1 for a plain byte, 0 to stop before it */
+static int skip_byte(json_parser *parser, unsigned char ch, int *done)
+{
+	uint8_t flags = parser->skip_flags;
+
+	*done = 0;
+	if (flags & SKIP_STRING) {
+		if (flags & SKIP_ESCAPE)
+			flags &= ~SKIP_ESCAPE;
+		else if (ch == '\\')
+			flags |= SKIP_ESCAPE;
+		else if (ch == '"') {
+			flags &= ~SKIP_STRING;
+			*done = (parser->skip_depth == 0);
+		}
+	} else if (flags & SKIP_YAML) {
+		if (ch == '\n')
+			flags &= ~SKIP_YAML;
+	} else if (flags & (SKIP_C_COMMENT | SKIP_STAR)) {
+		if (ch == '/' && (flags & SKIP_STAR))
+			flags &= ~(SKIP_C_COMMENT | SKIP_STAR);
+		else
+			flags = (ch == '*') ? (flags | SKIP_STAR) : (flags & ~SKIP_STAR);
+	} else if ((flags & SKIP_SLASH) && ch == '*') {
+		flags = (flags & ~SKIP_SLASH) | SKIP_C_COMMENT;
+	} else {
+		flags &= ~SKIP_SLASH;
+		switch (ch) {
+		case '"': flags |= SKIP_STRING; break;
+		case '{': case '[': parser->skip_depth++; break;
+		case '}': case ']':
+			if (parser->skip_depth == 1 && (flags & SKIP_INNER)) {
+				*done = 1;
+				return 0;
+			}
+			*done = (--parser->skip_depth == 0);
+			break;
+		case '/':
+			if (parser->config.allow_c_comments)
+				flags |= SKIP_SLASH;
+			break;
+		case '#':
+			if (parser->config.allow_yaml_comments)
+				flags |= SKIP_YAML;
+			break;
+		}
+	}
+	parser->skip_flags = flags;
+	return 1;
+}
+
+/* pass over a skipped structure or string, looking only at the quotes,
+ * backslashes and brackets of each block of 16 bytes */
+static uint32_t skip_nested(json_parser *parser, const char *s, uint32_t i, uint32_t length)
+{
+	int done;
+
+#ifdef JSON_HAVE_SSE2
+	if (!parser->config.allow_c_comments && !parser->config.allow_yaml_comments) {
+		const __m128i quote = _mm_set1_epi8('"');
+		const __m128i backslash = _mm_set1_epi8('\\');
+		/* '[' and ']' are '{' and '}' without the 0x20 bit */
+		const __m128i lower = _mm_set1_epi8(0x20);
+		const __m128i open = _mm_set1_epi8('{');
+		const __m128i close = _mm_set1_epi8('}');
+
+		for (; i + 16 <= length; i += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+			__m128i folded = _mm_or_si128(v, lower);
+			unsigned int mask = _mm_movemask_epi8(_mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+				_mm_or_si128(_mm_cmpeq_epi8(folded, open), _mm_cmpeq_epi8(folded, close))));
+
+			/* the first byte is escaped by the end of the previous block */
+			if (parser->skip_flags & SKIP_ESCAPE) {
+				parser->skip_flags &= ~SKIP_ESCAPE;
+				mask &= ~1u;
+			}
+			while (mask) {
+				int p = mask_ctz(mask);
+				unsigned char ch = s[i + p];
+
+				mask &= mask - 1;
+				if (ch == '\\') {
+					if (!(parser->skip_flags & SKIP_STRING))
+						continue;
+					if (p == 15)
+						parser->skip_flags |= SKIP_ESCAPE;
+					else
+						mask &= ~(1u << (p + 1));
+					continue;
+				}
+				if (!skip_byte(parser, ch, &done))
+					return skip_done(parser, i + p);
+				if (done)
+					return skip_done(parser, i + p + 1);
+			}
+		}
+	}
+#endif
+	for (; i < length; i++) {
+		if (!skip_byte(parser, s[i], &done))
+			return skip_done(parser, i);
+		if (done)
+			return skip_done(parser, i + 1);
+	}
+	return i;
+}
+
+/* pass over the value a callback asked to skip, starting at s[i]. returns
+ * where parsing resumes; whitespace and comments before the value are left
+ * to the tables */
+static uint32_t skip_value(json_parser *parser, const char *s, uint32_t i, uint32_t length)
+{
+	unsigned char ch;
+
+	switch (parser->skip) {
+	case SKIP_VALUE:
+		if (parser->state != STATE__V)
+			return i;
+		ch = s[i];
+		switch (ch) {
+		case ' ': case '\t': case '\n': case '\r': case '/': case '#':
+			return i;
+		case '{': case '[': case '"':
+			parser->skip = SKIP_NESTED;
+			return skip_nested(parser, s, i, length);
+		case '}': case ']': case ',': case ':':
+			/* no value: let the tables report it */
+			parser->skip = SKIP_NONE;
+			return i;
+		}
+		parser->skip = SKIP_SCALAR;
+		/* fall through */
+	case SKIP_SCALAR:
+		for (; i < length; i++) {
+			ch = s[i];
+			if (ch == ',' || ch == '}' || ch == ']' || ch == ' ' || ch == '\t'
+			    || ch == '\n' || ch == '\r' || ch == '/' || ch == '#')
+				return skip_done(parser, i);
+		}
+		return i;
+	default:
+		return skip_nested(parser, s, i, length);
+	}
+}
+
+/* run the state machine over s[*pos..length), bytes already checked as
+ * utf8. *pos is left on the first byte not consumed. a parser driven by a
+ * json_reader stops after the byte that produced a token */
+static int parser_scan(json_parser *parser, const char *s, uint32_t *pos, uint32_t length)
+{
+	int ret = 0;
+	int next_class, next_state;
+	int buffer_policy;
+	uint16_t entry;
+	uint32_t i;
+
+	for (i = *pos; i < length; i++) {
+		unsigned char ch;
+
+		if (parser->skip) {
+			i = skip_value(parser, s, i, length);
+			if (i == length)
+				break;
+		}
+
+		/* plain runs inside strings and numbers don't go through the
+		 * tables: they are appended to the buffer in one go, and only the
+		 * delimiter is dispatched */
+		if (parser->state == STATE__S || parser->state == STATE_I0
+		    || parser->state == STATE_R2 || parser->state == STATE_X3) {
+			uint32_t end = (parser->state == STATE__S)
+				? string_span(s, i, length)
+				: digit_span(s, i, length);
+			if (end > i) {
+				if (parser->state != STATE__S && NUMBER_SCAN(parser))
+					number_digits(parser, s + i, end - i);
+				ret = span_append(parser, s + i, end - i);
+				if (ret)
+					break;
+				i = end;
+				if (i == length)
+					break;
+			}
+		}
+		ch = s[i];
+
+		ret = 0;
+		next_class = (ch < 0x80) ? character_class[ch] : C_OTHER;
+		/* RFC 7464 record separator, only between documents */
+		if (ch == 0x1e && parser->state == STATE_GO && parser->config.multi_document)
+			continue;
+		if (next_class == C_ERROR) {
+			ret = JSON_ERROR_BAD_CHAR;
+			break;
+		}
+
+		entry = state_table[parser->state][next_class];
+		next_state = STATE_NEXT(entry);
+		buffer_policy = STATE_POLICY(entry);
+		TRACING("addchar %d (current-state=%d, next-state=%d, buf-policy=%d)\n",
+			ch, parser->state, next_state, buffer_policy);
+		if (next_state == STATE___) {
+			ret = JSON_ERROR_UNEXPECTED_CHAR;
+			break;
+		}
+
+		/* add char to buffer */
+		if (buffer_policy && !(buffer_policy == 1 && direct_take(parser, s + i, 1))) {
+			ret = direct_flush(parser);
+			/* the buffer holds whole characters when about to take a
+			 * plain byte, an escape or the first digit of a \u */
+			if (!ret && parser->config.partial_strings && !parser->config.validate_only && !parser->binary
+			    && (parser->state == STATE__S || parser->state == STATE_E0 || parser->state == STATE_U1)
+			    && parser->buffer_offset + PARTIAL_MARGIN >= parser->buffer_size)
+				ret = string_part_flush(parser);
+			if (!ret)
+				ret = (buffer_policy == 2)
+					? buffer_push_escape(parser, ch)
+					: buffer_push(parser, ch);
+			if (ret)
+				break;
+		}
+
+		/* move to the next level */
+		if (IS_STATE_ACTION(next_state))
+			ret = do_action(parser, next_state);
+		else
+			parser->state = next_state;
+		if (ret)
+			break;
+
+		/* the byte was taken into a number (the type is set by its first) */
+		if (buffer_policy && (parser->type == JSON_INT || parser->type == JSON_FLOAT)
+		    && NUMBER_SCAN(parser))
+			number_char(parser, ch);
+
+		if (parser->reader && parser->reader->queue_tail != parser->reader->queue_head) {
+			i++;
+			break;
+		}
+	}
+	*pos = i;
+	return ret;
+}
+
+/** json_parser_string append a string s with a specific length to the parser
+ * return 0 if everything went ok, a JSON_ERROR_* otherwise.
+ * the user can supplied a valid processed pointer that will
+ * be fill with the number of processed characters before returning */
+int json_parser_string(json_parser *parser, const char *s,
+                       uint32_t length, uint32_t *processed)
+{
+	int ret;
+	uint32_t i = 0, valid;
+
+	valid = utf8_validate(parser, s, length);
+	ret = parser_scan(parser, s, &i, valid);
+
+	/* a token can't point into a chunk the caller may release */
+	if (parser->direct_ptr) {
+		int flush = direct_flush(parser);
+		if (!ret)
+			ret = flush;
+	}
+	if (!ret && valid < length)
+		ret = JSON_ERROR_UTF8;
+	/* events before an error are delivered too */
+	if (parser->batch_count) {
+		int flush = batch_flush(parser);
+		if (!ret)
+			ret = flush;
+	}
+	if (processed)
+		*processed = i;
+	return ret;
+}
+
+/** json_parser_char append one single char to the parser
+ * return 0 if everything went ok, a JSON_ERROR_* otherwise */
+int json_parser_char(json_parser *parser, unsigned char ch)
+{
+	return json_parser_string(parser, (char *) &ch, 1, NULL);
 }
 
-/** json_parser_string append a string s with a specific length to the parser
- * return 0 if everything went ok, a JSON_ERROR_* otherwise.
- * the user can supplied a valid processed pointer that will
- * be fill with the number of processed characters before returning */
-int json_parser_string(json_parser *parser, const char *s,
-                       uint32_t length, uint32_t *processed)
+/* the scanning loop of a validate_only parser: the tables and the actions
+ * only, nothing goes through the buffer. plain runs in strings and numbers
+ * are stepped over, and the digits of a \uXXXX escape are the one thing
+ * kept, for the surrogate checks */
+static int validator_scan(json_parser *parser, const char *s, uint32_t length, uint32_t *processed)
 {
-	int ret;
+	int ret = 0;
 	int next_class, next_state;
-	int buffer_policy;
-	uint32_t i;
+	uint16_t entry;
+	uint32_t i, valid;
 
-	ret = 0;
-	for (i = 0; i < length; i++) {
-		unsigned char ch = s[i];
+	valid = utf8_validate(parser, s, length);
 
-		ret = 0;
-		if (parser->utf8_multibyte_left > 0) {
-			if (utf8_continuation_table[ch] != 0) {
-				ret = JSON_ERROR_UTF8;
-				break;
-			}
-			next_class = C_OTHER;
-			parser->utf8_multibyte_left--;
-		} else {
-			parser->utf8_multibyte_left = utf8_header_table[ch];
-			if (parser->utf8_multibyte_left == 0xff) {
-				ret = JSON_ERROR_UTF8;
+	for (i = 0; i < valid; i++) {
+		unsigned char ch;
+
+		if (parser->state == STATE__S) {
+			i = string_span(s, i, valid);
+			if (i == valid)
 				break;
-			}
-			next_class = (parser->utf8_multibyte_left > 0) ? C_OTHER : character_class[ch];
-			if (next_class == C_ERROR) {
-				ret = JSON_ERROR_BAD_CHAR;
+		} else if (parser->state == STATE_I0 || parser->state == STATE_R2
+		           || parser->state == STATE_X3) {
+			i = digit_span(s, i, valid);
+			if (i == valid)
 				break;
-			}
 		}
+		ch = s[i];
 
-		next_state = state_transition_table[parser->state][next_class];
-		buffer_policy = buffer_policy_table[parser->state][next_class];
-		TRACING("addchar %d (current-state=%d, next-state=%d, buf-policy=%d)\n",
-			ch, parser->state, next_state, buffer_policy);
+		next_class = (ch < 0x80) ? character_class[ch] : C_OTHER;
+		if (ch == 0x1e && parser->state == STATE_GO && parser->config.multi_document)
+			continue;
+		if (next_class == C_ERROR) {
+			ret = JSON_ERROR_BAD_CHAR;
+			break;
+		}
+
+		entry = state_table[parser->state][next_class];
+		next_state = STATE_NEXT(entry);
 		if (next_state == STATE___) {
 			ret = JSON_ERROR_UNEXPECTED_CHAR;
 			break;
 		}
 
-		/* add char to buffer */
-		if (buffer_policy) {
-			ret = (buffer_policy == 2)
-				? buffer_push_escape(parser, ch)
-				: buffer_push(parser, ch);
-			if (ret)
-				break;
-		}
+		if (STATE_POLICY(entry) && parser->state >= STATE_U1 && parser->state <= STATE_U4)
+			parser->unicode_value = (parser->unicode_value << 4) | hex(ch);
 
-		/* move to the next level */
 		if (IS_STATE_ACTION(next_state))
 			ret = do_action(parser, next_state);
 		else
@@ -2185,16 +9601,190 @@ int json_parser_string(json_parser *parser, const char *s,
 		if (ret)
 			break;
 	}
-	if (processed)
-		*processed = i;
+	if (!ret && valid < length)
+		ret = JSON_ERROR_UTF8;
+	*processed = i;
 	return ret;
 }
 
-/** json_parser_char append one single char to the parser
- * return 0 if everything went ok, a JSON_ERROR_* otherwise */
-int json_parser_char(json_parser *parser, unsigned char ch)
+/* set up a validate_only parser on a caller provided stack, so that
+ * validation doesn't touch the allocator at all. */
+static void validator_init(json_parser *parser, json_config *config, uint8_t *stack)
 {
-	return json_parser_string(parser, (char *) &ch, 1, NULL);
+	memset(parser, 0, sizeof(*parser));
+	if (config)
+		memcpy(&parser->config, config, sizeof(json_config));
+	parser->config.validate_only = 1;
+	parser->state = STATE_GO;
+
+	parser->stack = stack;
+	parser->stack_size = LIBJSON_VALIDATE_STACK_SIZE;
+	if (parser->config.max_nesting > 0 && parser->config.max_nesting < parser->stack_size)
+		parser->stack_size = parser->config.max_nesting;
+	/* a non-zero limit stops state_grow from reallocating the stack */
+	parser->config.max_nesting = parser->stack_size;
+}
+
+/* feed s to a validator, in chunks if it doesn't fit a uint32_t */
+static int validator_run(json_parser *parser, const char *s, size_t length, size_t *offset)
+{
+	uint32_t chunk, processed;
+	int ret;
+
+	*offset = 0;
+	while (*offset < length) {
+		chunk = (length - *offset > 0x40000000) ? 0x40000000 : (uint32_t) (length - *offset);
+		ret = validator_scan(parser, s + *offset, chunk, &processed);
+		*offset += processed;
+		if (ret)
+			return ret;
+	}
+	if (parser->stack_offset != 0)
+		return JSON_ERROR_INCOMPLETE;
+
+	/* the document must have been closed */
+	switch (parser->state) {
+	case STATE_OK:
+		return 0;
+	case STATE_GO:
+		return (parser->config.multi_document) ? 0 : JSON_ERROR_INCOMPLETE;
+	case STATE_Y1:
+		/* a yaml comment may run to the end of the input */
+		if (parser->save_state == STATE_OK)
+			return 0;
+		return (parser->save_state == STATE_GO && parser->config.multi_document) ? 0 : JSON_ERROR_INCOMPLETE;
+	default:
+		return JSON_ERROR_INCOMPLETE;
+	}
+}
+
+/** json_validate checks that s holds exactly one well-formed document
+ * without allocating or buffering anything */
+int json_validate(json_config *config, const char *s, uint32_t length, uint32_t *error_offset)
+{
+	uint8_t stack[LIBJSON_VALIDATE_STACK_SIZE];
+	json_parser parser;
+	size_t offset;
+	int ret;
+
+	validator_init(&parser, config, stack);
+	ret = validator_run(&parser, s, length, &offset);
+	if (ret && error_offset)
+		*error_offset = (uint32_t) offset;
+	return ret;
+}
+
+#define IS_MINIFY_SPACE(c) ((c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == '\r')
+
+/* compact length bytes of in into out (which may be in itself), carrying
+ * the string/escape state of the minifier across calls. return the number
+ * of bytes written */
+static uint32_t minify_block(json_minifier *m, char *out, const char *in, uint32_t length)
+{
+	uint32_t i = 0, n = 0, end;
+
+#ifdef JSON_HAVE_SSE2
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i backslash = _mm_set1_epi8('\\');
+	const __m128i space = _mm_set1_epi8(' ');
+	const __m128i tab = _mm_set1_epi8('\t');
+	const __m128i nl = _mm_set1_epi8('\n');
+	const __m128i cr = _mm_set1_epi8('\r');
+#endif
+
+	while (i < length) {
+		end = length;
+#ifdef JSON_HAVE_SSE2
+		if (i + 16 <= length) {
+			__m128i v = _mm_loadu_si128((const __m128i *) (in + i));
+			uint32_t quotes, strings, white, keep;
+
+			/* escapes are rare: a block with a backslash, or starting
+			 * right after one, goes through the byte loop */
+			end = i + 16;
+			if (!m->escaped && !_mm_movemask_epi8(_mm_cmpeq_epi8(v, backslash))) {
+				quotes = _mm_movemask_epi8(_mm_cmpeq_epi8(v, quote));
+				white = _mm_movemask_epi8(_mm_or_si128(
+					_mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, tab)),
+					_mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, cr))));
+
+				/* prefix xor of the quotes marks the bytes inside strings */
+				strings = quotes ^ (quotes << 1);
+				strings ^= strings << 2;
+				strings ^= strings << 4;
+				strings ^= strings << 8;
+				if (m->in_string)
+					strings = ~strings;
+				m->in_string ^= mask_parity(quotes);
+
+				keep = ~(white & ~strings) & 0xffff;
+				if (keep == 0xffff) {
+					_mm_storeu_si128((__m128i *) (out + n), v);
+					n += 16;
+				} else {
+					while (keep) {
+						out[n++] = in[i + mask_ctz(keep)];
+						keep &= keep - 1;
+					}
+				}
+				i = end;
+				continue;
+			}
+		}
+#endif
+		for (; i < end; i++) {
+			char c = in[i];
+			if (m->in_string) {
+				out[n++] = c;
+				if (m->escaped)
+					m->escaped = 0;
+				else if (c == '\\')
+					m->escaped = 1;
+				else if (c == '"')
+					m->in_string = 0;
+			} else if (!IS_MINIFY_SPACE(c)) {
+				out[n++] = c;
+				if (c == '"')
+					m->in_string = 1;
+			}
+		}
+	}
+	return n;
+}
+
+/** json_minify strips the whitespace outside of strings */
+uint32_t json_minify(char *out, const char *in, uint32_t length)
+{
+	json_minifier m;
+
+	memset(&m, 0, sizeof(m));
+	return minify_block(&m, out, in, length);
+}
+
+/** json_minifier_init initialize a streaming minifier. always succeed */
+int json_minifier_init(json_minifier *minifier, json_printer_callback callback, void *userdata)
+{
+	memset(minifier, 0, sizeof(*minifier));
+	minifier->callback = callback;
+	minifier->userdata = userdata;
+	return 0;
+}
+
+/** json_minifier_string minify the next chunk of a document */
+int json_minifier_string(json_minifier *minifier, const char *s, uint32_t length)
+{
+	char out[4096];
+	uint32_t chunk, n;
+
+	while (length > 0) {
+		chunk = (length > sizeof(out)) ? sizeof(out) : length;
+		n = minify_block(minifier, out, s, chunk);
+		if (n > 0 && (*minifier->callback)(minifier->userdata, out, n))
+			return JSON_ERROR_CALLBACK;
+		s += chunk;
+		length -= chunk;
+	}
+	return 0;
 }
 
 /** json_print_init initialize a printer context. always succeed */
@@ -2211,113 +9801,345 @@ int json_print_init(json_printer *printer, json_printer_callback callback, void
 	return 0;
 }
 
-/** json_print_free free a printer context
- * doesn't do anything now, but in future print_init could allocate memory */
+/** json_print_flush pass the buffered output to the callback */
+int json_print_flush(json_printer *printer)
+{
+	uint32_t length = printer->buffer_offset;
+
+	if (length == 0)
+		return 0;
+	printer->buffer_offset = 0;
+	return printer->callback(printer->userdata, printer->buffer, length);
+}
+
+/** json_print_set_buffer gather the output in a buffer of size bytes */
+int json_print_set_buffer(json_printer *printer, uint32_t size)
+{
+	char *buffer = NULL;
+	int ret;
+
+	ret = json_print_flush(printer);
+	if (ret)
+		return ret;
+	if (size > 0) {
+		buffer = malloc(size);
+		if (!buffer)
+			return JSON_ERROR_NO_MEMORY;
+	}
+	free(printer->buffer);
+	printer->buffer = buffer;
+	printer->buffer_size = size;
+	return 0;
+}
+
+/** json_print_free free a printer context */
 int json_print_free(json_printer *printer)
 {
+	int ret;
+
+	ret = (printer->buffer) ? json_print_flush(printer) : 0;
+	free(printer->buffer);
+	free(printer->indent);
 	memset(printer, '\0', sizeof(*printer));
+	return ret;
+}
+
+/* copy to the buffer, or straight to the callback what doesn't fit in */
+static int print_out(json_printer *printer, const char *data, uint32_t length)
+{
+	int ret;
+
+	if (!printer->buffer)
+		return printer->callback(printer->userdata, data, length);
+	if (length > printer->buffer_size - printer->buffer_offset) {
+		ret = json_print_flush(printer);
+		if (ret)
+			return ret;
+		if (length >= printer->buffer_size)
+			return printer->callback(printer->userdata, data, length);
+	}
+	memcpy(printer->buffer + printer->buffer_offset, data, length);
+	printer->buffer_offset += length;
 	return 0;
 }
 
 /* escape a C string to be a JSON valid string on the wire.
  * : it doesn't do unicode verification. yet?. */
+/* end of the run of printable ascii starting at i, for ascii_only output */
+static uint32_t ascii_span(const char *s, uint32_t i, uint32_t length)
+{
+#ifdef JSON_HAVE_SSE2
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i backslash = _mm_set1_epi8('\\');
+	const __m128i control = _mm_set1_epi8(0x1f);
+
+	for (; i + 16 <= length; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+		__m128i stop = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+			_mm_cmpeq_epi8(_mm_max_epu8(v, control), control));
+		/* the high bit of the non-ascii bytes is in the mask as is */
+		int mask = _mm_movemask_epi8(_mm_or_si128(stop, v));
+		if (mask)
+			return i + mask_ctz(mask);
+	}
+#endif
+	for (; i < length; i++) {
+		unsigned char ch = s[i];
+		if (ch == '"' || ch == '\\' || ch < 0x20 || ch >= 0x80)
+			break;
+	}
+	return i;
+}
+
+static int print_u_escape(json_printer *printer, uint32_t code)
+{
+	static const char hex[] = "0123456789abcdef";
+	char esc[6] = { '\\', 'u', hex[(code >> 12) & 0xf], hex[(code >> 8) & 0xf],
+	                hex[(code >> 4) & 0xf], hex[code & 0xf] };
+
+	return print_out(printer, esc, 6);
+}
+
+/* write the utf8 character at s as \uXXXX, or a surrogate pair beyond the
+ * BMP. a byte that doesn't start a well formed sequence is taken as latin1,
+ * like print_binary_string does. *consumed is set to the bytes taken */
+static int print_utf8_escape(json_printer *printer, const unsigned char *s, uint32_t length,
+                             uint32_t *consumed)
+{
+	uint32_t n = utf8_header_table[s[0]];
+	uint32_t code, k;
+	int ret;
+
+	*consumed = 1;
+	if (n < 1 || n > 3 || n >= length)
+		return print_u_escape(printer, s[0]);
+	code = s[0] & (0x3f >> n);
+	for (k = 1; k <= n; k++) {
+		if ((s[k] & 0xc0) != 0x80)
+			return print_u_escape(printer, s[0]);
+		code = (code << 6) | (s[k] & 0x3f);
+	}
+	*consumed = n + 1;
+	if (code < 0x10000)
+		return print_u_escape(printer, code);
+	code -= 0x10000;
+	ret = print_u_escape(printer, 0xd800 | (code >> 10));
+	if (ret)
+		return ret;
+	return print_u_escape(printer, 0xdc00 | (code & 0x3ff));
+}
+
+/* runs of characters that need no escaping go out in one piece. stops at
+ * the first error of the output callback and returns it */
+static int print_string_body(json_printer *printer, const char *data, uint32_t length)
+{
+	uint32_t i, end, n;
+	int ret = 0;
+
+	for (i = 0; i < length && !ret; i = end) {
+		unsigned char c;
+
+		end = (printer->ascii_only) ? ascii_span(data, i, length) : string_span(data, i, length);
+		if (end > i) {
+			ret = print_out(printer, data + i, end - i);
+			if (ret)
+				break;
+		}
+		if (end == length)
+			break;
+		c = data[end];
+		if (c >= 0x80) {
+			ret = print_utf8_escape(printer, (const unsigned char *) data + end, length - end, &n);
+			end += n;
+			continue;
+		}
+		ret = print_out(printer, character_escape[c], character_escape_length[c]);
+		end++;
+	}
+	return ret;
+}
+
 static int print_string(json_printer *printer, const char *data, uint32_t length)
 {
-	uint32_t i;
+	int ret;
 
-	printer->callback(printer->userdata, "\"", 1);
-	for (i = 0; i < length; i++) {
-		unsigned char c = data[i];
-		if (c < 36) {
-			char const *esc = character_escape[c];
-			printer->callback(printer->userdata, esc, strlen(esc));
-		} else if (c == '\\') {
-			printer->callback(printer->userdata, "\\\\", 2);
-		} else
-			printer->callback(printer->userdata, data + i, 1);
+	ret = print_out(printer, "\"", 1);
+	if (!ret)
+		ret = print_string_body(printer, data, length);
+	if (!ret)
+		ret = print_out(printer, "\"", 1);
+	return ret;
+}
+
+/* base64 goes out by blocks of 768 bytes, a multiple of 3 so that only
+ * the last one can be padded */
+static int print_base64_string(json_printer *printer, const char *data, uint32_t length)
+{
+	char out[1024];
+	uint32_t i, n;
+	int ret;
+
+	ret = print_out(printer, "\"", 1);
+	for (i = 0; i < length && !ret; i += n) {
+		n = (length - i > 768) ? 768 : length - i;
+		ret = print_out(printer, out, json_base64_encode(out, data + i, n, printer->base64));
 	}
-	printer->callback(printer->userdata, "\"", 1);
-	return 0;
+	if (!ret)
+		ret = print_out(printer, "\"", 1);
+	return ret;
 }
 
 static int print_binary_string(json_printer *printer, const char *data, uint32_t length)
 {
 	uint32_t i;
+	int ret;
 
-	printer->callback(printer->userdata, "\"", 1);
-	for (i = 0; i < length; i++) {
+	if (printer->base64)
+		return print_base64_string(printer, data, length);
+	ret = print_out(printer, "\"", 1);
+	for (i = 0; i < length && !ret; i++) {
 		unsigned char c = data[i];
-		char const *esc = character_escape[c];
-		printer->callback(printer->userdata, esc, strlen(esc));
+		ret = print_out(printer, character_escape[c], character_escape_length[c]);
 	}
-	printer->callback(printer->userdata, "\"", 1);
-	return 0;
+	if (!ret)
+		ret = print_out(printer, "\"", 1);
+	return ret;
 }
 
 
+/* the newline and indentation are made once for the deepest level seen,
+ * and again when indentstr is changed */
 static int print_indent(json_printer *printer)
 {
-	int i;
-	printer->callback(printer->userdata, "\n", 1);
-	for (i = 0; i < printer->indentlevel; i++)
-		printer->callback(printer->userdata, printer->indentstr, strlen(printer->indentstr));
-	return 0;
+	size_t len = strlen(printer->indentstr);
+	int i, ret;
+
+	if (printer->indentlevel > printer->indent_levels || printer->indent_str != printer->indentstr) {
+		int levels = (printer->indentlevel > 16) ? printer->indentlevel * 2 : 16;
+		char *indent = realloc(printer->indent, 1 + levels * len);
+
+		if (!indent) {
+			ret = print_out(printer, "\n", 1);
+			for (i = 0; i < printer->indentlevel && !ret; i++)
+				ret = print_out(printer, printer->indentstr, len);
+			return ret;
+		}
+		indent[0] = '\n';
+		for (i = 0; i < levels; i++)
+			memcpy(indent + 1 + i * len, printer->indentstr, len);
+		printer->indent = indent;
+		printer->indent_str = printer->indentstr;
+		printer->indent_levels = levels;
+	}
+	return print_out(printer, printer->indent, 1 + printer->indentlevel * len);
+}
+
+/* what goes before a value: the comma after the previous one, and the
+ * indentation when pretty */
+static int print_value_prefix(json_printer *printer, int pretty)
+{
+	int ret = 0;
+
+	if (!printer->enter_object && !printer->afterkey) {
+		ret = print_out(printer, ",", 1);
+		if (!ret && pretty)
+			ret = print_indent(printer);
+	} else if (pretty && printer->enter_object && !printer->first)
+		ret = print_indent(printer);
+
+	printer->first = 0;
+	printer->enter_object = 0;
+	printer->afterkey = 0;
+	return ret;
 }
 
+/* every error of the output callback is reported as JSON_ERROR_CALLBACK */
 static int json_print_mode(json_printer *printer, int type, const char *data, uint32_t length, int pretty)
 {
 	int enterobj = printer->enter_object;
+	int ret = 0;
+
+	/* one document per line, the next one starts afresh */
+	if (type == JSON_DOCUMENT_END) {
+		printer->enter_object = 1;
+		printer->first = 1;
+		printer->afterkey = 0;
+		return (print_out(printer, "\n", 1)) ? JSON_ERROR_CALLBACK : 0;
+	}
 
-	if (!enterobj && !printer->afterkey && (type != JSON_ARRAY_END && type != JSON_OBJECT_END)) {
-		printer->callback(printer->userdata, ",", 1);
-		if (pretty) print_indent(printer);
+	/* the rest of a string opened by JSON_STRING_PART or JSON_KEY_PART */
+	if (printer->instring) {
+		ret = print_string_body(printer, data, length);
+		if (ret || type == JSON_STRING_PART || type == JSON_KEY_PART)
+			return (ret) ? JSON_ERROR_CALLBACK : 0;
+		printer->instring = 0;
+		ret = print_out(printer, "\"", 1);
+		if (!ret && type == JSON_KEY) {
+			ret = print_out(printer, ": ", (pretty) ? 2 : 1);
+			printer->afterkey = 1;
+		}
+		return (ret) ? JSON_ERROR_CALLBACK : 0;
 	}
 
-	if (pretty && (enterobj && !printer->first && (type != JSON_ARRAY_END && type != JSON_OBJECT_END))) {
-		print_indent(printer);
+	if (type != JSON_ARRAY_END && type != JSON_OBJECT_END)
+		ret = print_value_prefix(printer, pretty);
+	else {
+		printer->first = 0;
+		printer->enter_object = 0;
+		printer->afterkey = 0;
 	}
+	if (ret)
+		return JSON_ERROR_CALLBACK;
 
-	printer->first = 0;
-	printer->enter_object = 0;
-	printer->afterkey = 0;
 	switch (type) {
 	case JSON_ARRAY_BEGIN:
-		printer->callback(printer->userdata, "[", 1);
+		ret = print_out(printer, "[", 1);
 		printer->indentlevel++;
 		printer->enter_object = 1;
 		break;
 	case JSON_OBJECT_BEGIN:
-		printer->callback(printer->userdata, "{", 1);
+		ret = print_out(printer, "{", 1);
 		printer->indentlevel++;
 		printer->enter_object = 1;
 		break;
 	case JSON_ARRAY_END:
 	case JSON_OBJECT_END:
 		printer->indentlevel--;
-		if (pretty && !enterobj) print_indent(printer);
-		printer->callback(printer->userdata, (type == JSON_OBJECT_END) ? "}" : "]", 1);
+		if (pretty && !enterobj)
+			ret = print_indent(printer);
+		if (!ret)
+			ret = print_out(printer, (type == JSON_OBJECT_END) ? "}" : "]", 1);
 		break;
-	case JSON_INT: printer->callback(printer->userdata, data, length); break;
-	case JSON_FLOAT: printer->callback(printer->userdata, data, length); break;
-	case JSON_NULL: printer->callback(printer->userdata, "null", 4); break;
-	case JSON_TRUE: printer->callback(printer->userdata, "true", 4); break;
-	case JSON_FALSE: printer->callback(printer->userdata, "false", 5); break;
+	case JSON_INT: ret = print_out(printer, data, length); break;
+	case JSON_FLOAT: ret = print_out(printer, data, length); break;
+	case JSON_NULL: ret = print_out(printer, "null", 4); break;
+	case JSON_TRUE: ret = print_out(printer, "true", 4); break;
+	case JSON_FALSE: ret = print_out(printer, "false", 5); break;
 	case JSON_KEY:
-		print_string(printer, data, length);
-		printer->callback(printer->userdata, ": ", (pretty) ? 2 : 1);
+		ret = print_string(printer, data, length);
+		if (!ret)
+			ret = print_out(printer, ": ", (pretty) ? 2 : 1);
 		printer->afterkey = 1;
 		break;
 	case JSON_STRING:
-		print_string(printer, data, length);
+		ret = print_string(printer, data, length);
 		break;
 	case JSON_BSTRING:
-		print_binary_string(printer, data, length);
+		ret = print_binary_string(printer, data, length);
+		break;
+	case JSON_KEY_PART:
+	case JSON_STRING_PART:
+		ret = print_out(printer, "\"", 1);
+		printer->instring = 1;
+		if (!ret)
+			ret = print_string_body(printer, data, length);
 		break;
 	default:
 		break;
 	}
 
-	return 0;
+	return (ret) ? JSON_ERROR_CALLBACK : 0;
 }
 
 /** json_print_pretty pretty print the passed argument (type/data/length). */
@@ -2326,22 +10148,115 @@ int json_print_pretty(json_printer *printer, int type, const char *data, uint32_
 	return json_print_mode(printer, type, data, length, 1);
 }
 
-/** json_print_raw prints without eye candy the passed argument (type/data/length). */
-int json_print_raw(json_printer *printer, int type, const char *data, uint32_t length)
+/** json_print_raw prints without eye candy the passed argument (type/data/length). */
+int json_print_raw(json_printer *printer, int type, const char *data, uint32_t length)
+{
+	return json_print_mode(printer, type, data, length, 0);
+}
+
+/** json_print_args takes multiple types and pass them to the printer function */
+int json_print_args(json_printer *printer,
+                    int (*f)(json_printer *, int, const char *, uint32_t),
+                    ...)
+{
+	va_list ap;
+	char *data;
+	uint32_t length;
+	int type, ret;
+
+	ret = 0;
+	va_start(ap, f);
+	while ((type = va_arg(ap, int)) != -1) {
+		switch (type) {
+		case JSON_ARRAY_BEGIN:
+		case JSON_ARRAY_END:
+		case JSON_OBJECT_BEGIN:
+		case JSON_OBJECT_END:
+		case JSON_NULL:
+		case JSON_TRUE:
+		case JSON_FALSE:
+			ret = (*f)(printer, type, NULL, 0);
+			break;
+		case JSON_INT:
+		case JSON_FLOAT:
+		case JSON_KEY:
+		case JSON_STRING:
+			data = va_arg(ap, char *);
+			length = va_arg(ap, uint32_t);
+			if (length == -1)
+				length = strlen(data);
+			ret = (*f)(printer, type, data, length);
+			break;
+		}
+		if (ret)
+			break;
+	}
+	va_end(ap);
+	return ret;
+}
+
+/* printer callback of json_template_compile */
+static int template_append(void *userdata, const char *data, uint32_t length)
+{
+	json_template *tpl = userdata;
+
+	if (tpl->text_length + length > tpl->text_size) {
+		uint32_t newsize = (tpl->text_size) ? tpl->text_size * 2 : 256;
+		char *ptr;
+
+		while (tpl->text_length + length > newsize)
+			newsize *= 2;
+		ptr = realloc(tpl->text, newsize);
+		if (!ptr) {
+			tpl->failed = 1;
+			return JSON_ERROR_NO_MEMORY;
+		}
+		tpl->text = ptr;
+		tpl->text_size = newsize;
+	}
+	memcpy(tpl->text + tpl->text_length, data, length);
+	tpl->text_length += length;
+	return 0;
+}
+
+static int template_slot(json_template *tpl, json_printer *printer, int type)
 {
-	return json_print_mode(printer, type, data, length, 0);
+	struct json_template_slot *ptr;
+	int ret;
+
+	ret = print_value_prefix(printer, tpl->pretty);
+	if (ret)
+		return ret;
+	if (tpl->slot_count == tpl->slot_size) {
+		uint32_t newsize = (tpl->slot_size) ? tpl->slot_size * 2 : 16;
+
+		ptr = realloc(tpl->slots, newsize * sizeof(*ptr));
+		if (!ptr)
+			return JSON_ERROR_NO_MEMORY;
+		tpl->slots = ptr;
+		tpl->slot_size = newsize;
+	}
+	tpl->slots[tpl->slot_count].offset = tpl->text_length;
+	tpl->slots[tpl->slot_count].type = type;
+	tpl->slot_count++;
+	return 0;
 }
 
-/** json_print_args takes multiple types and pass them to the printer function */
-int json_print_args(json_printer *printer,
-                    int (*f)(json_printer *, int, const char *, uint32_t),
-                    ...)
+/** json_template_compile renders a skeleton given like to json_print_args */
+int json_template_compile(json_template *tpl,
+                          int (*f)(json_printer *, int, const char *, uint32_t),
+                          ...)
 {
+	json_printer printer;
 	va_list ap;
 	char *data;
 	uint32_t length;
 	int type, ret;
 
+	memset(tpl, 0, sizeof(*tpl));
+	tpl->pretty = (f == json_print_pretty);
+	json_print_init(&printer, template_append, tpl);
+
 	ret = 0;
 	va_start(ap, f);
 	while ((type = va_arg(ap, int)) != -1) {
@@ -2353,7 +10268,7 @@ int json_print_args(json_printer *printer,
 		case JSON_NULL:
 		case JSON_TRUE:
 		case JSON_FALSE:
-			ret = (*f)(printer, type, NULL, 0);
+			ret = (*f)(&printer, type, NULL, 0);
 			break;
 		case JSON_INT:
 		case JSON_FLOAT:
@@ -2361,18 +10276,97 @@ int json_print_args(json_printer *printer,
 		case JSON_STRING:
 			data = va_arg(ap, char *);
 			length = va_arg(ap, uint32_t);
-			if (length == -1)
+			if (length == (uint32_t) -1)
 				length = strlen(data);
-			ret = (*f)(printer, type, data, length);
+			ret = (*f)(&printer, type, data, length);
+			break;
+		case JSON_SLOT_INT:
+		case JSON_SLOT_FLOAT:
+		case JSON_SLOT_STRING:
+		case JSON_SLOT_BOOL:
+		case JSON_SLOT_RAW:
+			ret = template_slot(tpl, &printer, type);
 			break;
 		}
+		if (!ret && tpl->failed)
+			ret = JSON_ERROR_NO_MEMORY;
 		if (ret)
 			break;
 	}
 	va_end(ap);
+	json_print_free(&printer);
+	if (ret)
+		json_template_free(tpl);
+	return ret;
+}
+
+/* digits of an int64 written backward from the end of buf */
+static uint32_t template_format_int(char *buf, int64_t v)
+{
+	uint64_t u = (v < 0) ? -(uint64_t) v : (uint64_t) v;
+	char *p = buf + 24;
+
+	do {
+		*--p = '0' + (u % 10);
+		u /= 10;
+	} while (u);
+	if (v < 0)
+		*--p = '-';
+	memmove(buf, p, buf + 24 - p);
+	return buf + 24 - p;
+}
+
+/** json_template_render prints tpl with its slots filled from slots */
+int json_template_render(const json_template *tpl, json_printer *printer, const json_slot *slots)
+{
+	const json_slot *slot;
+	uint32_t i, pos = 0, length;
+	char buf[32];
+	int ret = 0;
+
+	/* the whole template goes where a value would */
+	ret = print_value_prefix(printer, tpl->pretty);
+	for (i = 0; i < tpl->slot_count && !ret; i++) {
+		if (tpl->slots[i].offset > pos)
+			ret = print_out(printer, tpl->text + pos, tpl->slots[i].offset - pos);
+		pos = tpl->slots[i].offset;
+		slot = &slots[i];
+		switch (tpl->slots[i].type) {
+		case JSON_SLOT_INT:
+			ret = print_out(printer, buf, template_format_int(buf, slot->i));
+			break;
+		case JSON_SLOT_FLOAT:
+			if (isfinite(slot->d))
+				ret = print_out(printer, buf, format_double(buf, slot->d));
+			else
+				ret = print_out(printer, "null", 4);
+			break;
+		case JSON_SLOT_BOOL:
+			ret = (slot->b) ? print_out(printer, "true", 4) : print_out(printer, "false", 5);
+			break;
+		case JSON_SLOT_STRING:
+			length = (slot->length == (uint32_t) -1) ? strlen(slot->s) : slot->length;
+			ret = print_string(printer, slot->s, length);
+			break;
+		case JSON_SLOT_RAW:
+			length = (slot->length == (uint32_t) -1) ? strlen(slot->s) : slot->length;
+			ret = print_out(printer, slot->s, length);
+			break;
+		}
+	}
+	if (!ret && tpl->text_length > pos)
+		ret = print_out(printer, tpl->text + pos, tpl->text_length - pos);
 	return ret;
 }
 
+/** json_template_free freed memory structure allocated by the template */
+void json_template_free(json_template *tpl)
+{
+	free(tpl->text);
+	free(tpl->slots);
+	memset(tpl, 0, sizeof(*tpl));
+}
+
 static int dom_push(struct json_parser_dom *ctx, void *val)
 {
 	if (ctx->stack_offset == ctx->stack_size) {
@@ -2421,6 +10415,21 @@ int json_parser_dom_free(json_parser_dom *dom)
 	return 0;
 }
 
+int json_parser_dom_batch_callback(void *userdata, const json_event *events,
+                                   uint32_t nr_events, const char *arena)
+{
+	uint32_t i;
+	int ret;
+
+	for (i = 0; i < nr_events; i++) {
+		ret = json_parser_dom_callback(userdata, events[i].type,
+		                               arena + events[i].offset, events[i].length);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
 int json_parser_dom_callback(void *userdata, int type, const char *data, uint32_t length)
 {
 	struct json_parser_dom *ctx = userdata;
@@ -2472,6 +10481,352 @@ int json_parser_dom_callback(void *userdata, int type, const char *data, uint32_
 }
 
 
+static uint32_t schema_hash(const char *key, uint32_t length)
+{
+	uint32_t hash = 2166136261u;
+	uint32_t i;
+
+	for (i = 0; i < length; i++) {
+		hash ^= (unsigned char) key[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+int json_schema_init(json_schema *schema, const json_field *fields, uint32_t nr_fields)
+{
+	uint32_t i;
+
+	if (nr_fields > JSON_SCHEMA_MAX_FIELDS)
+		return JSON_ERROR_DATA_LIMIT;
+
+	memset(schema, 0, sizeof(*schema));
+	schema->fields = fields;
+	schema->nr_fields = nr_fields;
+
+	for (i = 0; i < nr_fields; i++) {
+		uint32_t slot = schema_hash(fields[i].key, strlen(fields[i].key)) % JSON_SCHEMA_SLOTS;
+		while (schema->slots[slot])
+			slot = (slot + 1) % JSON_SCHEMA_SLOTS;
+		schema->slots[slot] = i + 1;
+	}
+	return 0;
+}
+
+static const json_field *schema_lookup(const json_schema *schema, const char *key, uint32_t length)
+{
+	uint32_t slot = schema_hash(key, length) % JSON_SCHEMA_SLOTS;
+
+	while (schema->slots[slot]) {
+		const json_field *field = &schema->fields[schema->slots[slot] - 1];
+		/* keys may hold a \u0000: lengths first, then bytes */
+		if (strlen(field->key) == length && memcmp(field->key, key, length) == 0)
+			return field;
+		slot = (slot + 1) % JSON_SCHEMA_SLOTS;
+	}
+	return NULL;
+}
+
+int json_schema_decoder_init(json_schema_decoder *dec, const json_schema *schema, void *target)
+{
+	memset(dec, 0, sizeof(*dec));
+	dec->schema = schema;
+	dec->target = target;
+	return 0;
+}
+
+/* numbers are converted from a bounded copy: the token isn't guaranteed
+ * to be followed by anything the C library would stop at */
+static int schema_store_number(const json_field *field, char *base, int type,
+                               const char *data, uint32_t length)
+{
+	char number[64];
+	char *end;
+
+	if (length >= sizeof(number))
+		return JSON_ERROR_CALLBACK;
+	memcpy(number, data, length);
+	number[length] = '\0';
+
+	switch (field->type) {
+	case JSON_FIELD_INT:
+		if (type != JSON_INT)
+			return JSON_ERROR_CALLBACK;
+		errno = 0;
+		*(int64_t *) (base + field->offset) = strtoll(number, &end, 10);
+		return (errno || *end) ? JSON_ERROR_CALLBACK : 0;
+	case JSON_FIELD_DOUBLE:
+		*(double *) (base + field->offset) = c_strtod(number, &end);
+		return (*end) ? JSON_ERROR_CALLBACK : 0;
+	default:
+		return JSON_ERROR_CALLBACK;
+	}
+}
+
+int json_schema_callback(void *userdata, int type, const char *data, uint32_t length)
+{
+	json_schema_decoder *dec = userdata;
+	const json_field *field = dec->field;
+	char *base;
+
+	/* inside a member nobody asked for: only track nesting */
+	if (dec->skip) {
+		if (type == JSON_OBJECT_BEGIN || type == JSON_ARRAY_BEGIN)
+			dec->skip++;
+		else if (type == JSON_OBJECT_END || type == JSON_ARRAY_END)
+			dec->skip--;
+		return 0;
+	}
+
+	if (dec->depth == 0) {
+		if (type == JSON_DOCUMENT_END)
+			return 0;
+		if (type != JSON_OBJECT_BEGIN)
+			return JSON_ERROR_CALLBACK;
+		dec->stack[0].schema = dec->schema;
+		dec->stack[0].base = dec->target;
+		dec->depth = 1;
+		return 0;
+	}
+
+	base = dec->stack[dec->depth - 1].base;
+	dec->field = NULL;
+
+	switch (type) {
+	case JSON_KEY:
+		dec->field = schema_lookup(dec->stack[dec->depth - 1].schema, data, length);
+		break;
+	case JSON_OBJECT_BEGIN:
+		if (!field) {
+			dec->skip = 1;
+			break;
+		}
+		if (field->type != JSON_FIELD_OBJECT || !field->nested)
+			return JSON_ERROR_CALLBACK;
+		if (dec->depth == JSON_SCHEMA_MAX_DEPTH)
+			return JSON_ERROR_NESTING_LIMIT;
+		dec->stack[dec->depth].schema = field->nested;
+		dec->stack[dec->depth].base = base + field->offset;
+		dec->depth++;
+		break;
+	case JSON_ARRAY_BEGIN:
+		if (field)
+			return JSON_ERROR_CALLBACK;
+		dec->skip = 1;
+		break;
+	case JSON_OBJECT_END:
+		dec->depth--;
+		break;
+	case JSON_INT:
+	case JSON_FLOAT:
+		if (field)
+			return schema_store_number(field, base, type, data, length);
+		break;
+	case JSON_TRUE:
+	case JSON_FALSE:
+		if (!field)
+			break;
+		if (field->type != JSON_FIELD_BOOL)
+			return JSON_ERROR_CALLBACK;
+		*(int *) (base + field->offset) = (type == JSON_TRUE);
+		break;
+	case JSON_STRING:
+		if (!field)
+			break;
+		if (field->type != JSON_FIELD_STRING || field->size == 0)
+			return JSON_ERROR_CALLBACK;
+		if (length >= field->size)
+			length = field->size - 1;
+		memcpy(base + field->offset, data, length);
+		base[field->offset + length] = '\0';
+		break;
+	case JSON_NULL:
+		/* null leaves the member untouched */
+		break;
+	}
+	return 0;
+}
+
+/* the parser of a reader hands its tokens over here, without going through
+ * a callback. data is kept where it is, in the reader's input or in the
+ * parse buffer, since the parser stops right after the byte that produced
+ * the token. string parts are copied to the arena: the buffer is reused for
+ * the rest of the string before the scan stops */
+static int reader_take(json_reader *reader, int type, const char *data, uint32_t length)
+{
+	json_parser *parser = &reader->parser;
+	struct json_reader_token *token;
+
+	if (reader->queue_tail == reader->queue_size) {
+		uint32_t newsize = reader->queue_size * 2;
+		void *ptr = parser_realloc(parser, reader->queue, newsize * sizeof(reader->queue[0]));
+		if (!ptr)
+			return JSON_ERROR_NO_MEMORY;
+		reader->queue = ptr;
+		reader->queue_size = newsize;
+	}
+	token = &reader->queue[reader->queue_tail++];
+	token->type = type;
+	token->data = data;
+	token->length = length;
+	token->arena_offset = 0;
+	memset(&token->number, 0, sizeof(token->number));
+
+	if (type == JSON_STRING_PART || type == JSON_KEY_PART) {
+		if (reader->arena_offset + length + 1 > reader->arena_size) {
+			uint32_t newsize = reader->arena_size * 2;
+			void *ptr;
+
+			while (reader->arena_offset + length + 1 > newsize)
+				newsize *= 2;
+			ptr = parser_realloc(parser, reader->arena, newsize);
+			if (!ptr)
+				return JSON_ERROR_NO_MEMORY;
+			reader->arena = ptr;
+			reader->arena_size = newsize;
+		}
+		memcpy(reader->arena + reader->arena_offset, data, length);
+		reader->arena[reader->arena_offset + length] = '\0';
+		token->data = NULL;
+		token->arena_offset = reader->arena_offset;
+		reader->arena_offset += length + 1;
+	}
+	return 0;
+}
+
+static int reader_init(json_reader *reader, json_config *config)
+{
+	json_parser *parser = &reader->parser;
+	json_config rconfig;
+	int ret;
+
+	memset(reader, 0, sizeof(*reader));
+	if (config)
+		memcpy(&rconfig, config, sizeof(json_config));
+	else
+		memset(&rconfig, 0, sizeof(json_config));
+	rconfig.zero_copy = 1;
+	rconfig.validate_only = 0;
+
+	ret = json_parser_init(parser, &rconfig, NULL, NULL);
+	if (ret)
+		return ret;
+	parser->reader = reader;
+
+	reader->queue_size = 16;
+	reader->queue = parser_calloc(parser, reader->queue_size, sizeof(reader->queue[0]));
+	reader->arena_size = LIBJSON_DEFAULT_BUFFER_SIZE;
+	reader->arena = parser_calloc(parser, reader->arena_size, sizeof(char));
+	if (!reader->queue || !reader->arena) {
+		json_reader_free(reader);
+		return JSON_ERROR_NO_MEMORY;
+	}
+	return 0;
+}
+
+/** json_reader_init initialize a reader over a whole document in memory */
+int json_reader_init(json_reader *reader, json_config *config, const char *s, uint32_t length)
+{
+	int ret = reader_init(reader, config);
+
+	if (ret)
+		return ret;
+	reader->input = s;
+	reader->input_length = length;
+	reader->input_valid = utf8_validate(&reader->parser, s, length);
+	return 0;
+}
+
+/** json_reader_init_source initialize a reader pulling its input from refill */
+int json_reader_init_source(json_reader *reader, json_config *config,
+                            json_reader_refill refill, void *userdata)
+{
+	int ret = reader_init(reader, config);
+
+	reader->refill = refill;
+	reader->refill_userdata = userdata;
+	return ret;
+}
+
+/** json_reader_next return the next token of the document */
+int json_reader_next(json_reader *reader, json_token *token)
+{
+	json_parser *parser = &reader->parser;
+	struct json_reader_token *next;
+
+	/* the queue is only refilled once empty, so the data of the tokens
+	 * already handed out stay valid until then */
+	if (reader->queue_head == reader->queue_tail) {
+		if (reader->error)
+			return reader->error;
+		reader->queue_head = reader->queue_tail = 0;
+		reader->arena_offset = 0;
+	}
+
+	while (reader->queue_head == reader->queue_tail) {
+		int ret;
+
+		if (reader->input_offset == reader->input_valid) {
+			if (reader->input_valid < reader->input_length) {
+				reader->error = JSON_ERROR_UTF8;
+				return reader->error;
+			}
+			if (!reader->refill || reader->eof) {
+				if (!json_parser_is_done(parser)) {
+					reader->error = JSON_ERROR_INCOMPLETE;
+					return reader->error;
+				}
+				token->type = JSON_NONE;
+				token->data = NULL;
+				token->length = 0;
+				return 0;
+			}
+			/* a token can't point into a chunk the caller may release */
+			ret = direct_flush(parser);
+			if (!ret)
+				ret = reader->refill(reader->refill_userdata, &reader->input, &reader->input_length)
+					? JSON_ERROR_CALLBACK : 0;
+			if (ret) {
+				reader->error = ret;
+				return reader->error;
+			}
+			reader->input_offset = 0;
+			if (reader->input_length == 0)
+				reader->eof = 1;
+			/* utf8 is checked once per chunk, ahead of the scans */
+			reader->input_valid = utf8_validate(parser, reader->input, reader->input_length);
+			continue;
+		}
+
+		ret = parser_scan(parser, reader->input, &reader->input_offset, reader->input_valid);
+		if (ret) {
+			/* tokens before the error are still returned */
+			reader->error = ret;
+			if (reader->queue_head == reader->queue_tail)
+				return ret;
+			break;
+		}
+	}
+
+	next = &reader->queue[reader->queue_head++];
+	token->type = next->type;
+	token->data = (next->data) ? next->data : reader->arena + next->arena_offset;
+	token->length = next->length;
+	token->number = next->number;
+	return 0;
+}
+
+/** json_reader_free freed memory structure allocated by the reader */
+int json_reader_free(json_reader *reader)
+{
+	json_parser_free(&reader->parser);
+	free(reader->queue);
+	free(reader->arena);
+	reader->queue = NULL;
+	reader->arena = NULL;
+	return 0;
+}
+
 //////////////////////////////////////////////////////////////////////////////
 
 
@@ -2500,14 +10855,16 @@ char *string_of_errors[] =
 	[JSON_ERROR_UNICODE_UNEXPECTED_LOW_SURROGATE] = "unexpected unicode low surrogate",
 	[JSON_ERROR_COMMA_OUT_OF_STRUCTURE] = "error comma out of structure",
 	[JSON_ERROR_CALLBACK] = "error in a callback",
-	[JSON_ERROR_UTF8]     = "utf8 validation error"
+	[JSON_ERROR_UTF8]     = "utf8 validation error",
+	[JSON_ERROR_INCOMPLETE] = "unexpected end of document",
+	[JSON_ERROR_BASE64]   = "invalid base64 string",
 };
 
 static int printchannel(void *userdata, const char *data, uint32_t length)
 {
 	FILE *channel = userdata;
 	int ret;
-	ret = fwrite(data, length, 1, channel);
+	ret = fwrite(data, 1, length, channel);
 	if (ret != length)
 		return 1;
 	return 0;
@@ -2571,14 +10928,18 @@ static int do_verify(json_config *config, const char *filename)
 {
 	FILE *input;
 	json_parser parser;
+	json_config vconfig;
 	int ret;
 
 	input = open_filename(filename, "r", 1);
 	if (!input)
 		return 2;
 
-	/* initialize the parser structure. we don't need a callback in verify */
-	ret = json_parser_init(&parser, config, NULL, NULL);
+	/* initialize the parser structure. we don't need a callback nor any
+	 * buffering in verify */
+	memcpy(&vconfig, config, sizeof(vconfig));
+	vconfig.validate_only = 1;
+	ret = json_parser_init(&parser, &vconfig, NULL, NULL);
 	if (ret) {
 		fprintf(stderr, "error: initializing parser failed (code=%d): %s\n", ret, string_of_errors[ret]);
 		return ret;
@@ -2648,6 +11009,8 @@ static int do_format(json_config *config, const char *filename)
 
 	/* initialize printer and parser structures */
 	ret = json_print_init(&printer, printchannel, stdout);
+	if (!ret)
+		ret = json_print_set_buffer(&printer, LIBJSON_PRINTER_BUFFER_SIZE);
 	if (ret) {
 		fprintf(stderr, "error: initializing printer failed: [code=%d] %s\n", ret, string_of_errors[ret]);
 		return ret;
@@ -2663,6 +11026,8 @@ static int do_format(json_config *config, const char *filename)
 
 	ret = process_file(&parser, input, &lines, &col);
 	if (ret) {
+		/* what was printed up to the error */
+		json_print_free(&printer);
 		fprintf(stderr, "line %d, col %d: [code=%d] %s\n",
 		        lines, col, ret, string_of_errors[ret]);
 		return 1;
@@ -2670,6 +11035,7 @@ static int do_format(json_config *config, const char *filename)
 
 	ret = json_parser_is_done(&parser);
 	if (!ret) {
+		json_print_free(&printer);
 		fprintf(stderr, "syntax error\n");
 		return 1;
 	}
@@ -3088,6 +11454,154 @@ int format = 0, verify = 0, use_tree = 0, benchmarks = 0;
 
 }
 
+static int minifychannel(void *userdata, const char *data, uint32_t length)
+{
+	return fwrite(data, 1, length, userdata) != length;
+}
+
+int Minify(int argc, char **argv)
+{
+	json_minifier minifier;
+	FILE *input;
+	char buffer[65536];
+	size_t read;
+	int ret = 0;
+
+	if (argc < 2) {
+		fprintf(stderr, "error: no input file\n");
+		return 2;
+	}
+
+	input = open_filename(argv[1], "r", 1);
+	if (!input)
+		return 2;
+
+	json_minifier_init(&minifier, minifychannel, stdout);
+	while ((read = fread(buffer, 1, sizeof(buffer), input)) > 0) {
+		ret = json_minifier_string(&minifier, buffer, read);
+		if (ret)
+			break;
+	}
+	fwrite("\n", 1, 1, stdout);
+	close_filename(argv[1], input);
+
+	if (ret)
+		fprintf(stderr, "error: [code=%d] %s\n", ret, string_of_errors[ret]);
+	else
+		printf(ANSI_COLOR_GREEN   "DONE"   ANSI_COLOR_RESET "\n");
+	return ret;
+}
+
+int Serialize(int argc, char **argv)
+{
+	json_settings settings;
+	json_value *value;
+	int ret;
+
+	if (argc < 2) {
+		fprintf(stderr, "error: no input file\n");
+		return 2;
+	}
+
+	memset(&settings, 0, sizeof(settings));
+	settings.settings = json_enable_comments;
+	value = json_parse_file_cached(&settings, argv[1], NULL, NULL);
+	if (!value) {
+		fprintf(stderr, "error: %s couldn't be parsed\n", argv[1]);
+		return 1;
+	}
+
+	/* every online cpu prints a part of the tree */
+	fflush(stdout);
+	ret = json_value_write(value, fileno(stdout), 0);
+	json_value_free(value);
+	fwrite("\n", 1, 1, stdout);
+
+	if (ret)
+		fprintf(stderr, "error: %s\n", strerror(ret));
+	else
+		printf(ANSI_COLOR_GREEN   "DONE"   ANSI_COLOR_RESET "\n");
+	return ret;
+}
+
+int Patch(int argc, char **argv)
+{
+	char patchfile[FILENAME_SIZE], tmpfile[FILENAME_SIZE + 8];
+	char error[json_error_max];
+	json_value *value, *patch;
+	json_printer printer;
+	char *text;
+	size_t length;
+	FILE *output;
+	int ret;
+
+	if (argc < 2) {
+		fprintf(stderr, "error: no input file\n");
+		return 2;
+	}
+
+	printf("Enter JSON Patch file : ");
+	if (scanf("%1023s", patchfile) != 1)
+		return 1;
+
+	text = read_whole_file(patchfile, &length);
+	patch = text ? json_parse(text, length) : NULL;
+	free(text);
+	if (!patch) {
+		fprintf(stderr, "error: %s couldn't be parsed\n", patchfile);
+		return 1;
+	}
+
+	text = read_whole_file(argv[1], &length);
+	value = text ? json_parse(text, length) : NULL;
+	free(text);
+	if (!value) {
+		fprintf(stderr, "error: %s couldn't be parsed\n", argv[1]);
+		json_value_free(patch);
+		return 1;
+	}
+
+	/* all the operations in memory, then a single rewrite of the file */
+	if (!json_patch_apply(&value, patch, error)) {
+		fprintf(stderr, "error: %s, %s left unchanged\n", error, argv[1]);
+		json_value_free(value);
+		json_value_free(patch);
+		return 1;
+	}
+
+	snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", argv[1]);
+	output = fopen(tmpfile, "w");
+	if (!output) {
+		fprintf(stderr, "error: cannot write %s\n", tmpfile);
+		json_value_free(value);
+		json_value_free(patch);
+		return 1;
+	}
+
+	json_print_init(&printer, printchannel, output);
+	ret = json_print_set_buffer(&printer, LIBJSON_PRINTER_BUFFER_SIZE);
+	if (!ret)
+		ret = json_value_emit(value, prettyprint, &printer);
+	if (json_print_free(&printer) && !ret)
+		ret = 1;
+	fputc('\n', output);
+	if (fclose(output) && !ret)
+		ret = 1;
+
+	if (!ret && rename(tmpfile, argv[1]))
+		ret = 1;
+
+	json_value_free(value);
+	json_value_free(patch);
+
+	if (ret) {
+		remove(tmpfile);
+		fprintf(stderr, "error: cannot write %s\n", argv[1]);
+	} else
+		printf(ANSI_COLOR_GREEN   "DONE"   ANSI_COLOR_RESET "\n");
+	return ret;
+}
+
 static int do_errdet(json_config *config, const char *filename, const char *outputfile)
 {
 	FILE *input, *output;
@@ -3106,6 +11620,8 @@ static int do_errdet(json_config *config, const char *filename, const char *outp
 
 	/* initialize printer and parser structures */
 	ret = json_print_init(&printer, printchannel, stdout);
+	if (!ret)
+		ret = json_print_set_buffer(&printer, LIBJSON_PRINTER_BUFFER_SIZE);
 	if (ret) {
 		fprintf(stderr, "error: initializing printer failed: [code=%d] %s\n", ret, string_of_errors[ret]);
 		return ret;
@@ -3121,6 +11637,8 @@ static int do_errdet(json_config *config, const char *filename, const char *outp
 
 	ret = process_file(&parser, input, &lines, &col);
 	if (ret) {
+		/* what was printed up to the error */
+		json_print_free(&printer);
 		fprintf(stderr, "line %d, col %d: [code=%d] %s\n",
 		        lines, col, ret, string_of_errors[ret]);
 		return 1;
@@ -3128,6 +11646,7 @@ static int do_errdet(json_config *config, const char *filename, const char *outp
 
 	ret = json_parser_is_done(&parser);
 	if (!ret) {
+		json_print_free(&printer);
 		fprintf(stderr, "syntax error\n");
 		return 1;
 	}
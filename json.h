@@ -60,6 +60,14 @@ typedef struct
 
 #define json_enable_comments  0x01
 
+/* Identical subtrees of the parsed tree share one read-only copy, so equal
+ * subtrees are the same pointer; a shared value's parent is that of its
+ * first occurrence.  The copy is one block from mem_alloc, released by
+ * json_value_free_ex with the same settings as usual.  Ignored when
+ * value_extra is set.
+ */
+#define json_enable_dedupe    0x02
+
 typedef enum
 {
    json_none,
@@ -268,6 +276,73 @@ int update(int argc, char **argv);
 void json_value_free_ex (json_settings * settings,
                          json_value *);
 
+/* Checks a document without building the tree or allocating anything.
+ * This is json_parse_ex's own first pass, so the verdict and the error
+ * message are the ones json_parse_ex gives with the same settings, except
+ * that nesting deeper than LIBJSON_VALIDATE_STACK_SIZE levels is rejected
+ * and max_memory is not checked.
+ * Returns 1 if the document is valid, 0 otherwise with a
+ * "line:col: message" description in error_buf.
+ */
+int json_validate_ex (json_settings * settings,
+                      const json_char * json,
+                      size_t length,
+                      char * error_buf);
+
+/* Parse a file through the on-disk parse cache: a compact image of the tree
+ * is kept next to the file (or in cache_dir when not null) and is read back
+ * in one block instead of re-parsing while the file's size, mtime and
+ * content hash still match.  The result is released with json_value_free as usual.
+ */
+json_value * json_parse_file_cached (json_settings * settings,
+                                     const char * filename,
+                                     const char * cache_dir,
+                                     char * error);
+
+/* Relocatable images: a tree compacted into one position-independent block
+ * (offsets instead of pointers) that can be published in POSIX shared
+ * memory and read by other processes without copying or parsing.
+ *
+ * Values returned by the accessors live inside the block: their type,
+ * length and scalar fields are valid, but their pointer fields hold offsets
+ * and must only be followed through the json_image_* accessors.
+ */
+typedef struct _json_image json_image;
+
+json_image * json_image_create (const json_value *);
+void json_image_free (json_image *);
+size_t json_image_size (const json_image *);
+
+/* Publish under a shm_open name (e.g. "/config"), replacing any previous
+ * image of that name.  The image is written to an object of its own
+ * (<name>.<generation>) and the name is switched to it once it is complete,
+ * so readers always attach to a whole image; those attached to the previous
+ * one keep it until they detach.  Returns 0 or an errno value (ENOSYS
+ * without POSIX shared memory and atomics).  json_image_attach returns null
+ * with errno ENOENT when nothing was ever published under name, EAGAIN
+ * while the first image is on its way.
+ */
+int json_image_publish (const char * name, const json_value *);
+json_image * json_image_attach (const char * name);
+void json_image_detach (json_image *);
+int json_image_unlink (const char * name);
+
+const json_value * json_image_root (const json_image *);
+const json_value * json_image_parent (const json_image *, const json_value *);
+const json_value * json_image_array_get (const json_image *,
+                                         const json_value * array,
+                                         unsigned int index);
+const json_char * json_image_object_key (const json_image *,
+                                         const json_value * object,
+                                         unsigned int index);
+const json_value * json_image_object_value (const json_image *,
+                                            const json_value * object,
+                                            unsigned int index);
+const json_value * json_image_object_get (const json_image *,
+                                          const json_value * object,
+                                          const json_char * key);
+const json_char * json_image_string (const json_image *, const json_value *);
+
 
 #ifdef __cplusplus
    } /* extern "C" */
@@ -319,6 +394,9 @@ typedef enum
 	JSON_FALSE,
 	JSON_NULL,
 	JSON_BSTRING,
+	JSON_DOCUMENT_END, /* a root value completed, in multi_document mode */
+	JSON_STRING_PART,  /* leading piece of a string, in partial_strings mode */
+	JSON_KEY_PART,     /* leading piece of a key, in partial_strings mode */
 } jlint_type;
 
 typedef enum
@@ -350,14 +428,65 @@ typedef enum
 	JSON_ERROR_CALLBACK,
 	/* utf8 stream is invalid */
 	JSON_ERROR_UTF8,
+	/* document ended before the top level value was complete */
+	JSON_ERROR_INCOMPLETE,
+	/* a binary string isn't valid base64 */
+	JSON_ERROR_BASE64,
 } json_error;
 
+/* returned by a parser callback on JSON_KEY to have the value of the key
+ * passed over, or on JSON_OBJECT_BEGIN / JSON_ARRAY_BEGIN to have the
+ * content of the structure passed over (its END event is still reported).
+ * a skipped value is only scanned for quotes and brackets: it isn't checked,
+ * buffered, nor reported. returned for any other event, it's an error. */
+#define JSON_CALLBACK_SKIP 0x100
+
+/* returned by a parser callback on JSON_KEY to have the value of the key,
+ * if it is a string, decoded from base64 (either alphabet, padded or not)
+ * and reported as JSON_BSTRING */
+#define JSON_CALLBACK_BINARY 0x101
+
+/* base64 alphabets, json_printer.base64 and json_base64_encode */
+#define JSON_BASE64     1 /* standard, padded */
+#define JSON_BASE64_URL 2 /* url and filename safe, unpadded */
+
+/* room json_base64_encode needs for length bytes */
+#define JSON_BASE64_LENGTH(length) (((length) + 2) / 3 * 4)
+
 #define LIBJSON_DEFAULT_STACK_SIZE 256
 #define LIBJSON_DEFAULT_BUFFER_SIZE 4096
+#define LIBJSON_VALIDATE_STACK_SIZE 1024
+#define LIBJSON_PARTIAL_MIN_BUFFER_SIZE 64
+#define LIBJSON_PRINTER_BUFFER_SIZE 65536
 
 typedef int (*json_parser_callback)(void *userdata, int type, const char *data, uint32_t length);
 typedef int (*json_printer_callback)(void *userdata, const char *s, uint32_t length);
 
+/* number converted by the parser. i is exact for JSON_INT unless overflow
+ * is set, in which case it is saturated and d holds the nearest double.
+ * overflow on a JSON_FLOAT means it is out of the range of a double.
+ * raw always points to the text of the number (not nul terminated) */
+typedef struct json_number {
+	int type; /* JSON_INT or JSON_FLOAT */
+	int overflow;
+	int64_t i;
+	double d;
+	const char *raw;
+	uint32_t raw_length;
+} json_number;
+
+typedef int (*json_parser_number_callback)(void *userdata, const json_number *number);
+
+/* batched event: token data is at arena + offset, nul terminated */
+typedef struct json_event {
+	uint32_t type;
+	uint32_t offset;
+	uint32_t length;
+} json_event;
+
+typedef int (*json_parser_batch_callback)(void *userdata, const json_event *events,
+                                          uint32_t nr_events, const char *arena);
+
 typedef struct {
 	uint32_t buffer_initial_size;
 	uint32_t max_nesting;
@@ -366,6 +495,21 @@ typedef struct {
 	int allow_yaml_comments;
 	void * (*user_calloc)(size_t nmemb, size_t size);
 	void * (*user_realloc)(void *ptr, size_t size);
+	/* only check the document: no parse buffer, no callbacks */
+	int validate_only;
+	/* tokens needing no unescaping are passed to the callback as pointers
+	 * into the chunk given to json_parser_string, without the terminating
+	 * nul, as long as they don't cross a chunk boundary */
+	int zero_copy;
+	/* accept a stream of root values, concatenated or RFC 7464 delimited
+	 * (record separator 0x1e before each one): JSON_DOCUMENT_END follows
+	 * every one of them and the parser is ready for the next */
+	int multi_document;
+	/* strings that don't fit the parse buffer are delivered as a sequence
+	 * of JSON_STRING_PART (or JSON_KEY_PART) events, cut on utf8 character
+	 * boundaries, followed by the usual JSON_STRING (or JSON_KEY) with the
+	 * rest. the buffer keeps its initial size however long the strings */
+	int partial_strings;
 } json_config;
 
 typedef struct json_parser {
@@ -374,15 +518,42 @@ typedef struct json_parser {
 	/* SAJ callback */
 	json_parser_callback callback;
 	void *userdata;
+	json_parser_number_callback number_callback;
+
+	/* batched events, and the arena holding their data */
+	json_parser_batch_callback batch_callback;
+	json_event *batch;
+	uint32_t batch_size;
+	uint32_t batch_count;
+	char *arena;
+	uint32_t arena_size;
+	uint32_t arena_offset;
 
 	/* parser state */
 	uint8_t state;
 	uint8_t save_state;
 	uint8_t expecting_key;
 	uint8_t utf8_multibyte_left;
+	uint8_t utf8_next_min; /* bounds of the next continuation byte */
+	uint8_t utf8_next_max;
 	uint16_t unicode_multi;
+	uint16_t unicode_value; /* \uXXXX accumulator in validate_only mode */
 	jlint_type type;
 
+	/* number being converted as it is scanned, for the number callback
+	 * and the reader: up to 19 significant digits, and the power of ten
+	 * they are to be scaled by */
+	struct json_number_scan {
+		uint64_t mantissa;
+		int digits;
+		int scale;
+		int exponent;
+		uint8_t negative;
+		uint8_t fraction;
+		uint8_t in_exponent;
+		uint8_t exponent_negative;
+	} number;
+
 	/* state stack */
 	uint8_t *stack;
 	uint32_t stack_offset;
@@ -392,6 +563,21 @@ typedef struct json_parser {
 	char *buffer;
 	uint32_t buffer_size;
 	uint32_t buffer_offset;
+
+	/* zero_copy token still in the caller's chunk */
+	const char *direct_ptr;
+	uint32_t direct_length;
+
+	/* the next string is base64 on JSON_CALLBACK_BINARY */
+	uint8_t binary;
+
+	/* value passed over on JSON_CALLBACK_SKIP */
+	uint8_t skip;
+	uint8_t skip_flags;
+	uint32_t skip_depth;
+
+	/* pull reader taking the tokens in place of the callbacks */
+	struct json_reader *reader;
 } json_parser;
 
 typedef struct json_printer {
@@ -403,6 +589,19 @@ typedef struct json_printer {
 	int afterkey;
 	int enter_object;
 	int first;
+	int instring; /* a string is opened by its parts and not yet closed */
+	int ascii_only; /* escape non-ascii characters of strings as \uXXXX */
+	int base64;     /* JSON_BSTRING as JSON_BASE64(_URL) rather than latin1 */
+
+	/* output gathered before going to the callback */
+	char *buffer;
+	uint32_t buffer_size;
+	uint32_t buffer_offset;
+
+	/* a newline followed by indentstr repeated indent_levels times */
+	char *indent;
+	const char *indent_str;
+	int indent_levels;
 } json_printer;
 
 /** json_parser_init initialize a parser structure taking a config,
@@ -414,6 +613,22 @@ int json_parser_init(json_parser *parser, json_config *cfg,
 /** json_parser_free freed memory structure allocated by the parser */
 int json_parser_free(json_parser *parser);
 
+/** json_parser_set_number_callback delivers numbers converted to int64 or
+ * double to callback (with the same userdata) instead of JSON_INT and
+ * JSON_FLOAT events, in document order: batched events before a number are
+ * handed over first. numbers are converted as they are scanned, and
+ * conversion doesn't depend on the locale. a reader's parser doesn't use
+ * it: its number tokens carry the converted number */
+int json_parser_set_number_callback(json_parser *parser, json_parser_number_callback callback);
+
+/** json_parser_set_batch switches the parser to batched events: instead of
+ * one callback per token, records are appended to the events array (of
+ * nr_events entries) and callback is called with the whole batch when it
+ * is full and at the end of every json_parser_string call. the arena and
+ * the events are reused after the callback returns */
+int json_parser_set_batch(json_parser *parser, json_event *events, uint32_t nr_events,
+                          json_parser_batch_callback callback);
+
 /** json_parser_string append a string s with a specific length to the parser
  * return 0 if everything went ok, a JSON_ERROR_* otherwise.
  * the user can supplied a valid processed pointer that will
@@ -421,20 +636,70 @@ int json_parser_free(json_parser *parser);
 int json_parser_string(json_parser *parser, const char *string,
                        uint32_t length, uint32_t *processed);
 
+/** json_validate checks that s holds exactly one well-formed document
+ * (structure, escapes, numbers and utf8) without allocating or buffering
+ * anything. nesting is limited to LIBJSON_VALIDATE_STACK_SIZE levels.
+ * return 0 if the document is valid, a JSON_ERROR_* otherwise, in which
+ * case error_offset (if not NULL) is set to the offset of the faulty byte */
+int json_validate(json_config *config, const char *s, uint32_t length, uint32_t *error_offset);
+
+/** streaming minifier state: whether the previous chunk ended inside a
+ * string, and right after a backslash in it */
+typedef struct json_minifier {
+	json_printer_callback callback;
+	void *userdata;
+
+	int in_string;
+	int escaped;
+} json_minifier;
+
+/** json_minify copies length bytes of in to out without the whitespace
+ * outside of strings; out may be in itself. the document isn't validated.
+ * return the number of bytes written to out */
+uint32_t json_minify(char *out, const char *in, uint32_t length);
+
+/** json_minifier_init initialize a streaming minifier writing through callback */
+int json_minifier_init(json_minifier *minifier, json_printer_callback callback, void *userdata);
+
+/** json_minifier_string minify the next chunk of a document, documents may
+ * be split anywhere. return JSON_ERROR_CALLBACK if the callback failed */
+int json_minifier_string(json_minifier *minifier, const char *s, uint32_t length);
+
+/** json_base64_encode writes length bytes of in to out as base64 in the
+ * JSON_BASE64 or JSON_BASE64_URL alphabet. out needs JSON_BASE64_LENGTH(length)
+ * bytes. return the number of characters written */
+uint32_t json_base64_encode(char *out, const char *in, uint32_t length, int variant);
+
+/** json_base64_decode writes the bytes encoded by length base64 characters
+ * of in, in either alphabet and with or without padding, to out, which may
+ * be in itself. return JSON_ERROR_BASE64 if in isn't valid base64 or SUCCESS */
+int json_base64_decode(char *out, uint32_t *out_length, const char *in, uint32_t length);
+
 /** json_parser_char append one single char to the parser
  * return 0 if everything went ok, a JSON_ERROR_* otherwise */
 int json_parser_char(json_parser *parser, unsigned char next_char);
 
-/** json_parser_is_done return 0 is the parser isn't in a finish state. !0 if it is */
+/** json_parser_is_done return 0 is the parser isn't in a finish state. !0 if it is.
+ * in multi_document mode, the parser is done when between two documents */
 int json_parser_is_done(json_parser *parser);
 
 /** json_print_init initialize a printer context. always succeed */
 int json_print_init(json_printer *printer, json_printer_callback callback, void *userdata);
 
-/** json_print_free free a printer context
- * doesn't do anything now, but in future print_init could allocate memory */
+/** json_print_free free a printer context, flushing its buffer first.
+ * return the callback error of the flush if any */
 int json_print_free(json_printer *printer);
 
+/** json_print_set_buffer has the printer gather its output in a buffer of
+ * size bytes, passed to the callback only when full and on json_print_flush.
+ * a size of 0 goes back to one callback per piece of output.
+ * return JSON_ERROR_NO_MEMORY if allocation failed or SUCCESS */
+int json_print_set_buffer(json_printer *printer, uint32_t size);
+
+/** json_print_flush pass the buffered output to the callback.
+ * return the callback error if any */
+int json_print_flush(json_printer *printer);
+
 /** json_print_pretty pretty print the passed argument (type/data/length). */
 int json_print_pretty(json_printer *printer, int type, const char *data, uint32_t length);
 
@@ -448,6 +713,54 @@ int json_print_raw(json_printer *printer, int type, const char *data, uint32_t l
  * the function call should always be terminated by -1 */
 int json_print_args(json_printer *, int (*f)(json_printer *, int, const char *, uint32_t), ...);
 
+/* slots of a template, given to json_template_compile where a value goes */
+#define JSON_SLOT_INT    0x200 /* json_slot.i */
+#define JSON_SLOT_FLOAT  0x201 /* json_slot.d, null if not finite */
+#define JSON_SLOT_STRING 0x202 /* json_slot.s and .length, escaped */
+#define JSON_SLOT_BOOL   0x203 /* json_slot.b */
+#define JSON_SLOT_RAW    0x204 /* json_slot.s and .length, already json */
+
+/* the value of a slot, by the type it was compiled with. a length of -1
+ * is the strlen of s */
+typedef struct {
+	int64_t i;
+	double d;
+	int b;
+	const char *s;
+	uint32_t length;
+} json_slot;
+
+/* a document printed once, keys and punctuation included, with the places
+ * of its slots */
+typedef struct json_template {
+	char *text;
+	uint32_t text_length;
+	uint32_t text_size;
+	struct json_template_slot {
+		uint32_t offset; /* in text */
+		int type;
+	} *slots;
+	uint32_t slot_count;
+	uint32_t slot_size;
+	int pretty;
+	int failed;
+} json_template;
+
+/** json_template_compile prints a skeleton into tpl, with the arguments of
+ * json_print_args (f is json_print_pretty or json_print_raw) plus
+ * JSON_SLOT_* types, which take no argument, where values are left open.
+ * return JSON_ERROR_NO_MEMORY if memory allocation failed or SUCCESS */
+int json_template_compile(json_template *tpl, int (*f)(json_printer *, int, const char *, uint32_t), ...);
+
+/** json_template_render prints tpl to printer as one value, the i-th slot
+ * filled from slots[i]. a pretty template keeps the indentation it was
+ * compiled with. tpl isn't modified and may be shared between threads.
+ * return the printer callback error if any */
+int json_template_render(const json_template *tpl, json_printer *printer, const json_slot *slots);
+
+/** json_template_free freed memory structure allocated by the template */
+void json_template_free(json_template *tpl);
+
 /** callback from the parser_dom callback to create object and array */
 typedef void * (*json_parser_dom_create_structure)(int, int);
 
@@ -491,6 +804,207 @@ int json_parser_dom_free(json_parser_dom *ctx);
 /** helper to parser callback that arrange parsing events into comprehensive JSON data structure */
 int json_parser_dom_callback(void *userdata, int type, const char *data, uint32_t length);
 
+/** batch callback version of json_parser_dom_callback */
+int json_parser_dom_batch_callback(void *userdata, const json_event *events,
+                                   uint32_t nr_events, const char *arena);
+
+/** field types understood by the schema decoder */
+typedef enum
+{
+	JSON_FIELD_INT,    /* int64_t */
+	JSON_FIELD_DOUBLE, /* double, also accepts integers */
+	JSON_FIELD_BOOL,   /* int */
+	JSON_FIELD_STRING, /* char[size], truncated to fit and always nul terminated */
+	JSON_FIELD_OBJECT, /* nested struct described by the nested schema */
+} json_field_type;
+
+/** one member of a struct: the JSON key, how to store it, and where */
+typedef struct json_field
+{
+	const char *key;
+	json_field_type type;
+	size_t offset;
+	size_t size;
+	const struct json_schema *nested;
+} json_field;
+
+#define JSON_SCHEMA_MAX_FIELDS 64
+#define JSON_SCHEMA_SLOTS      128
+#define JSON_SCHEMA_MAX_DEPTH  32
+
+/** a descriptor table plus its precomputed key hash table */
+typedef struct json_schema
+{
+	const json_field *fields;
+	uint32_t nr_fields;
+	uint8_t slots[JSON_SCHEMA_SLOTS]; /* field index + 1, 0 for an empty slot */
+} json_schema;
+
+/** decoding context: pass it as userdata with json_schema_callback */
+typedef struct json_schema_decoder
+{
+	const json_schema *schema;
+	void *target;
+
+	struct { const json_schema *schema; char *base; } stack[JSON_SCHEMA_MAX_DEPTH];
+	uint32_t depth;
+	const json_field *field; /* field selected by the last key, NULL if unknown */
+	uint32_t skip;           /* nesting of the unknown member being skipped */
+} json_schema_decoder;
+
+/** json_schema_init builds the key hash table of a descriptor table.
+ * the fields array must outlive the schema.
+ * return JSON_ERROR_DATA_LIMIT if there are more than JSON_SCHEMA_MAX_FIELDS fields */
+int json_schema_init(json_schema *schema, const json_field *fields, uint32_t nr_fields);
+
+/** json_schema_decoder_init prepares decoding of one document into target */
+int json_schema_decoder_init(json_schema_decoder *dec, const json_schema *schema, void *target);
+
+/** parser callback writing the members of the document straight into the
+ * target struct, without building a tree. unknown members are skipped,
+ * members of the wrong type fail with JSON_ERROR_CALLBACK */
+int json_schema_callback(void *userdata, int type, const char *data, uint32_t length);
+
+/** a token returned by json_reader_next. data isn't nul terminated and
+ * stays valid until the next call to json_reader_next. number is set on
+ * JSON_INT and JSON_FLOAT tokens, as the number callback gets it */
+typedef struct json_token
+{
+	int type;
+	const char *data;
+	uint32_t length;
+	json_number number;
+} json_token;
+
+/** input source of a reader: point data/length to the next chunk of input,
+ * or set length to 0 at the end of the input. the chunk must stay valid
+ * until the next refill. return non-zero to abort */
+typedef int (*json_reader_refill)(void *userdata, const char **data, uint32_t *length);
+
+typedef struct json_reader
+{
+	json_parser parser;
+
+	/* current input chunk, checked as utf8 up to input_valid */
+	const char *input;
+	uint32_t input_length;
+	uint32_t input_offset;
+	uint32_t input_valid;
+	json_reader_refill refill;
+	void *refill_userdata;
+	int eof;
+	int error;
+
+	/* tokens produced by the last scan and not returned yet */
+	struct json_reader_token { int type; const char *data; uint32_t length; uint32_t arena_offset; json_number number; } *queue;
+	uint32_t queue_size;
+	uint32_t queue_head;
+	uint32_t queue_tail;
+
+	/* copies of the string parts, which the parse buffer doesn't keep */
+	char *arena;
+	uint32_t arena_size;
+	uint32_t arena_offset;
+} json_reader;
+
+/** json_reader_init initialize a pull reader over the document s.
+ * return JSON_ERROR_NO_MEMORY if memory allocation failed or SUCCESS */
+int json_reader_init(json_reader *reader, json_config *config, const char *s, uint32_t length);
+
+/** json_reader_init_source initialize a pull reader over a refillable input */
+int json_reader_init_source(json_reader *reader, json_config *config,
+                            json_reader_refill refill, void *userdata);
+
+/** json_reader_next fill token with the next token of the document, in
+ * document order. a JSON_NONE token marks the end of a complete document.
+ * return 0 or a JSON_ERROR_*, which is then returned by all further calls */
+int json_reader_next(json_reader *reader, json_token *token);
+
+/** json_reader_free freed memory structure allocated by the reader */
+int json_reader_free(json_reader *reader);
+
+/** json_value_emit replays a parsed json_value tree as parser events, so any
+ * parser callback (printer, dom helper...) can consume an already parsed tree */
+int json_value_emit(const json_value *value, json_parser_callback callback, void *userdata);
+
+/** json_value_write writes value to fd as compact json. large trees are cut
+ * into subtrees printed on threads threads (0 for one per online cpu) and
+ * written in document order with writev.
+ * return 0, or an errno value: ENOMEM, EDOM for a NaN or infinite number
+ * (nothing is written then), a write error, or ENOSYS without POSIX
+ * threads */
+int json_value_write(const json_value *value, int fd, int threads);
+
+/** json_value_canonical writes value in the canonical form of RFC 8785:
+ * compact, object members sorted by the UTF-16 code units of their names,
+ * numbers written as ECMAScript writes a double, minimal escapes.
+ * return 0, ENOMEM, EDOM for a NaN or infinite number, or the callback error */
+int json_value_canonical(const json_value *value, json_printer_callback callback, void *userdata);
+
+/** json_value_hash sets hash to the XXH64 with seed of the canonical text of
+ * value, computed while walking the tree, without building the text. NaN and
+ * infinities hash as null. return 0 or ENOMEM */
+int json_value_hash(const json_value *value, uint64_t seed, uint64_t *hash);
+
+/** json_value_hash128 the same walk feeding two XXH64, seeded with 0 and
+ * 0x9E3779B185EBCA87, into hash[0] and hash[1]. return 0 or ENOMEM */
+int json_value_hash128(const json_value *value, uint64_t hash[2]);
+
+/** json_value_diff emits as parser events the JSON Patch (RFC 6902) that turns
+ * from into to: an array of add, remove and replace operations. subtrees with
+ * equal hashes are skipped without being entered, array elements are matched
+ * by hash. return 0, ENOMEM or the callback error */
+int json_value_diff(const json_value *from, const json_value *to, json_parser_callback callback, void *userdata);
+
+/** json_patch_apply applies a JSON Patch (RFC 6902: add, remove, replace, move,
+ * copy, test) to *doc in place, all or nothing. the values it adds and drops
+ * are allocated and freed with malloc and free, like json_value_free does;
+ * an image or deduplicated tree is replaced by an edited copy. return 1, or
+ * 0 with "op N: message" in error (json_error_max bytes, may be null) and
+ * *doc unchanged */
+int json_patch_apply(json_value **doc, const json_value *patch, char *error);
+
+/** json_patch_apply_ex is json_patch_apply for a tree from json_parse_ex:
+ * memory goes through the mem_alloc and mem_free of settings, and added
+ * values get value_extra bytes like parsed ones */
+int json_patch_apply_ex(json_settings *settings, json_value **doc, const json_value *patch, char *error);
+
+/** json_store keeps a document in a file and its edits in an append-only log
+ * beside it (<file>.log), so an edit costs the size of its patch on disk.
+ * the log is fsynced every 64 edits and on json_store_sync, replayed on open,
+ * and folded into a new base file once it outgrows the base, on a thread
+ * where there are POSIX threads. needs POSIX file I/O */
+typedef struct _json_store json_store;
+
+/** json_store_open reads filename and replays its log. return the store, or
+ * null with a message in error (json_error_max bytes, may be null). a log
+ * written for another version of the file is left alone and fails the open */
+json_store *json_store_open(const char *filename, char *error);
+
+/** json_store_root the current document, owned by the store */
+const json_value *json_store_root(const json_store *store);
+
+/** json_store_patch applies a JSON Patch to the document and appends it to the
+ * log. return 0 once the edit is applied and logged, EINVAL with the message
+ * in error when the patch does not apply (nothing changes), or an errno value;
+ * after a write error the edit is only in memory and the store takes no more.
+ * an error of the batched fsync or of the automatic compaction that follow a
+ * logged edit is returned by the next json_store_sync or json_store_close */
+int json_store_patch(json_store *store, const json_value *patch, char *error);
+
+/** json_store_sync makes every edit so far durable. return 0 or an errno value,
+ * also for a write error that stopped the store or an error held over from
+ * json_store_patch */
+int json_store_sync(json_store *store);
+
+/** json_store_compact starts writing the document as the new base file. return
+ * 0 or an errno value */
+int json_store_compact(json_store *store);
+
+/** json_store_close waits for a compaction, syncs the log and frees the store.
+ * return 0 or an errno value, as json_store_sync */
+int json_store_close(json_store *store);
+
 #ifdef __cplusplus
 }
 #endif
@@ -499,6 +1013,9 @@ int json_parser_dom_callback(void *userdata, int type, const char *data, uint32_
 
 
 int Export(int argc, char **argv);
+int Minify(int argc, char **argv);
+int Serialize(int argc, char **argv);
+int Patch(int argc, char **argv);
 static int do_format(json_config *config, const char *filename);
 static int do_parse(json_config *config, const char *filename);
 static int do_verify(json_config *config, const char *filename);
@@ -42,7 +42,6 @@ int main(int argc, char** argv)
         struct stat filestatus;
         int file_size;
         char* file_contents;
-        json_char* json;
         json_value* value;
 
         if (argc != 2) {
@@ -81,9 +80,8 @@ int main(int argc, char** argv)
 
         printf("<-----------------+ EXECUTION +----------------->\n\n");
 
-        json = (json_char*)file_contents;
-
-        value = json_parse(json,file_size);
+        /* unchanged files are mapped from the parse cache instead of re-parsed */
+        value = json_parse_file_cached(NULL, filename, NULL, NULL);
 
         if (value == NULL) {
                 
@@ -116,8 +114,18 @@ int main(int argc, char** argv)
     printf("10) "ANSI_COLOR_CYAN   "Export to Json"   ANSI_COLOR_RESET "\n");
     printf("11) "ANSI_COLOR_CYAN   "Updatev2.0"   ANSI_COLOR_RESET "\n");
     printf("12) Quit\n");
+    printf("13) "ANSI_COLOR_CYAN   "Minify"   ANSI_COLOR_RESET "\n");
+    printf("14) "ANSI_COLOR_CYAN   "Serialize"   ANSI_COLOR_RESET "\n");
+    printf("15) "ANSI_COLOR_CYAN   "Patch"   ANSI_COLOR_RESET "\n");
     printf("Enter Choice: ");
-    scanf("%d", &choice);
+    /* at the end of scripted input, stop instead of repeating the last
+     * choice with whatever the tools read from a closed stdin */
+    if (scanf("%d", &choice) != 1) {
+      if (feof(stdin))
+        exit(0);
+      scanf("%*s");
+      continue;
+    }
     
     
     switch (choice)
@@ -181,6 +189,24 @@ int main(int argc, char** argv)
         printf("_________________________________\n\n");
         exit(0);
         
+          case 13:
+        Minify(argc,argv);
+      printf("\n");
+        printf("\n");
+        break;
+      
+          case 14:
+        Serialize(argc,argv);
+      printf("\n");
+        printf("\n");
+        break;
+      
+          case 15:
+        Patch(argc,argv);
+      printf("\n");
+        printf("\n");
+        break;
+      
     }
     
   }